@@ -0,0 +1,226 @@
+//
+// This file is part of the liboh project
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Compares loopback UDP with unix domain datagram sockets. For every
+// transport, a ping-pong test measures the round trip latency and a bulk
+// test measures how many datagrams per second reach the receiver.
+//
+// usage: LocalBench [round trips] [bulk datagrams] [datagram size]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <o.h>
+#include <thread>
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+template <typename Protocol>
+using device = o::io::net::datagram_device<Protocol, std::string,
+                                           o::ccy::unsafe>;
+
+// Echoes every datagram back to its sender, or only counts it.
+template <typename Protocol>
+class server : public device<Protocol> {
+
+  public:
+    using endpoint_type = typename Protocol::endpoint;
+
+    server(boost::asio::io_context& ctx, bool echo)
+        : device<Protocol>(ctx), echo_(echo) {}
+
+    void on_dgram_received_from(const endpoint_type& remote,
+                                std::string&& message) override {
+        received.fetch_add(1, std::memory_order_relaxed);
+        if (echo_) this->dgram_write(remote, std::move(message));
+    }
+
+    // remember when the last batch arrived, once per batch to keep the
+    // clock out of the per datagram cost
+    void on_dgram_batch(
+        const o::io::net::dgram_batch<Protocol>& batch) override {
+        device<Protocol>::on_dgram_batch(batch);
+        last_received.store(clock_type::now().time_since_epoch().count(),
+                            std::memory_order_relaxed);
+    }
+
+    void on_dgram_received(std::string&&) override {}
+
+    void on_dgram_sent() override {}
+
+    std::atomic<std::size_t> received{0};
+    std::atomic<clock_type::rep> last_received{0};
+
+  private:
+    bool echo_;
+};
+
+template <typename Protocol>
+class client : public device<Protocol> {
+
+  public:
+    using endpoint_type = typename Protocol::endpoint;
+
+    client(boost::asio::io_context& ctx, endpoint_type remote)
+        : device<Protocol>(ctx), remote_(remote) {}
+
+    // send the first ping, every reply sends the next one
+    void ping(std::size_t count, std::size_t size) {
+        remaining_ = count;
+        payload_.assign(size, 'x');
+
+        if (remaining_)
+            send_ping();
+        else
+            this->dgram_sock_close();
+    }
+
+    void on_dgram_received(std::string&&) override {
+        rtt.record(clock_type::now() - sent_at_);
+        if (--remaining_) return send_ping();
+        this->dgram_sock_close();
+    }
+
+    void on_dgram_sent() override {}
+
+    o::io::histogram rtt;
+
+  private:
+    void send_ping() {
+        sent_at_ = clock_type::now();
+        this->dgram_write(remote_, std::string(payload_));
+    }
+
+    endpoint_type remote_;
+    std::string payload_;
+    std::size_t remaining_ = 0;
+    clock_type::time_point sent_at_;
+};
+
+template <typename Protocol>
+void run(const char* name, typename Protocol::endpoint server_endp,
+         typename Protocol::endpoint client_endp, std::size_t round_trips,
+         std::size_t bulk, std::size_t size) {
+
+    // latency
+    {
+        boost::asio::io_context server_ctx(1), client_ctx(1);
+        server<Protocol> srv(server_ctx, true);
+        client<Protocol> cli(client_ctx, server_endp);
+
+        srv.dgram_sock_bind(server_endp);
+        cli.dgram_sock_bind(client_endp);
+
+        std::thread server_thread([&]() { server_ctx.run_for(30s); });
+
+        cli.ping(round_trips, size);
+        client_ctx.run_for(30s);
+
+        // the socket belongs to the server thread
+        boost::asio::post(server_ctx, [&]() { srv.dgram_sock_close(); });
+        server_thread.join();
+
+        std::cout << name << " round trip (" << cli.rtt.count()
+                  << " samples, ns):\n";
+        cli.rtt.write_summary(std::cout);
+        std::cout << "\n";
+    }
+
+    // throughput
+    {
+        boost::asio::io_context server_ctx(1), client_ctx(1);
+        server<Protocol> srv(server_ctx, false);
+        client<Protocol> cli(client_ctx, server_endp);
+
+        srv.dgram_receive_batched(64, size);
+        srv.dgram_sock_bind(server_endp);
+        cli.dgram_send_batched(64);
+        cli.dgram_sock_bind(client_endp);
+
+        std::thread server_thread([&]() { server_ctx.run_for(30s); });
+
+        auto start = clock_type::now();
+        std::string payload(size, 'x');
+
+        for (std::size_t i = 0; i < bulk; ++i) {
+            cli.dgram_write(server_endp, std::string(payload));
+
+            // let the queue drain every now and then
+            if (i % 1024 == 1023) client_ctx.poll();
+        }
+
+        // flush the queue and give the server time to catch up, this is
+        // not part of the measurement
+        client_ctx.run_for(100ms);
+
+        boost::asio::post(server_ctx, [&]() { srv.dgram_sock_close(); });
+        server_thread.join();
+
+        auto received = srv.received.load();
+        auto last = clock_type::time_point(
+            clock_type::duration(srv.last_received.load()));
+        auto secs = std::chrono::duration<double>(last - start).count();
+
+        std::cout << name << " bulk: " << received << " of " << bulk
+                  << " datagrams received, "
+                  << static_cast<std::size_t>(secs > 0 ? received / secs : 0)
+                  << " per second\n\n";
+    }
+}
+
+int main(int argc, char** argv) {
+
+    auto arg = [&](int i, std::size_t fallback) -> std::size_t {
+        return argc > i ? std::strtoul(argv[i], nullptr, 10) : fallback;
+    };
+
+    auto round_trips = arg(1, 100000);
+    auto bulk = arg(2, 1000000);
+    auto size = arg(3, 64);
+
+    using udp = boost::asio::ip::udp;
+    auto loopback = boost::asio::ip::address_v4::loopback();
+
+    run<udp>("udp", udp::endpoint(loopback, 47100),
+             udp::endpoint(loopback, 47101), round_trips, bulk, size);
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+    namespace local = o::io::net::local;
+
+#if defined(O_NET_LINUX)
+    auto server_endp = local::abstract_endpoint("liboh-bench-server");
+    auto client_endp = local::abstract_endpoint("liboh-bench-client");
+#else
+    local::datagram_protocol::endpoint server_endp("/tmp/liboh-bench-server");
+    local::datagram_protocol::endpoint client_endp("/tmp/liboh-bench-client");
+    local::remove_stale(server_endp);
+    local::remove_stale(client_endp);
+#endif
+
+    run<local::datagram_protocol>("unix", server_endp, client_endp, round_trips,
+                                  bulk, size);
+#endif
+}
@@ -0,0 +1,92 @@
+//
+// This file is part of the liboh project
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Replays the udp datagrams of a capture file into a handler that parses
+// every datagram as a line of text and counts the distinct first words,
+// then reports the throughput and the time spent in the handler.
+//
+// usage: PcapReplay <file> [speed]
+//
+// Without a speed, the datagrams are replayed as fast as possible. With a
+// speed, they keep the recorded timing, scaled by the speed, which must be
+// positive.
+
+#include <cstdlib>
+#include <iostream>
+#include <o.h>
+#include <unordered_map>
+
+class counter : public o::io::net::datagram_device<boost::asio::ip::udp,
+                                                   std::string,
+                                                   o::ccy::none> {
+
+  public:
+    using datagram_device::datagram_device;
+
+    void on_dgram_received_from(const endpoint_type& remote,
+                                std::string&& message) override {
+        ++words[message.substr(0, message.find_first_of(" \n"))];
+    }
+
+    void on_dgram_received(std::string&&) override {}
+
+    void on_dgram_sent() override {}
+
+    std::unordered_map<std::string, std::size_t> words;
+};
+
+int main(int argc, char** argv) {
+
+    double speed = argc > 2 ? std::strtod(argv[2], nullptr) : 1.0;
+
+    if (argc < 2 || !(speed > 0)) {
+        std::cerr << "usage: " << argv[0] << " <file> [speed]\n";
+        return 1;
+    }
+
+    boost::asio::io_context ctx;
+    counter handler(ctx);
+    o::io::net::pcap_replay<counter> replay(handler);
+
+    boost::system::error_code ec;
+    replay.open(argv[1], ec);
+
+    if (ec) {
+        std::cerr << argv[1] << ": " << ec.message() << "\n";
+        return 1;
+    }
+
+    if (argc > 2)
+        replay.replay(o::io::net::replay_timing::original, speed, ec);
+    else
+        replay.replay(ec);
+
+    if (ec) std::cerr << argv[1] << ": " << ec.message() << "\n";
+
+    replay.write_report(std::cout);
+    std::cout << "distinct first words: " << handler.words.size() << "\n";
+
+    return ec ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+//
+// This file is part of the liboh project
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// A line based tcp echo server. Every complete line a client sends is
+// written back, incomplete lines wait in the read buffer of the session.
+//
+// usage: StreamEcho [port] [threads]
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <o.h>
+
+using tcp = boost::asio::ip::tcp;
+
+class echo_session
+    : public o::io::net::server::stream_session<tcp, std::string,
+                                                o::ccy::safe> {
+
+  public:
+    using stream_session::stream_session;
+
+    std::size_t on_sess_received(const char* data, std::size_t size) override {
+
+        std::size_t consumed = 0;
+
+        while (auto end = static_cast<const char*>(
+                   std::memchr(data + consumed, '\n', size - consumed))) {
+            write(std::string(data + consumed, end + 1));
+            consumed = end + 1 - data;
+        }
+
+        return consumed;
+    }
+};
+
+class echo_server
+    : public o::io::net::server::server_base<echo_session, o::ccy::safe> {
+
+    void on_server_error(boost::system::error_code ec) override {
+        std::cout << "error: " << ec.message() << std::endl;
+    }
+};
+
+int main(int argc, char** argv) {
+
+    auto port = argc > 1 ? std::atoi(argv[1]) : 7000;
+    auto threads = argc > 2 ? std::atoi(argv[2]) : 4;
+
+    echo_server server;
+
+    server.listen(tcp::endpoint(tcp::v4(), port));
+    server.start(threads);
+
+    std::cout << "listening on " << server.local_endpoint()
+              << ", press enter to stop" << std::endl;
+
+    std::cin.get();
+
+    server.shutdown();
+}
@@ -0,0 +1,78 @@
+//
+// This file is part of the liboh project
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Echoes the udp datagrams sent to port 6001 through io_uring for a number
+// of seconds, then reports the traffic.
+//
+// usage: UringEcho [seconds]
+//
+// The io_uring path is only built when configured with
+// -Dliboh_use_io_uring=ON, which needs liburing. Without it, or on kernels
+// without multishot receives, the device falls back to asio.
+
+#include <cstdlib>
+#include <iostream>
+#include <o.h>
+
+class uring_echo
+    : public o::io::net::uring_datagram_device<
+          boost::asio::ip::udp, std::string, o::ccy::unsafe,
+          o::sessions::features::statistics> {
+
+  public:
+    using uring_datagram_device::uring_datagram_device;
+
+    void on_dgram_received(std::string&& data) override {
+        this->dgram_reply(std::forward<std::string>(data));
+    }
+
+    void on_dgram_sent() override {}
+
+    void on_dgram_error(error_case eca,
+                        boost::system::error_code ec) override {
+        std::cerr << "error: " << ec.message() << "\n";
+    }
+};
+
+int main(int argc, char** argv) {
+
+    auto seconds = argc > 1 ? std::atoi(argv[1]) : 10;
+
+    boost::asio::io_context ctx;
+    uring_echo echo(ctx);
+
+    echo.dgram_uring_config(256, 256, 2048);
+    echo.dgram_sock_bind(6001);
+
+    ctx.run_for(std::chrono::seconds(seconds));
+
+    auto traffic = echo.traffic();
+
+    std::cout << (echo.dgram_uring_active() ? "io_uring" : "asio") << ": "
+              << traffic.packets_in << " datagrams in, "
+              << traffic.packets_out << " out\n";
+
+    echo.dgram_sock_close();
+}
@@ -1,3 +1,4 @@
 #pragma once
 
+#include "ccy/rcu_slot.h"
 #include "ccy/threads.h"
@@ -0,0 +1,224 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace o::ccy {
+
+    namespace detail {
+
+        // Index of the reader shard of the calling thread. Threads are
+        // spread round robin, so readers on different threads rarely
+        // share a counter.
+        inline std::size_t rcu_reader_index() noexcept {
+            static std::atomic<std::size_t> next{0};
+            thread_local const std::size_t index =
+                next.fetch_add(1, std::memory_order_relaxed);
+            return index;
+        }
+
+    } // namespace detail
+
+    /**
+     * Holds a value that is read on a hot path by many threads and replaced
+     * rarely, like a handler. Reading never blocks and only touches a
+     * counter of the calling thread. Writers are serialized with a mutex
+     * and publish a new copy of the value (read-copy-update).
+     *
+     * A replaced value can still be in use by a reader, so it is retired
+     * instead of destroyed. Readers announce themselves in one of two
+     * counters, chosen by the current epoch. The epoch only advances when
+     * the counters of the previous epoch dropped to zero, so a value that
+     * was retired two epochs ago cannot be held by any reader anymore and
+     * is destroyed. This happens on store(), reset() and collect(), none
+     * of which wait for readers.
+     *
+     * @tparam  T   Type of the value.
+     */
+    template <typename T>
+    class rcu_slot {
+
+        static constexpr std::size_t shard_count = 16;
+
+        struct alignas(64) reader_shard {
+            std::atomic<std::size_t> active[2] = {{0}, {0}};
+        };
+
+        struct retired_value {
+            std::unique_ptr<T> value;
+            std::uint64_t epoch;
+        };
+
+      public:
+        /**
+         * Access to the value of a slot. The value stays valid as long as
+         * the reader exists, even if the slot is changed meanwhile. Keep
+         * readers short lived, a reader that is never destroyed stops the
+         * slot from destroying retired values.
+         */
+        class reader {
+
+          public:
+            reader(const reader&) = delete;
+            reader& operator=(const reader&) = delete;
+
+            ~reader() {
+                counter_->fetch_sub(1, std::memory_order_release);
+            }
+
+            /** @returns The value or nullptr, if the slot is empty. */
+            const T* get() const noexcept { return value_; }
+
+            const T& operator*() const noexcept { return *value_; }
+            const T* operator->() const noexcept { return value_; }
+
+            /** @returns true if the slot held a value */
+            explicit operator bool() const noexcept {
+                return value_ != nullptr;
+            }
+
+          private:
+            friend class rcu_slot;
+
+            explicit reader(const rcu_slot& slot) {
+
+                auto& shard =
+                    slot.shards_[detail::rcu_reader_index() % shard_count];
+
+                counter_ = &shard.active[slot.epoch_.load() & 1];
+                counter_->fetch_add(1);
+                value_ = slot.current_.load();
+            }
+
+            std::atomic<std::size_t>* counter_;
+            const T* value_;
+        };
+
+        rcu_slot() = default;
+
+        rcu_slot(const rcu_slot&) = delete;
+        rcu_slot& operator=(const rcu_slot&) = delete;
+
+        ~rcu_slot() { delete current_.load(std::memory_order_relaxed); }
+
+        /**
+         * Read the current value.
+         *
+         * @returns A reader holding the value, which may be empty.
+         */
+        reader read() const noexcept { return reader(*this); }
+
+        /**
+         * Replace the value. Readers see either the old or the new value.
+         *
+         * @param   value   The new value.
+         */
+        void store(T value) { exchange_impl(new T(std::move(value))); }
+
+        /**
+         * Empty the slot.
+         */
+        void reset() { exchange_impl(nullptr); }
+
+        /**
+         * Destroy the retired values that no reader can hold anymore. Never
+         * waits for readers and is cheap if nothing is retired, so it can
+         * be called from the hot path, for example after each received
+         * datagram.
+         */
+        void collect() {
+
+            if (!retired_count_.load(std::memory_order_relaxed)) return;
+
+            std::unique_lock<std::mutex> lock(writer_mtx_, std::try_to_lock);
+
+            if (lock.owns_lock()) collect_impl();
+        }
+
+      private:
+        void exchange_impl(T* next) {
+
+            std::lock_guard<std::mutex> lock(writer_mtx_);
+
+            auto* prev = current_.exchange(next);
+
+            if (prev) {
+                retired_.push_back({std::unique_ptr<T>(prev), epoch_.load()});
+                retired_count_.store(retired_.size(),
+                                     std::memory_order_relaxed);
+            }
+
+            collect_impl();
+        }
+
+        // Advance the epoch as far as the readers allow, then destroy what
+        // was retired at least two epochs ago. Called with the writer mutex.
+        void collect_impl() {
+
+            for (int i = 0; i < 2 && !retired_.empty(); ++i) {
+
+                auto epoch = epoch_.load();
+
+                if (readers_impl((epoch + 1) & 1)) break;
+
+                epoch_.store(epoch + 1);
+            }
+
+            auto epoch = epoch_.load();
+
+            auto it = retired_.begin();
+
+            while (it != retired_.end() && it->epoch + 2 <= epoch) ++it;
+
+            retired_.erase(retired_.begin(), it);
+
+            retired_count_.store(retired_.size(), std::memory_order_relaxed);
+        }
+
+        bool readers_impl(std::uint64_t parity) const {
+
+            for (const auto& shard : shards_)
+                if (shard.active[parity].load()) return true;
+
+            return false;
+        }
+
+        std::atomic<T*> current_{nullptr};
+        std::atomic<std::uint64_t> epoch_{0};
+        mutable reader_shard shards_[shard_count];
+
+        std::mutex writer_mtx_;
+        std::vector<retired_value> retired_;
+        std::atomic<std::size_t> retired_count_{0};
+    };
+
+} // namespace o::ccy
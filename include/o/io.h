@@ -26,6 +26,7 @@
 #pragma once
 
 #include "io/endpoints.h"
+#include "io/histogram.h"
 #include "io/io_app_base.h"
 #include "io/io_signals.h"
 #include "io/messages.h"
@@ -33,4 +34,5 @@
 #include "io/sin_listener.h"
 #include "io/thread_pool.h"
 #include "io/timer.h"
+#include "io/timing_wheel.h"
 #include "io/writing.h"
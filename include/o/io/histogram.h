@@ -0,0 +1,265 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+/**
+ * @file
+ *
+ * A lock-free histogram for latency measurements
+ */
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+
+namespace o::io {
+
+    /**
+     * A histogram with logarithmic buckets, suitable to record latencies in
+     * nanoseconds. Every power of two is divided into 8 linear sub-buckets,
+     * so a recorded value is off by at most 12.5%. Recording is lock-free
+     * and may happen from multiple threads concurrently.
+     */
+    class histogram {
+
+      public:
+        /** number of linear sub-buckets per power of two */
+        static constexpr const std::size_t sub_buckets = 8;
+
+        /** total number of buckets. values below sub_buckets get a bucket of
+         * their own, above that every power of two up to 2^63 is split */
+        static constexpr const std::size_t bucket_count = 62 * sub_buckets;
+
+        histogram() { reset(); }
+
+        histogram(const histogram&) = delete;
+        histogram& operator=(const histogram&) = delete;
+
+        /**
+         * Record a single value
+         *
+         * @param   value   The value.
+         */
+        void record(std::uint64_t value) {
+            buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+            count_.fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(value, std::memory_order_relaxed);
+
+            auto min = min_.load(std::memory_order_relaxed);
+            while (value < min &&
+                   !min_.compare_exchange_weak(min, value,
+                                               std::memory_order_relaxed)) {
+            }
+
+            auto max = max_.load(std::memory_order_relaxed);
+            while (value > max &&
+                   !max_.compare_exchange_weak(max, value,
+                                               std::memory_order_relaxed)) {
+            }
+        }
+
+        /**
+         * Record a duration in nanoseconds. Negative durations are recorded
+         * as zero.
+         *
+         * @param   d   The duration.
+         */
+        template <typename Rep, typename Period>
+        void record(std::chrono::duration<Rep, Period> d) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d)
+                          .count();
+            record(static_cast<std::uint64_t>(ns < 0 ? 0 : ns));
+        }
+
+        /** number of recorded values */
+        std::uint64_t count() const {
+            return count_.load(std::memory_order_relaxed);
+        }
+
+        /** smallest recorded value or 0 */
+        std::uint64_t min() const {
+            return count() ? min_.load(std::memory_order_relaxed) : 0;
+        }
+
+        /** largest recorded value */
+        std::uint64_t max() const {
+            return max_.load(std::memory_order_relaxed);
+        }
+
+        /** mean of all recorded values or 0 */
+        double mean() const {
+            auto cnt = count();
+            return cnt ? static_cast<double>(
+                             sum_.load(std::memory_order_relaxed)) /
+                             cnt
+                       : 0.0;
+        }
+
+        /**
+         * Get an upper bound for the given percentile.
+         *
+         * @param   p   The percentile in the range [0, 100].
+         *
+         * @returns The upper bound of the bucket that contains the
+         *          percentile, clamped to max().
+         */
+        std::uint64_t percentile(double p) const {
+
+            auto cnt = count();
+
+            if (!cnt) return 0;
+
+            auto rank = static_cast<std::uint64_t>(p / 100.0 * cnt);
+            if (rank >= cnt) rank = cnt - 1;
+
+            std::uint64_t seen = 0;
+
+            for (std::size_t i = 0; i < bucket_count; ++i) {
+                seen += buckets_[i].load(std::memory_order_relaxed);
+                if (seen > rank) return std::min(bucket_upper(i), max());
+            }
+
+            return max();
+        }
+
+        /**
+         * Call `f(lower, upper, count)` for every non-empty bucket, where
+         * [lower, upper] is the range of values counted by the bucket.
+         *
+         * @param   f   The visitor.
+         */
+        template <typename Visitor>
+        void for_each_bucket(Visitor f) const {
+            for (std::size_t i = 0; i < bucket_count; ++i)
+                if (auto cnt = buckets_[i].load(std::memory_order_relaxed))
+                    f(bucket_lower(i), bucket_upper(i), cnt);
+        }
+
+        /**
+         * Add the values recorded by another histogram.
+         *
+         * @param   other   The histogram to add.
+         */
+        void merge(const histogram& other) {
+
+            for (std::size_t i = 0; i < bucket_count; ++i) {
+                auto cnt = other.buckets_[i].load(std::memory_order_relaxed);
+                if (cnt) buckets_[i].fetch_add(cnt, std::memory_order_relaxed);
+            }
+
+            count_.fetch_add(other.count(), std::memory_order_relaxed);
+            sum_.fetch_add(other.sum_.load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+
+            auto other_min = other.min_.load(std::memory_order_relaxed);
+            auto min = min_.load(std::memory_order_relaxed);
+            while (other_min < min &&
+                   !min_.compare_exchange_weak(min, other_min,
+                                               std::memory_order_relaxed)) {
+            }
+
+            auto other_max = other.max();
+            auto max = max_.load(std::memory_order_relaxed);
+            while (other_max > max &&
+                   !max_.compare_exchange_weak(max, other_max,
+                                               std::memory_order_relaxed)) {
+            }
+        }
+
+        /** clear all recorded values */
+        void reset() {
+            for (auto& bucket : buckets_)
+                bucket.store(0, std::memory_order_relaxed);
+
+            count_.store(0, std::memory_order_relaxed);
+            sum_.store(0, std::memory_order_relaxed);
+            min_.store(std::numeric_limits<std::uint64_t>::max(),
+                       std::memory_order_relaxed);
+            max_.store(0, std::memory_order_relaxed);
+        }
+
+        /**
+         * Write a summary of the histogram in a single line.
+         *
+         * @param [in,out]  os  The stream to write to.
+         */
+        void write_summary(std::ostream& os) const {
+            os << "count=" << count() << " min=" << min()
+               << " mean=" << static_cast<std::uint64_t>(mean())
+               << " p50=" << percentile(50) << " p90=" << percentile(90)
+               << " p99=" << percentile(99) << " p99.9=" << percentile(99.9)
+               << " max=" << max();
+        }
+
+      private:
+        static std::size_t bucket_of(std::uint64_t value) {
+
+            if (value < sub_buckets) return static_cast<std::size_t>(value);
+
+            std::size_t octave = 63 - count_leading_zeros(value);
+            std::size_t sub = (value >> (octave - 3)) & (sub_buckets - 1);
+
+            return (octave - 2) * sub_buckets + sub;
+        }
+
+        static std::uint64_t bucket_lower(std::size_t idx) {
+
+            if (idx < sub_buckets) return idx;
+
+            std::size_t octave = idx / sub_buckets + 2;
+            std::uint64_t sub = idx % sub_buckets;
+
+            return (sub_buckets + sub) << (octave - 3);
+        }
+
+        static std::uint64_t bucket_upper(std::size_t idx) {
+            if (idx + 1 < bucket_count) return bucket_lower(idx + 1) - 1;
+            return std::numeric_limits<std::uint64_t>::max();
+        }
+
+        static std::size_t count_leading_zeros(std::uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<std::size_t>(__builtin_clzll(value));
+#else
+            std::size_t n = 0;
+            for (std::uint64_t bit = 1ull << 63; !(value & bit); bit >>= 1)
+                ++n;
+            return n;
+#endif
+        }
+
+        std::array<std::atomic<std::uint64_t>, bucket_count> buckets_;
+        std::atomic<std::uint64_t> count_;
+        std::atomic<std::uint64_t> sum_;
+        std::atomic<std::uint64_t> min_;
+        std::atomic<std::uint64_t> max_;
+    };
+
+} // namespace o::io
@@ -281,9 +281,9 @@ namespace o::io {
          * @author  Jonas Ohland
          * @date    16.03.2019
          *
-         * @returns A reference to an executor_type.
+         * @returns The executor_type.
          */
-        executor_type& executor() { return ctx_.get_executor(); }
+        executor_type executor() { return ctx_.get_executor(); }
 
         /**
          * Will be called when the app is started. This Function will be
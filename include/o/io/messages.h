@@ -27,4 +27,5 @@
 
 #include "messages/bytes_message.h"
 #include "messages/json_message.h"
+#include "messages/shared_message.h"
 #include "messages/string_message.h"
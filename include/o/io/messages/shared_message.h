@@ -0,0 +1,127 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <utility>
+
+namespace o::io::messages {
+
+    /// An immutable message with a reference count, for sending the same
+    /// bytes to many receivers. The reference count and the bytes share a
+    /// single allocation, copying a shared_message only takes another
+    /// reference, and the bytes are freed when the last copy is gone.
+    ///
+    /// notify_send() and notify_send_done() take and release a reference
+    /// explicitly, for senders that keep the message by other means than a
+    /// copy, see o::messages::is_send_notification_supported.
+    class shared_message {
+
+        struct block {
+            std::atomic< std::size_t > refs{ 1 };
+            std::size_t size = 0;
+
+            char* bytes() { return reinterpret_cast< char* >( this + 1 ); }
+        };
+
+      public:
+        shared_message() = default;
+
+        /// copy the bytes into a new message
+        shared_message( const void* data, std::size_t size )
+            : block_( allocate( size ) ) {
+            if ( size )
+                std::memcpy( block_->bytes(), data, size );
+        }
+
+        explicit shared_message( std::string_view text )
+            : shared_message( text.data(), text.size() ) {}
+
+        /// create a message of the given size and let the writer serialize
+        /// into it, the writer is called with a char* to size bytes
+        template < typename Writer >
+        static shared_message build( std::size_t size, Writer&& writer ) {
+            shared_message message;
+            message.block_ = allocate( size );
+            writer( message.block_->bytes() );
+            return message;
+        }
+
+        shared_message( const shared_message& other ) : block_( other.block_ ) {
+            notify_send();
+        }
+
+        shared_message( shared_message&& other ) noexcept
+            : block_( std::exchange( other.block_, nullptr ) ) {}
+
+        shared_message& operator=( shared_message other ) noexcept {
+            std::swap( block_, other.block_ );
+            return *this;
+        }
+
+        ~shared_message() { notify_send_done(); }
+
+        /// take a reference
+        void notify_send() const noexcept {
+            if ( block_ )
+                block_->refs.fetch_add( 1, std::memory_order_relaxed );
+        }
+
+        /// release a reference taken by notify_send()
+        void notify_send_done() const noexcept {
+            if ( block_ &&
+                 block_->refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+                block_->~block();
+                ::operator delete( block_ );
+            }
+        }
+
+        const char* data() const { return block_ ? block_->bytes() : nullptr; }
+
+        std::size_t size() const { return block_ ? block_->size : 0; }
+
+        bool empty() const { return size() == 0; }
+
+        /// number of references, including this one
+        std::size_t use_count() const {
+            return block_ ? block_->refs.load( std::memory_order_relaxed ) : 0;
+        }
+
+      private:
+        static block* allocate( std::size_t size ) {
+            auto b = new ( ::operator new( sizeof( block ) + size ) ) block;
+            b->size = size;
+            return b;
+        }
+
+        block* block_ = nullptr;
+    };
+
+} // namespace o::io::messages
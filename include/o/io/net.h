@@ -25,5 +25,25 @@
 
 #pragma once
 
+#include "net/dgram_batch.h"
+#include "net/dgram_buffer_pool.h"
+#include "net/dgram_busy_poll.h"
+#include "net/dgram_dispatch.h"
+#include "net/dgram_offload.h"
+#include "net/dgram_pacer.h"
+#include "net/dgram_send_queue.h"
+#include "net/dgram_shards.h"
+#include "net/fragment_device.h"
+#include "net/local.h"
+#include "net/multicast.h"
+#include "net/pcap_replay.h"
+#include "net/reliable_device.h"
 #include "net/server_base.h"
+#include "net/session_activity.h"
+#include "net/session_registry.h"
+#include "net/shm_device.h"
+#include "net/socket_options.h"
+#include "net/stream_session.h"
+#include "net/traffic_stats.h"
 #include "net/udp_device.h"
+#include "net/uring_device.h"
@@ -0,0 +1,378 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#if defined(O_NET_LINUX)
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+namespace o::io::net {
+
+    namespace detail {
+        template <typename Protocol>
+        class dgram_batch_receiver;
+    }
+
+    /**
+     * A non-owning view of a single received datagram. The memory referenced
+     * by the view is only valid until the handler it was passed to returns.
+     *
+     * @tparam  Protocol    Type of the protocol.
+     */
+    template <typename Protocol>
+    class dgram_view {
+
+      public:
+        using endpoint_type = typename Protocol::endpoint;
+        using time_point = std::chrono::system_clock::time_point;
+
+        dgram_view() = default;
+
+        /**
+         * Create a view of a datagram that was received outside of a
+         * datagram_device.
+         *
+         * @param   data    The first byte of the datagram.
+         * @param   size    The size of the datagram.
+         * @param   remote  The endpoint the datagram was received from.
+         */
+        dgram_view(const char* data, std::size_t size,
+                   const endpoint_type& remote)
+            : data_(const_cast<char*>(data)), size_(size), remote_(remote) {}
+
+        /** pointer to the first byte of the datagram */
+        const char* data() const { return data_; }
+
+        /** size of the datagram in bytes */
+        std::size_t size() const { return size_; }
+
+        /** the datagram as asio buffer */
+        boost::asio::const_buffer buffer() const {
+            return boost::asio::const_buffer(data_, size_);
+        }
+
+        /** endpoint the datagram was received from */
+        const endpoint_type& remote() const { return remote_; }
+
+        /**
+         * time the datagram arrived at the kernel. Only available if
+         * kernel timestamps were enabled, otherwise the epoch.
+         */
+        time_point timestamp() const { return timestamp_; }
+
+        /**
+         * destination address of the datagram, for example the multicast
+         * group it was sent to. Only available if destination addresses
+         * were enabled, otherwise unspecified.
+         */
+        const boost::asio::ip::address& destination() const {
+            return destination_;
+        }
+
+        /**
+         * index of the interface the datagram was received on. Only
+         * available if destination addresses were enabled, otherwise 0.
+         */
+        unsigned int interface_index() const { return interface_index_; }
+
+      private:
+        friend class detail::dgram_batch_receiver<Protocol>;
+
+        char* data_ = nullptr;
+        std::size_t size_ = 0;
+        endpoint_type remote_;
+        time_point timestamp_;
+        boost::asio::ip::address destination_;
+        unsigned int interface_index_ = 0;
+    };
+
+    /**
+     * A batch of datagrams that were received with a single receive
+     * operation.
+     *
+     * @tparam  Protocol    Type of the protocol.
+     */
+    template <typename Protocol>
+    class dgram_batch {
+
+      public:
+        using value_type = dgram_view<Protocol>;
+        using const_iterator = const value_type*;
+
+        dgram_batch(const value_type* first, std::size_t count)
+            : first_(first), count_(count) {}
+
+        const_iterator begin() const { return first_; }
+
+        const_iterator end() const { return first_ + count_; }
+
+        const value_type& operator[](std::size_t idx) const {
+            return first_[idx];
+        }
+
+        /** number of datagrams in this batch */
+        std::size_t size() const { return count_; }
+
+        bool empty() const { return count_ == 0; }
+
+      private:
+        const value_type* first_;
+        std::size_t count_;
+    };
+
+    namespace detail {
+
+        /**
+         * Owns the storage for a batch of datagrams and performs the actual
+         * receive operation. On linux this will use a single recvmmsg call,
+         * on other platforms the socket will be read non-blocking until it
+         * would block or the batch is full.
+         *
+         * On linux, every message also gets a buffer for ancillary data.
+         * If the socket has UDP_GRO enabled, coalesced messages will be split
+         * into the original datagrams, so a batch may contain more datagrams
+         * than capacity().
+         *
+         * @tparam  Protocol    Type of the protocol.
+         */
+        template <typename Protocol>
+        class dgram_batch_receiver {
+
+            using endpoint_type = typename Protocol::endpoint;
+
+            /** size of the ancillary data buffer of a single message */
+            static constexpr std::size_t control_size = 256;
+
+          public:
+            dgram_batch_receiver(std::size_t count, std::size_t max_size)
+                : max_size_(max_size), storage_(count * max_size)
+                , remotes_(count)
+#if defined(O_NET_LINUX)
+                , control_(count * control_size), headers_(count)
+                , iovecs_(count)
+#endif
+            {
+                views_.reserve(count);
+            }
+
+            /** maximum number of messages per receive operation */
+            std::size_t capacity() const { return remotes_.size(); }
+
+            /** maximum size of a single message */
+            std::size_t max_size() const { return max_size_; }
+
+            /**
+             * Receive as many datagrams as are available without blocking,
+             * up to capacity(). If no datagram was available, ec will be set
+             * to boost::asio::error::would_block.
+             *
+             * @param [in,out]  sock    The socket to read from.
+             * @param [out]     ec      Set to indicate an error.
+             *
+             * @returns A batch referencing the internal storage. It is valid
+             *          until the next call to receive().
+             */
+            template <typename Socket>
+            dgram_batch<Protocol> receive(Socket& sock,
+                                          boost::system::error_code& ec) {
+
+                views_.clear();
+
+#if defined(O_NET_LINUX)
+                for (std::size_t i = 0; i < capacity(); ++i) {
+                    iovecs_[i].iov_base = message_data(i);
+                    iovecs_[i].iov_len = max_size_;
+
+                    auto& hdr = headers_[i].msg_hdr;
+                    hdr = ::msghdr{};
+                    hdr.msg_name = remotes_[i].data();
+                    hdr.msg_namelen = remotes_[i].capacity();
+                    hdr.msg_iov = &iovecs_[i];
+                    hdr.msg_iovlen = 1;
+                    hdr.msg_control = control_.data() + i * control_size;
+                    hdr.msg_controllen = control_size;
+                }
+
+                int res = ::recvmmsg(sock.native_handle(), headers_.data(),
+                                     capacity(), MSG_DONTWAIT, nullptr);
+
+                if (res < 0) {
+                    ec = boost::system::error_code(
+                        errno, boost::asio::error::get_system_category());
+                    return batch();
+                }
+
+                for (int i = 0; i < res; ++i) {
+                    auto& hdr = headers_[i].msg_hdr;
+
+                    remotes_[i].resize(hdr.msg_namelen);
+
+                    add_message(i, headers_[i].msg_len, parse_control(hdr));
+                }
+
+                ec.clear();
+#else
+                if (!sock.non_blocking()) sock.non_blocking(true, ec);
+
+                for (std::size_t i = 0; !ec && i < capacity(); ++i) {
+
+                    auto bytes = sock.receive_from(
+                        boost::asio::buffer(message_data(i), max_size_),
+                        remotes_[i], 0, ec);
+
+                    if (!ec) add_message(i, bytes, message_info());
+                }
+
+                if (!views_.empty() && ec == boost::asio::error::would_block)
+                    ec.clear();
+#endif
+                return batch();
+            }
+
+          private:
+            char* message_data(std::size_t idx) {
+                return storage_.data() + idx * max_size_;
+            }
+
+            dgram_batch<Protocol> batch() const {
+                return dgram_batch<Protocol>(views_.data(), views_.size());
+            }
+
+            // information about a message taken from its ancillary data
+            struct message_info {
+                std::size_t segment_size = 0;
+                std::chrono::system_clock::time_point timestamp;
+                boost::asio::ip::address destination;
+                unsigned int interface_index = 0;
+            };
+
+            // add the datagrams contained in a message to the batch. If the
+            // message is a coalesced GRO message, split it into segments.
+            void add_message(std::size_t idx, std::size_t bytes,
+                             const message_info& info) {
+
+                auto segment = info.segment_size;
+
+                if (!segment || segment >= bytes) segment = bytes;
+
+                std::size_t offset = 0;
+
+                // a zero length datagram still results in one view
+                do {
+                    views_.emplace_back();
+
+                    auto& view = views_.back();
+                    view.data_ = message_data(idx) + offset;
+                    view.size_ = std::min(segment, bytes - offset);
+                    view.remote_ = remotes_[idx];
+                    view.timestamp_ = info.timestamp;
+                    view.destination_ = info.destination;
+                    view.interface_index_ = info.interface_index;
+
+                    offset += segment;
+                } while (offset < bytes);
+            }
+
+#if defined(O_NET_LINUX)
+            static message_info parse_control(::msghdr& hdr) {
+
+                message_info info;
+
+                for (auto* cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+                     cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+#if defined(UDP_GRO)
+                    if (cmsg->cmsg_level == SOL_UDP &&
+                        cmsg->cmsg_type == UDP_GRO) {
+                        int segment;
+                        std::memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                        info.segment_size = static_cast<std::size_t>(segment);
+                    }
+#endif
+#if defined(SCM_TIMESTAMPNS)
+                    if (cmsg->cmsg_level == SOL_SOCKET &&
+                        cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                        ::timespec ts;
+                        std::memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                        info.timestamp = std::chrono::system_clock::time_point(
+                            std::chrono::duration_cast<
+                                std::chrono::system_clock::duration>(
+                                std::chrono::seconds(ts.tv_sec) +
+                                std::chrono::nanoseconds(ts.tv_nsec)));
+                    }
+#endif
+                    if (cmsg->cmsg_level == IPPROTO_IP &&
+                        cmsg->cmsg_type == IP_PKTINFO) {
+                        ::in_pktinfo pi;
+                        std::memcpy(&pi, CMSG_DATA(cmsg), sizeof(pi));
+
+                        boost::asio::ip::address_v4::bytes_type bytes;
+                        std::memcpy(bytes.data(), &pi.ipi_addr, bytes.size());
+
+                        info.destination = boost::asio::ip::address_v4(bytes);
+                        info.interface_index = pi.ipi_ifindex;
+                    }
+
+                    if (cmsg->cmsg_level == IPPROTO_IPV6 &&
+                        cmsg->cmsg_type == IPV6_PKTINFO) {
+                        ::in6_pktinfo pi;
+                        std::memcpy(&pi, CMSG_DATA(cmsg), sizeof(pi));
+
+                        boost::asio::ip::address_v6::bytes_type bytes;
+                        std::memcpy(bytes.data(), &pi.ipi6_addr, bytes.size());
+
+                        info.destination = boost::asio::ip::address_v6(bytes);
+                        info.interface_index = pi.ipi6_ifindex;
+                    }
+                }
+
+                return info;
+            }
+#endif
+
+            std::size_t max_size_;
+            std::vector<char> storage_;
+            std::vector<endpoint_type> remotes_;
+            std::vector<dgram_view<Protocol>> views_;
+#if defined(O_NET_LINUX)
+            std::vector<char> control_;
+            std::vector<::mmsghdr> headers_;
+            std::vector<::iovec> iovecs_;
+#endif
+        };
+    } // namespace detail
+
+} // namespace o::io::net
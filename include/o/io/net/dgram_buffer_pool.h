@@ -0,0 +1,271 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include <atomic>
+#include <boost/asio/buffer.hpp>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace o::io::net {
+
+    class dgram_buffer_pool;
+    class pooled_dgram;
+
+    namespace detail {
+
+        class dgram_pool_core;
+
+        /**
+         * Header of a pooled buffer. The payload is stored directly behind
+         * the header in the same allocation.
+         */
+        struct dgram_pool_block {
+            std::atomic<std::size_t> refs{0};
+            std::size_t size = 0;
+            dgram_pool_core* pool = nullptr;
+            dgram_pool_block* next_free = nullptr;
+
+            char* data() { return reinterpret_cast<char*>(this + 1); }
+        };
+
+        /**
+         * Shared state of a buffer pool. It is kept alive by the owning
+         * dgram_buffer_pool and by every buffer that is currently in use,
+         * so buffers may safely outlive the pool object.
+         */
+        class dgram_pool_core {
+
+          public:
+            dgram_pool_core(std::size_t buffer_size, std::size_t count)
+                : buffer_size_(buffer_size) {
+                for (std::size_t i = 0; i < count; ++i)
+                    push_free(allocate_block());
+            }
+
+            ~dgram_pool_core() {
+                while (free_) {
+                    auto* next = free_->next_free;
+                    free_block(free_);
+                    free_ = next;
+                }
+            }
+
+            dgram_pool_block* acquire() {
+
+                dgram_pool_block* block = nullptr;
+
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    if ((block = free_)) {
+                        free_ = block->next_free;
+                        --available_;
+                    }
+                }
+
+                if (!block) block = allocate_block();
+
+                refs_.fetch_add(1, std::memory_order_relaxed);
+
+                block->next_free = nullptr;
+                block->size = 0;
+                block->refs.store(1, std::memory_order_relaxed);
+
+                return block;
+            }
+
+            void recycle(dgram_pool_block* block) {
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    push_free(block);
+                }
+
+                release();
+            }
+
+            void retain() { refs_.fetch_add(1, std::memory_order_relaxed); }
+
+            void release() {
+                if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+            std::size_t buffer_size() const { return buffer_size_; }
+
+            std::size_t available() {
+                std::lock_guard<std::mutex> lock(mtx_);
+                return available_;
+            }
+
+            std::size_t allocated() const {
+                return allocated_.load(std::memory_order_relaxed);
+            }
+
+          private:
+            dgram_pool_block* allocate_block() {
+                void* mem =
+                    ::operator new(sizeof(dgram_pool_block) + buffer_size_);
+                auto* block = new (mem) dgram_pool_block();
+                block->pool = this;
+                allocated_.fetch_add(1, std::memory_order_relaxed);
+                return block;
+            }
+
+            static void free_block(dgram_pool_block* block) {
+                block->~dgram_pool_block();
+                ::operator delete(static_cast<void*>(block));
+            }
+
+            void push_free(dgram_pool_block* block) {
+                block->next_free = free_;
+                free_ = block;
+                ++available_;
+            }
+
+            std::size_t buffer_size_;
+            std::atomic<std::size_t> refs_{1};
+            std::atomic<std::size_t> allocated_{0};
+
+            std::mutex mtx_;
+            dgram_pool_block* free_ = nullptr;
+            std::size_t available_ = 0;
+        };
+    } // namespace detail
+
+    /**
+     * A reference counted, owning view of a buffer from a dgram_buffer_pool.
+     * Copying a pooled_dgram only increments the reference count. The buffer
+     * returns to its pool when the last reference is released.
+     */
+    class pooled_dgram {
+
+      public:
+        pooled_dgram() = default;
+
+        pooled_dgram(const pooled_dgram& other) : block_(other.block_) {
+            if (block_) block_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        pooled_dgram(pooled_dgram&& other) noexcept
+            : block_(std::exchange(other.block_, nullptr)) {}
+
+        pooled_dgram& operator=(pooled_dgram other) noexcept {
+            std::swap(block_, other.block_);
+            return *this;
+        }
+
+        ~pooled_dgram() { reset(); }
+
+        /** release this reference */
+        void reset() {
+            if (block_ &&
+                block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                block_->pool->recycle(block_);
+
+            block_ = nullptr;
+        }
+
+        char* data() { return block_->data(); }
+
+        const char* data() const { return block_->data(); }
+
+        /** number of valid bytes in the buffer */
+        std::size_t size() const { return block_->size; }
+
+        /** set the number of valid bytes. must not exceed capacity() */
+        void resize(std::size_t size) { block_->size = size; }
+
+        /** total size of the underlying buffer */
+        std::size_t capacity() const { return block_->pool->buffer_size(); }
+
+        /** the valid part of the buffer */
+        boost::asio::const_buffer buffer() const {
+            return boost::asio::const_buffer(data(), size());
+        }
+
+        /** the whole underlying buffer, used to receive into */
+        boost::asio::mutable_buffer prepare() {
+            return boost::asio::mutable_buffer(data(), capacity());
+        }
+
+        /** number of references to the underlying buffer */
+        std::size_t use_count() const {
+            return block_ ? block_->refs.load(std::memory_order_relaxed) : 0;
+        }
+
+        explicit operator bool() const { return block_ != nullptr; }
+
+      private:
+        friend class dgram_buffer_pool;
+
+        explicit pooled_dgram(detail::dgram_pool_block* block)
+            : block_(block) {}
+
+        detail::dgram_pool_block* block_ = nullptr;
+    };
+
+    /**
+     * A pool of fixed-size, recyclable datagram buffers. The pool grows
+     * when it runs out of buffers and never shrinks, so once it reached the
+     * high water mark of buffers in use, acquiring a buffer will not
+     * allocate.
+     */
+    class dgram_buffer_pool {
+
+      public:
+        /**
+         * Create a new pool
+         *
+         * @param   buffer_size Size of a single buffer in bytes.
+         * @param   count       Number of buffers to allocate upfront.
+         */
+        dgram_buffer_pool(std::size_t buffer_size, std::size_t count)
+            : core_(new detail::dgram_pool_core(buffer_size, count)) {}
+
+        dgram_buffer_pool(const dgram_buffer_pool&) = delete;
+        dgram_buffer_pool& operator=(const dgram_buffer_pool&) = delete;
+
+        ~dgram_buffer_pool() { core_->release(); }
+
+        /** take a buffer from the pool */
+        pooled_dgram acquire() { return pooled_dgram(core_->acquire()); }
+
+        /** size of a single buffer */
+        std::size_t buffer_size() const { return core_->buffer_size(); }
+
+        /** number of buffers that are currently not in use */
+        std::size_t available() { return core_->available(); }
+
+        /** total number of buffers allocated by the pool */
+        std::size_t allocated() const { return core_->allocated(); }
+
+      private:
+        detail::dgram_pool_core* core_;
+    };
+
+} // namespace o::io::net
@@ -0,0 +1,81 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include <algorithm>
+#include <chrono>
+
+namespace o::io::net::detail {
+
+    /**
+     * Decides how long a device should spin on its socket for the next
+     * datagram before it goes back to waiting for the reactor.
+     *
+     * Keeps a moving average of the time between datagrams. As long as the
+     * next datagram is expected within the maximum spin time, the budget is
+     * twice the average gap (at most the maximum spin time), otherwise it is
+     * zero. A socket that goes idle
+     * will stop spinning after a few datagrams, a busy one will spin for no
+     * longer than it usually takes for the next datagram to arrive.
+     */
+    class dgram_spin_budget {
+
+      public:
+        using clock = std::chrono::steady_clock;
+
+        explicit dgram_spin_budget(clock::duration max_spin)
+            : max_spin_(max_spin), gap_(max_spin * 4) {}
+
+        // A datagram (or a batch of them) arrived at `now`.
+        void arrived(clock::time_point now) {
+
+            if (last_ != clock::time_point()) {
+                // limit the weight of long idle periods, so the average
+                // recovers quickly once traffic resumes
+                auto gap = std::min(now - last_, max_spin_ * 4);
+                gap_ += (gap - gap_) / 8;
+            }
+
+            last_ = now;
+        }
+
+        // Time to spin for the next datagram, zero if it is not expected
+        // soon enough.
+        clock::duration budget() const {
+            if (gap_ > max_spin_) return clock::duration::zero();
+            return std::min<clock::duration>(gap_ * 2, max_spin_);
+        }
+
+        clock::duration max_spin() const { return max_spin_; }
+
+      private:
+        clock::duration max_spin_;
+        clock::duration gap_;
+        clock::time_point last_;
+    };
+
+} // namespace o::io::net::detail
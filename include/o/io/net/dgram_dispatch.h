@@ -0,0 +1,215 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace o::io::net {
+
+    /** Load of a single shard of a dgram_flow_dispatcher */
+    struct dgram_shard_load {
+        /** datagrams waiting for or in the handler right now */
+        std::size_t depth = 0;
+        /** highest depth seen since the dispatcher was created */
+        std::size_t peak_depth = 0;
+        /** datagrams dispatched to the shard */
+        std::uint64_t dispatched = 0;
+    };
+
+    namespace detail {
+
+        inline std::uint64_t dgram_flow_mix(std::uint64_t h) {
+            // finalizer of murmur3, spreads similar endpoints over shards
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdull;
+            h ^= h >> 33;
+            h *= 0xc4ceb9fe1a85ec53ull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        inline std::uint64_t dgram_flow_bytes(const void* data,
+                                              std::size_t size,
+                                              std::uint64_t h) {
+            auto* p = static_cast<const unsigned char*>(data);
+            for (std::size_t i = 0; i < size; ++i)
+                h = (h ^ p[i]) * 0x100000001b3ull;
+            return h;
+        }
+
+        // Hash of an endpoint. Ip endpoints hash the address and port, so
+        // padding in the socket address does not matter, others hash the
+        // raw address.
+        template <typename Endpoint>
+        std::uint64_t dgram_flow_hash(const Endpoint& endpoint) {
+
+            std::uint64_t h = 0xcbf29ce484222325ull;
+
+            if constexpr (o::type_traits::is_ip_protocol<
+                              typename Endpoint::protocol_type>::value) {
+                auto addr = endpoint.address();
+
+                if (addr.is_v4()) {
+                    auto bytes = addr.to_v4().to_bytes();
+                    h = dgram_flow_bytes(bytes.data(), bytes.size(), h);
+                } else {
+                    auto bytes = addr.to_v6().to_bytes();
+                    h = dgram_flow_bytes(bytes.data(), bytes.size(), h);
+                }
+
+                auto port = endpoint.port();
+                h = dgram_flow_bytes(&port, sizeof(port), h);
+            } else
+                h = dgram_flow_bytes(endpoint.data(), endpoint.size(), h);
+
+            return dgram_flow_mix(h);
+        }
+    } // namespace detail
+
+    /**
+     * Distributes received datagrams over a fixed number of strands by the
+     * endpoint they were received from. All datagrams of one peer go to the
+     * same strand and are handled in the order they were dispatched, while
+     * datagrams of different peers are handled in parallel by the threads
+     * running the io_context.
+     *
+     * The depth of every shard is tracked, so a peer that sends more than
+     * its shard can handle shows up as a shard with a deep queue, see
+     * load() and hottest().
+     *
+     * The dispatcher must outlive the handlers it posted, so it should be
+     * destroyed after the io_context was stopped.
+     *
+     * @tparam  Endpoint            Type of the endpoint.
+     * @tparam  MessageContainer    Type of the message.
+     */
+    template <typename Endpoint, typename MessageContainer>
+    class dgram_flow_dispatcher {
+
+      public:
+        using handler_type =
+            std::function<void(const Endpoint&, MessageContainer&&)>;
+
+        /**
+         * Constructor
+         *
+         * @param   exec    Executor of the context to run the handlers on,
+         *                  e.g. `ctx.get_executor()`.
+         * @param   shards  The number of shards, at least 1.
+         * @param   handler Called for every datagram, on the strand of its
+         *                  shard.
+         */
+        dgram_flow_dispatcher(const boost::asio::any_io_executor& exec,
+                              std::size_t shards, handler_type handler)
+            : handler_(std::move(handler)) {
+            for (std::size_t i = 0; i < std::max<std::size_t>(shards, 1); ++i)
+                shards_.emplace_back(std::make_unique<shard>(exec));
+        }
+
+        dgram_flow_dispatcher(const dgram_flow_dispatcher&) = delete;
+        dgram_flow_dispatcher& operator=(const dgram_flow_dispatcher&) =
+            delete;
+
+        /**
+         * Queue a datagram on the shard of its peer.
+         *
+         * @param   remote  The endpoint the datagram was received from.
+         * @param   message The datagram.
+         */
+        void dispatch(const Endpoint& remote, MessageContainer&& message) {
+
+            auto& s = *shards_[shard_of(remote)];
+
+            auto depth = s.depth.fetch_add(1, std::memory_order_relaxed) + 1;
+            auto peak = s.peak_depth.load(std::memory_order_relaxed);
+
+            while (depth > peak &&
+                   !s.peak_depth.compare_exchange_weak(
+                       peak, depth, std::memory_order_relaxed)) {
+            }
+
+            s.dispatched.fetch_add(1, std::memory_order_relaxed);
+
+            boost::asio::post(
+                s.strand,
+                [this, &s, remote,
+                 message = std::forward<MessageContainer>(message)]() mutable {
+                    handler_(remote, std::move(message));
+                    s.depth.fetch_sub(1, std::memory_order_relaxed);
+                });
+        }
+
+        /** @returns The shard the datagrams of a peer are handled on. */
+        std::size_t shard_of(const Endpoint& remote) const {
+            return detail::dgram_flow_hash(remote) % shards_.size();
+        }
+
+        /** number of shards */
+        std::size_t size() const { return shards_.size(); }
+
+        /** @returns The load of a shard. */
+        dgram_shard_load load(std::size_t idx) const {
+            const auto& s = *shards_[idx];
+            dgram_shard_load out;
+            out.depth = s.depth.load(std::memory_order_relaxed);
+            out.peak_depth = s.peak_depth.load(std::memory_order_relaxed);
+            out.dispatched = s.dispatched.load(std::memory_order_relaxed);
+            return out;
+        }
+
+        /** @returns The shard with the deepest queue right now. */
+        std::size_t hottest() const {
+            std::size_t best = 0;
+            for (std::size_t i = 1; i < shards_.size(); ++i)
+                if (load(i).depth > load(best).depth) best = i;
+            return best;
+        }
+
+      private:
+        // counters of different shards live on separate cache lines
+        struct alignas(64) shard {
+            explicit shard(const boost::asio::any_io_executor& exec)
+                : strand(exec) {}
+
+            boost::asio::strand<boost::asio::any_io_executor> strand;
+            std::atomic<std::size_t> depth{0};
+            std::atomic<std::size_t> peak_depth{0};
+            std::atomic<std::uint64_t> dispatched{0};
+        };
+
+        handler_type handler_;
+        std::vector<std::unique_ptr<shard>> shards_;
+    };
+
+} // namespace o::io::net
@@ -0,0 +1,107 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(O_NET_LINUX)
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+namespace o::io::net {
+
+#if defined(UDP_SEGMENT) || defined(DOXY_GENERATE)
+#define O_NET_HAS_UDP_GSO
+#endif
+
+    /** largest UDP payload the kernel will coalesce or segment */
+    static constexpr const std::size_t dgram_offload_max_size = 65507;
+
+    /** most segments the kernel sends from a single GSO write */
+    static constexpr const std::size_t dgram_offload_max_segments = 64;
+
+    namespace detail {
+
+#if defined(O_NET_HAS_UDP_GSO)
+        /**
+         * Send a buffer that consists of multiple datagrams of
+         * `segment_size` bytes with a single sendmsg call. The kernel (or
+         * the NIC) will split it into separate datagrams. Only the last
+         * segment may be shorter than `segment_size`.
+         *
+         * @param [in,out]  sock            The socket to write to.
+         * @param           remote          The destination endpoint.
+         * @param           data            The segments.
+         * @param           size            Total size of all segments.
+         * @param           segment_size    Size of a single segment.
+         * @param [out]     ec              Set to indicate an error.
+         */
+        template <typename Socket, typename Endpoint>
+        void dgram_send_segmented(Socket& sock, const Endpoint& remote,
+                                  const void* data, std::size_t size,
+                                  std::size_t segment_size,
+                                  boost::system::error_code& ec) {
+
+            alignas(::cmsghdr) char control[CMSG_SPACE(sizeof(std::uint16_t))];
+
+            ::iovec iov{const_cast<void*>(data), size};
+
+            ::msghdr hdr{};
+            hdr.msg_name = const_cast<void*>(
+                static_cast<const void*>(remote.data()));
+            hdr.msg_namelen = remote.size();
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+
+            if (segment_size < size) {
+                auto segment = static_cast<std::uint16_t>(segment_size);
+
+                hdr.msg_control = control;
+                hdr.msg_controllen = sizeof(control);
+
+                auto* cmsg = CMSG_FIRSTHDR(&hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(segment));
+                std::memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+            }
+
+            if (::sendmsg(sock.native_handle(), &hdr, MSG_DONTWAIT) < 0)
+                ec = boost::system::error_code(
+                    errno, boost::asio::error::get_system_category());
+            else
+                ec.clear();
+        }
+#endif
+    } // namespace detail
+
+} // namespace o::io::net
@@ -0,0 +1,336 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include "dgram_send_queue.h"
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <boost/optional.hpp>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace o::io::net {
+
+    /**
+     * A token bucket that limits datagrams to `rate` per second while
+     * allowing bursts of up to `burst` datagrams. Implemented as a generic
+     * cell rate algorithm, so it only keeps the time at which the next
+     * datagram is due and does not need a timer to refill.
+     */
+    class dgram_token_bucket {
+
+      public:
+        using clock = std::chrono::steady_clock;
+
+        /**
+         * @param   rate    Datagrams per second. A rate that is not positive
+         *                  does not limit the datagrams.
+         * @param   burst   Number of datagrams that may be sent back to back
+         *                  after the bucket was idle. At least 1.
+         */
+        dgram_token_bucket(double rate, std::size_t burst)
+            : interval_(interval_of(rate))
+            , tolerance_(interval_ * (std::max<std::size_t>(burst, 1) - 1)) {}
+
+        /** @return whether a datagram may be sent at `now` */
+        bool conforms(clock::time_point now) const {
+            return now >= due_ - tolerance_;
+        }
+
+        /** @return the earliest time a datagram may be sent */
+        clock::time_point next() const { return due_ - tolerance_; }
+
+        /**
+         * Take a token. A sender that is late by up to `slack` keeps the
+         * credit for the time it was late, so a timer that fires late does
+         * not lower the rate.
+         */
+        void consume(clock::time_point now, clock::duration slack) {
+            due_ = std::max(due_, now - slack) + interval_;
+        }
+
+        /** @return whether the bucket is full at `now` */
+        bool idle(clock::time_point now) const { return due_ <= now; }
+
+      private:
+        // A rate of at most one datagram in ~30 years is treated as that,
+        // so the interval and the tolerance cannot overflow.
+        static clock::duration interval_of(double rate) {
+
+            if (!(rate > 0)) return clock::duration::zero();
+
+            return std::chrono::nanoseconds(
+                static_cast<std::int64_t>(std::min(1e9 / rate, 1e18)));
+        }
+
+        clock::duration interval_;
+        clock::duration tolerance_;
+        clock::time_point due_;
+    };
+
+    namespace detail {
+
+        /**
+         * Releases datagrams according to a global token bucket and one
+         * token bucket per destination. A datagram that does not conform is
+         * appended to the backlog of its destination. The backlogs are
+         * drained round robin by release(), which is called from a single
+         * timer. If the backlogs are bounded, datagrams that do not fit are
+         * dropped like in a bounded send queue.
+         *
+         * @tparam  Protocol            Type of the protocol.
+         * @tparam  MessageContainer    Type of the message.
+         */
+        template <typename Protocol, typename MessageContainer>
+        class dgram_pacer {
+
+          public:
+            using clock = dgram_token_bucket::clock;
+            using endpoint_type = typename Protocol::endpoint;
+            using entry_type = dgram_send_entry<Protocol, MessageContainer>;
+
+            dgram_pacer() = default;
+
+            void limit_global(double rate, std::size_t burst) {
+                global_.emplace(rate, burst);
+            }
+
+            void limit_destination(double rate, std::size_t burst) {
+                per_destination_.emplace(rate, burst);
+            }
+
+            void resolution(clock::duration res) { resolution_ = res; }
+
+            // Hold at most `capacity` datagrams in all backlogs, 0 for no
+            // limit. The pacer never blocks, block_producer drops the
+            // newest datagram.
+            void bound(std::size_t capacity, dgram_drop_policy policy) {
+                capacity_ = capacity;
+                policy_ = policy;
+            }
+
+            std::uint64_t dropped_newest() const { return dropped_newest_; }
+
+            std::uint64_t dropped_oldest() const { return dropped_oldest_; }
+
+            clock::duration resolution() const { return resolution_; }
+
+            std::size_t backlog() const { return backlog_; }
+
+            /**
+             * Offer a datagram. Returns true if it may be sent right away,
+             * otherwise the datagram was moved into a backlog or dropped.
+             */
+            bool admit(clock::time_point now, const endpoint_type& remote,
+                       MessageContainer& message) {
+
+                // destinations that always conform never reach release()
+                evict_idle(now);
+
+                auto& fl = flow_for(remote);
+
+                // a datagram sent right away was not delayed by the timer,
+                // so it gets no credit for lateness and bursts stay within
+                // the limit
+                if (fl.backlog.empty() && (!global_ || !backlog_) &&
+                    conforms(fl, now)) {
+                    consume(fl, now, clock::duration::zero());
+                    return true;
+                }
+
+                if (capacity_ && backlog_ >= capacity_) {
+                    if (policy_ != dgram_drop_policy::drop_oldest ||
+                        fl.backlog.empty()) {
+                        ++dropped_newest_;
+                        return false;
+                    }
+
+                    fl.backlog.pop_front();
+                    --backlog_;
+                    ++dropped_oldest_;
+                }
+
+                if (fl.backlog.empty()) active_.push_back(&fl);
+
+                fl.backlog.push_back(
+                    {remote, std::forward<MessageContainer>(message)});
+                ++backlog_;
+
+                return false;
+            }
+
+            /**
+             * Move all datagrams that are due at `now` into `out`.
+             *
+             * @returns The time the next datagram is due, or
+             *          time_point::max() if the backlog is empty.
+             */
+            clock::time_point release(clock::time_point now,
+                                      std::vector<entry_type>& out) {
+
+                bool progress = true;
+
+                while (progress && !active_.empty()) {
+                    progress = false;
+
+                    for (std::size_t i = 0; i < active_.size(); ++i) {
+                        auto& fl = *active_[i];
+
+                        if (global_ && !global_->conforms(now)) break;
+
+                        if (!conforms(fl, now)) continue;
+
+                        consume(fl, now, resolution_ * 4);
+                        out.push_back(std::move(fl.backlog.front()));
+                        fl.backlog.pop_front();
+                        --backlog_;
+                        progress = true;
+                    }
+
+                    active_.erase(
+                        std::remove_if(active_.begin(), active_.end(),
+                                       [](flow* fl) {
+                                           return fl->backlog.empty();
+                                       }),
+                        active_.end());
+                }
+
+                evict_idle(now);
+
+                auto due = clock::time_point::max();
+
+                for (auto* fl : active_)
+                    due = std::min(due,
+                                   fl->bucket ? fl->bucket->next() : now);
+
+                if (global_ && !active_.empty())
+                    due = std::max(due, global_->next());
+
+                return due;
+            }
+
+          private:
+            struct flow {
+                boost::optional<dgram_token_bucket> bucket;
+                std::deque<entry_type> backlog;
+            };
+
+            flow& flow_for(const endpoint_type& remote) {
+
+                // without per destination limits, all datagrams share one
+                // flow
+                if (!per_destination_) return flows_[endpoint_type()];
+
+                auto it = flows_.find(remote);
+
+                if (it != flows_.end()) return it->second;
+
+                auto& fl = flows_[remote];
+                fl.bucket = *per_destination_;
+                return fl;
+            }
+
+            bool conforms(const flow& fl, clock::time_point now) const {
+                return (!fl.bucket || fl.bucket->conforms(now)) &&
+                       (!global_ || global_->conforms(now));
+            }
+
+            // A release may be late by the timer resolution plus the wake up
+            // latency of the io thread, release() allows for a few ticks of
+            // it.
+            void consume(flow& fl, clock::time_point now,
+                         clock::duration slack) {
+                if (fl.bucket) fl.bucket->consume(now, slack);
+                if (global_) global_->consume(now, slack);
+            }
+
+            // Forget destinations whose bucket is full and that have nothing
+            // queued, once there are many of them.
+            void evict_idle(clock::time_point now) {
+
+                if (flows_.size() < evict_at_) return;
+
+                for (auto it = flows_.begin(); it != flows_.end();)
+                    if (it->second.backlog.empty() &&
+                        (!it->second.bucket || it->second.bucket->idle(now)))
+                        it = flows_.erase(it);
+                    else
+                        ++it;
+
+                evict_at_ = std::max<std::size_t>(64, flows_.size() * 2);
+            }
+
+            clock::duration resolution_ = std::chrono::microseconds(100);
+            boost::optional<dgram_token_bucket> global_;
+            boost::optional<dgram_token_bucket> per_destination_;
+            std::map<endpoint_type, flow> flows_;
+            std::vector<flow*> active_;
+            std::size_t backlog_ = 0;
+            std::size_t evict_at_ = 64;
+            std::size_t capacity_ = 0;
+            dgram_drop_policy policy_ = dgram_drop_policy::drop_newest;
+            std::uint64_t dropped_newest_ = 0;
+            std::uint64_t dropped_oldest_ = 0;
+        };
+
+        /**
+         * A pacer with the state needed to schedule its timer.
+         */
+        template <typename Protocol, typename MessageContainer,
+                  typename ConcurrencyOption>
+        struct dgram_pace_state {
+            using pacer_type = dgram_pacer<Protocol, MessageContainer>;
+            using entry_type = typename pacer_type::entry_type;
+
+            struct shared_state {
+                pacer_type pacer;
+                bool timer_armed = false;
+                dgram_token_bucket::clock::time_point timer_due;
+                // identifies the current wait, so a handler of a wait that
+                // was replaced can tell it is stale
+                std::uint64_t timer_generation = 0;
+            };
+
+            template <typename Executor>
+            dgram_pace_state(const Executor& exec,
+                             dgram_token_bucket::clock::duration resolution)
+                : timer(std::make_shared<boost::asio::steady_timer>(exec)) {
+                state.apply(
+                    [&](auto& queue) { queue.pacer.resolution(resolution); });
+            }
+
+            o::ccy::opt_safe_visitable<shared_state, ConcurrencyOption> state;
+
+            std::shared_ptr<boost::asio::steady_timer> timer;
+        };
+    } // namespace detail
+
+} // namespace o::io::net
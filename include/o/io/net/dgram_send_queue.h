@@ -0,0 +1,313 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#if defined(O_NET_LINUX)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+namespace o::io::net {
+
+    /**
+     * A datagram waiting in a send queue.
+     *
+     * @tparam  Protocol            Type of the protocol.
+     * @tparam  MessageContainer    Type of the message.
+     */
+    template <typename Protocol, typename MessageContainer>
+    struct dgram_send_entry {
+        typename Protocol::endpoint remote;
+        MessageContainer message;
+    };
+
+    /**
+     * What a bounded send queue does with a datagram that is written while
+     * the queue is full.
+     */
+    enum class dgram_drop_policy {
+        /** discard the datagram that was just written */
+        drop_newest,
+        /** discard the oldest datagram that was not handed to the socket */
+        drop_oldest,
+        /**
+         * block the writing thread until there is room in the queue. Only
+         * available with o::ccy::safe, otherwise behaves like drop_newest.
+         * Must not be used from a thread that runs the io_context of the
+         * device.
+         */
+        block_producer
+    };
+
+    /**
+     * Counters of a send queue.
+     */
+    struct dgram_send_stats {
+        /** datagrams currently queued */
+        std::size_t depth = 0;
+        /** the highest depth the queue ever reached */
+        std::size_t peak_depth = 0;
+        /** datagrams handed to the socket */
+        std::uint64_t sent = 0;
+        /** datagrams discarded by drop_newest */
+        std::uint64_t dropped_newest = 0;
+        /** datagrams discarded by drop_oldest */
+        std::uint64_t dropped_oldest = 0;
+        /** datagrams the socket rejected */
+        std::uint64_t failed = 0;
+        /** number of times a producer had to wait for room in the queue */
+        std::uint64_t blocked = 0;
+    };
+
+    namespace detail {
+
+        /**
+         * Sends a sequence of queued datagrams with as few system calls as
+         * possible. On linux this will use sendmmsg, on other platforms the
+         * datagrams will be written non-blocking one by one.
+         *
+         * @tparam  Protocol            Type of the protocol.
+         * @tparam  MessageContainer    Type of the message.
+         */
+        template <typename Protocol, typename MessageContainer>
+        class dgram_batch_sender {
+
+          public:
+            using entry_type = dgram_send_entry<Protocol, MessageContainer>;
+
+            explicit dgram_batch_sender(std::size_t max_batch)
+#if defined(O_NET_LINUX)
+                : headers_(max_batch), iovecs_(max_batch)
+#endif
+            {
+            }
+
+            /**
+             * Send up to `count` datagrams without blocking. Sending stops
+             * at the first datagram that could not be sent. In that case
+             * ec indicates the reason.
+             *
+             * @param [in,out]  sock    The socket to write to.
+             * @param           first   The first datagram to send.
+             * @param           count   Number of datagrams to send. Must not
+             *                          exceed the batch size this sender was
+             *                          constructed with.
+             * @param [out]     ec      Set to indicate an error.
+             *
+             * @returns The number of datagrams that were sent.
+             */
+            template <typename Socket>
+            std::size_t send(Socket& sock, entry_type* first, std::size_t count,
+                             boost::system::error_code& ec) {
+#if defined(O_NET_LINUX)
+                for (std::size_t i = 0; i < count; ++i) {
+                    iovecs_[i].iov_base =
+                        const_cast<void*>(static_cast<const void*>(
+                            first[i].message.data()));
+                    iovecs_[i].iov_len = first[i].message.size();
+
+                    auto& hdr = headers_[i].msg_hdr;
+                    hdr = ::msghdr{};
+                    hdr.msg_name = first[i].remote.data();
+                    hdr.msg_namelen = first[i].remote.size();
+                    hdr.msg_iov = &iovecs_[i];
+                    hdr.msg_iovlen = 1;
+                }
+
+                int res = ::sendmmsg(sock.native_handle(), headers_.data(),
+                                     count, MSG_DONTWAIT);
+
+                if (res < 0) {
+                    ec = boost::system::error_code(
+                        errno, boost::asio::error::get_system_category());
+                    return 0;
+                }
+
+                ec.clear();
+                return static_cast<std::size_t>(res);
+#else
+                std::size_t sent = 0;
+
+                if (!sock.non_blocking()) sock.non_blocking(true, ec);
+
+                while (!ec && sent < count) {
+                    const auto& message = first[sent].message;
+
+                    sock.send_to(
+                        boost::asio::buffer(message.data(), message.size()),
+                        first[sent].remote, 0, ec);
+                    if (!ec) ++sent;
+                }
+
+                return sent;
+#endif
+            }
+
+          private:
+#if defined(O_NET_LINUX)
+            std::vector<::mmsghdr> headers_;
+            std::vector<::iovec> iovecs_;
+#endif
+        };
+
+        /**
+         * A datagram send queue. New datagrams are appended to the pending
+         * list, which is swapped into `inflight` when the queue is flushed.
+         * Both lists keep their capacity, so a queue that reached its steady
+         * state does not allocate.
+         *
+         * If the queue is bounded, `depth` counts the datagrams in both
+         * lists that were not sent yet. Datagrams dropped from the front of
+         * the pending list are skipped by moving `head`.
+         *
+         * @tparam  Protocol            Type of the protocol.
+         * @tparam  MessageContainer    Type of the message.
+         * @tparam  ConcurrencyOption   Type of the concurrency option.
+         */
+        template <typename Protocol, typename MessageContainer,
+                  typename ConcurrencyOption>
+        struct dgram_send_queue {
+            using entry_type = dgram_send_entry<Protocol, MessageContainer>;
+
+            /** state shared between producers and the flushing thread */
+            struct shared_state {
+                std::vector<entry_type> pending;
+                std::size_t head = 0;
+                std::size_t depth = 0;
+                bool flushing = false;
+                bool timer_armed = false;
+                bool congested = false;
+            };
+
+            // counters that can be read without taking the state lock
+            struct counters {
+                std::atomic<std::size_t> depth{0};
+                std::atomic<std::size_t> peak_depth{0};
+                std::atomic<std::uint64_t> sent{0};
+                std::atomic<std::uint64_t> dropped_newest{0};
+                std::atomic<std::uint64_t> dropped_oldest{0};
+                std::atomic<std::uint64_t> failed{0};
+                std::atomic<std::uint64_t> blocked{0};
+            };
+
+            template <typename Executor>
+            dgram_send_queue(const Executor& exec, std::size_t batch,
+                             std::chrono::microseconds latency)
+                : max_batch(batch), max_latency(latency), sender(batch)
+                , timer(std::make_shared<boost::asio::steady_timer>(exec)) {}
+
+            std::size_t max_batch;
+            std::chrono::microseconds max_latency;
+
+            // 0 if the queue is unbounded
+            std::size_t capacity = 0;
+            std::size_t high_watermark = 0;
+            std::size_t low_watermark = 0;
+            dgram_drop_policy policy = dgram_drop_policy::drop_newest;
+
+            dgram_batch_sender<Protocol, MessageContainer> sender;
+
+            // only accessed by the thread that is currently flushing
+            std::vector<entry_type> inflight;
+            std::size_t inflight_pos = 0;
+
+            o::ccy::opt_safe_visitable<shared_state, ConcurrencyOption> state;
+
+            std::shared_ptr<boost::asio::steady_timer> timer;
+
+            counters stats;
+
+            // producers waiting with block_producer
+            std::condition_variable room;
+
+            bool bounded() const { return capacity != 0; }
+
+            dgram_send_stats snapshot() const {
+                dgram_send_stats out;
+                out.depth = stats.depth.load(std::memory_order_relaxed);
+                out.peak_depth =
+                    stats.peak_depth.load(std::memory_order_relaxed);
+                out.sent = stats.sent.load(std::memory_order_relaxed);
+                out.dropped_newest =
+                    stats.dropped_newest.load(std::memory_order_relaxed);
+                out.dropped_oldest =
+                    stats.dropped_oldest.load(std::memory_order_relaxed);
+                out.failed = stats.failed.load(std::memory_order_relaxed);
+                out.blocked = stats.blocked.load(std::memory_order_relaxed);
+                return out;
+            }
+
+            // Update depth and the counters after `count` datagrams left
+            // the queue. Must be called with the state locked. Returns true
+            // if the queue dropped below the low watermark.
+            bool release(shared_state& queue, std::size_t count) {
+
+                queue.depth -= count;
+                stats.depth.store(queue.depth, std::memory_order_relaxed);
+
+                if (queue.congested && queue.depth <= low_watermark) {
+                    queue.congested = false;
+                    return true;
+                }
+
+                return false;
+            }
+
+            // Update depth and the counters after a datagram was added.
+            // Must be called with the state locked. Returns true if the
+            // queue reached the high watermark.
+            bool acquire(shared_state& queue) {
+
+                ++queue.depth;
+                stats.depth.store(queue.depth, std::memory_order_relaxed);
+
+                if (queue.depth > stats.peak_depth.load(
+                                      std::memory_order_relaxed))
+                    stats.peak_depth.store(queue.depth,
+                                           std::memory_order_relaxed);
+
+                if (bounded() && !queue.congested &&
+                    queue.depth >= high_watermark) {
+                    queue.congested = true;
+                    return true;
+                }
+
+                return false;
+            }
+        };
+    } // namespace detail
+
+} // namespace o::io::net
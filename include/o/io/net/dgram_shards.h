@@ -0,0 +1,180 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../ccy.h"
+#include "../../types.h"
+#include "socket_options.h"
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if defined(O_NET_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace o::io::net {
+
+#if defined(SO_REUSEPORT) || defined(DOXY_GENERATE)
+    /**
+     * A group of datagram devices that are all bound to the same endpoint
+     * using SO_REUSEPORT. Every device (shard) owns a socket and runs its own
+     * receive loop on a dedicated io_context and thread, so the kernel can
+     * balance flows between the shards without them contending on a single
+     * socket.
+     *
+     * Since every shard is only ever accessed from its own thread, Device
+     * should be a datagram_device with the o::ccy::unsafe option. It must
+     * be constructible from a `boost::asio::io_context&` followed by the
+     * extra arguments passed to the constructor of the group.
+     *
+     * Only available on platforms that define SO_REUSEPORT.
+     *
+     * @tparam  Device  Type of the shard device.
+     */
+    template <typename Device>
+    class dgram_shard_group {
+
+        using work_guard_type = boost::asio::executor_work_guard<
+            boost::asio::io_context::executor_type>;
+
+      public:
+        using device_type = Device;
+        using endpoint_type = typename Device::endpoint_type;
+
+        /**
+         * Create the shards
+         *
+         * @param   shards  The number of shards.
+         * @param   args    Extra arguments passed to every device.
+         */
+        template <typename... Args>
+        explicit dgram_shard_group(std::size_t shards, Args&&... args) {
+            for (std::size_t i = 0; i < shards; ++i) {
+                contexts_.emplace_back(
+                    std::make_unique<boost::asio::io_context>(1));
+                devices_.emplace_back(
+                    std::make_unique<Device>(*contexts_.back(), args...));
+            }
+        }
+
+        dgram_shard_group(const dgram_shard_group&) = delete;
+        dgram_shard_group& operator=(const dgram_shard_group&) = delete;
+
+        ~dgram_shard_group() { stop(); }
+
+        /**
+         * Open a socket for every shard, enable SO_REUSEPORT and bind it to
+         * the given endpoint. Errors will be reported through the
+         * on_dgram_error() handler of the affected shard, which is then
+         * not bound.
+         *
+         * @param   local_endp  The endpoint to bind to.
+         */
+        void bind(const endpoint_type& local_endp) {
+            for (auto& device : devices_) {
+                device->dgram_sock_open(local_endp.protocol());
+
+                if (device->dgram_sock().is_open() &&
+                    device->dgram_sock_option(options::reuse_port(true)))
+                    device->dgram_sock_bind(local_endp);
+            }
+        }
+
+        /**
+         * Start one thread per shard.
+         *
+         * @param   pin_threads If true, the thread of shard n will be pinned
+         *                      to cpu n (modulo the number of cpus). Only
+         *                      supported on linux.
+         */
+        void start(bool pin_threads = true) {
+
+            auto cpus = std::max(1u, std::thread::hardware_concurrency());
+
+            for (std::size_t i = 0; i < contexts_.size(); ++i) {
+
+                auto& ctx = *contexts_[i];
+
+                guards_.emplace_back(ctx.get_executor());
+                threads_.emplace_back([&ctx]() { ctx.run(); });
+
+#if defined(O_NET_LINUX)
+                if (pin_threads) {
+                    ::cpu_set_t cpu_set;
+                    CPU_ZERO(&cpu_set);
+                    CPU_SET(i % cpus, &cpu_set);
+                    ::pthread_setaffinity_np(threads_.back().native_handle(),
+                                             sizeof(cpu_set), &cpu_set);
+                }
+#endif
+            }
+        }
+
+        /**
+         * Close the sockets of all shards and wait for their threads to
+         * exit.
+         */
+        void stop() {
+
+            for (std::size_t i = 0; i < devices_.size(); ++i)
+                boost::asio::post(*contexts_[i],
+                                  [device = devices_[i].get()]() {
+                                      device->dgram_sock_close();
+                                  });
+
+            for (auto& guard : guards_) guard.reset();
+
+            std::for_each(threads_.begin(), threads_.end(),
+                          o::ccy::thread_join<std::thread>());
+
+            threads_.clear();
+            guards_.clear();
+        }
+
+        /** number of shards */
+        std::size_t size() const { return devices_.size(); }
+
+        Device& shard(std::size_t idx) { return *devices_[idx]; }
+
+        const Device& shard(std::size_t idx) const { return *devices_[idx]; }
+
+        boost::asio::io_context& context(std::size_t idx) {
+            return *contexts_[idx];
+        }
+
+      private:
+        std::vector<std::unique_ptr<boost::asio::io_context>> contexts_;
+        std::vector<std::unique_ptr<Device>> devices_;
+        std::vector<work_guard_type> guards_;
+        std::vector<std::thread> threads_;
+    };
+#endif
+
+} // namespace o::io::net
@@ -0,0 +1,465 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include "../timer.h"
+#include "udp_device.h"
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace o::io::net {
+
+    /**
+     * Parameters of a fragmenting_device.
+     */
+    struct frag_config {
+        /**
+         * maximum size of a datagram including the fragment header. Should
+         * fit into the path MTU without IP fragmentation. Must leave room
+         * for at least one byte after the 13 byte header.
+         */
+        std::size_t mtu = 1400;
+        /** time after which an incomplete message is dropped */
+        std::chrono::milliseconds timeout{2000};
+        /** memory that incomplete messages may occupy in total */
+        std::size_t memory_cap = 64 * 1024 * 1024;
+        /** largest message that will be reassembled */
+        std::size_t max_message = 16 * 1024 * 1024;
+    };
+
+    /**
+     * Counters of a fragmenting_device.
+     */
+    struct frag_stats {
+        /** messages that were reassembled from more than one fragment */
+        std::uint64_t reassembled = 0;
+        /** incomplete messages dropped after the timeout */
+        std::uint64_t timed_out = 0;
+        /** incomplete messages dropped to stay below the memory cap */
+        std::uint64_t evicted = 0;
+        /** datagrams without a valid fragment header */
+        std::uint64_t malformed = 0;
+        /** memory currently used by incomplete messages */
+        std::size_t pending_bytes = 0;
+    };
+
+    namespace detail {
+
+        // type (1), message id (4), index (2), count (2), total size (4)
+        constexpr std::size_t frag_header_size = 13;
+        constexpr std::uint8_t frag_type = 0xf7;
+        constexpr std::size_t frag_max_count = 0xffff;
+
+        inline void frag_put(char* out, std::uint32_t value, int bytes) {
+            for (int i = bytes - 1; i >= 0; --i, value >>= 8)
+                out[i] = static_cast<char>(value);
+        }
+
+        inline std::uint32_t frag_get(const char* in, int bytes) {
+            std::uint32_t value = 0;
+            for (int i = 0; i < bytes; ++i)
+                value = value << 8 | static_cast<unsigned char>(in[i]);
+            return value;
+        }
+
+        struct frag_header {
+            std::uint32_t id;
+            std::uint16_t index;
+            std::uint16_t count;
+            std::uint32_t total;
+
+            void write(char* out) const {
+                out[0] = static_cast<char>(frag_type);
+                frag_put(out + 1, id, 4);
+                frag_put(out + 5, index, 2);
+                frag_put(out + 7, count, 2);
+                frag_put(out + 9, total, 4);
+            }
+
+            // Parse and validate the header of a datagram of `size` bytes.
+            bool read(const char* in, std::size_t size) {
+
+                if (size < frag_header_size ||
+                    static_cast<std::uint8_t>(in[0]) != frag_type)
+                    return false;
+
+                id = frag_get(in + 1, 4);
+                index = static_cast<std::uint16_t>(frag_get(in + 5, 2));
+                count = static_cast<std::uint16_t>(frag_get(in + 7, 2));
+                total = frag_get(in + 9, 4);
+
+                return count && index < count &&
+                       (count == 1 || offset(count - 1) < total) &&
+                       size - frag_header_size == fragment_size(index);
+            }
+
+            // The payload is split into `count` chunks of equal size, only
+            // the last one may be shorter.
+            std::size_t chunk() const { return (total + count - 1) / count; }
+
+            std::size_t offset(std::size_t i) const { return i * chunk(); }
+
+            std::size_t fragment_size(std::size_t i) const {
+                return std::min<std::size_t>(chunk(), total - offset(i));
+            }
+        };
+
+        /**
+         * Collects the fragments of incomplete messages. Fragments are kept
+         * as the datagrams they arrived in, so an incomplete message only
+         * occupies the memory of the fragments that were received, and
+         * is copied once into its final buffer when it completes. Messages
+         * are dropped when they are older than the timeout or, oldest
+         * first, when the memory cap would be exceeded.
+         *
+         * @tparam  Endpoint            Type of the sender endpoint.
+         * @tparam  MessageContainer    Type of the datagrams and messages.
+         */
+        template <typename Endpoint, typename MessageContainer>
+        class frag_reassembler {
+
+          public:
+            using clock = std::chrono::steady_clock;
+
+            void configure(const frag_config& config) { config_ = &config; }
+
+            /**
+             * Add a fragment, the datagram it arrived in is taken over. If
+             * it completed a message, the message is moved into `out` and
+             * true is returned.
+             */
+            bool add(clock::time_point now, const Endpoint& remote,
+                     const frag_header& hdr, MessageContainer&& datagram,
+                     MessageContainer& out) {
+
+                if (hdr.total > config_->max_message ||
+                    hdr.total > config_->memory_cap)
+                    return false;
+
+                auto bytes = datagram.size() + fragment_overhead;
+
+                key k{remote, hdr.id};
+
+                // may drop the message of this fragment as well, it is
+                // started again then
+                make_room(bytes);
+
+                auto it = partials_.find(k);
+
+                if (it == partials_.end()) {
+                    it = partials_.emplace(k, partial()).first;
+
+                    auto& p = it->second;
+                    p.started = now;
+                    p.total = hdr.total;
+                    p.count = hdr.count;
+                    p.age = order_.insert(order_.end(), k);
+                }
+
+                auto& p = it->second;
+
+                // fragments of a different message that reused the id
+                if (p.total != hdr.total || p.count != hdr.count ||
+                    !p.fragments.try_emplace(hdr.index, std::move(datagram))
+                         .second)
+                    return false;
+
+                p.bytes += bytes;
+                pending_bytes_ += bytes;
+
+                if (p.fragments.size() != hdr.count) return false;
+
+                out.resize(hdr.total);
+
+                for (const auto& fragment : p.fragments) {
+                    auto* first =
+                        fragment.second.data() + frag_header_size;
+
+                    std::copy(first, first + hdr.fragment_size(fragment.first),
+                              out.begin() + hdr.offset(fragment.first));
+                }
+
+                erase(it);
+                ++reassembled_;
+
+                return true;
+            }
+
+            // Drop messages that did not complete within the timeout.
+            void expire(clock::time_point now) {
+                while (!order_.empty()) {
+                    auto it = partials_.find(order_.front());
+
+                    if (now - it->second.started < config_->timeout) break;
+
+                    erase(it);
+                    ++timed_out_;
+                }
+            }
+
+            frag_stats stats() const {
+                frag_stats out;
+                out.reassembled = reassembled_;
+                out.timed_out = timed_out_;
+                out.evicted = evicted_;
+                out.pending_bytes = pending_bytes_;
+                return out;
+            }
+
+          private:
+            struct key {
+                Endpoint remote;
+                std::uint32_t id;
+
+                bool operator<(const key& other) const {
+                    return remote < other.remote ||
+                           (!(other.remote < remote) && id < other.id);
+                }
+            };
+
+            // memory of a stored fragment beyond its bytes, roughly
+            static constexpr std::size_t fragment_overhead = 64;
+
+            struct partial {
+                // received datagrams by fragment index
+                std::map<std::uint16_t, MessageContainer> fragments;
+                std::size_t count = 0;
+                std::size_t total = 0;
+                std::size_t bytes = 0;
+                clock::time_point started;
+                typename std::list<key>::iterator age;
+            };
+
+            using partial_map = std::map<key, partial>;
+
+            void make_room(std::size_t bytes) {
+                while (!order_.empty() &&
+                       pending_bytes_ + bytes > config_->memory_cap) {
+                    erase(partials_.find(order_.front()));
+                    ++evicted_;
+                }
+            }
+
+            void erase(typename partial_map::iterator it) {
+                pending_bytes_ -= it->second.bytes;
+                order_.erase(it->second.age);
+                partials_.erase(it);
+            }
+
+            const frag_config* config_ = nullptr;
+            partial_map partials_;
+            // keys by age, oldest first
+            std::list<key> order_;
+            std::size_t pending_bytes_ = 0;
+            std::uint64_t reassembled_ = 0;
+            std::uint64_t timed_out_ = 0;
+            std::uint64_t evicted_ = 0;
+        };
+    } // namespace detail
+
+    /**
+     * A datagram device that sends messages larger than the MTU as a
+     * sequence of fragments and reassembles them on the receiving side,
+     * instead of relying on IP fragmentation.
+     *
+     * Every datagram carries a 13 byte header with the message id, the
+     * index of the fragment, the number of fragments and the total size,
+     * so both peers must use a fragmenting_device. Complete messages are
+     * passed to on_dgram_received() and on_dgram_received_from() like
+     * with a plain datagram_device. A message that is missing a fragment
+     * is dropped after frag_config::timeout. Receive buffers must be at
+     * least frag_config::mtu bytes (the default is 4096).
+     *
+     * @tparam  Protocol            Type of the protocol.
+     * @tparam  MessageContainer    Type of the message container. A
+     *                              contiguous container of char like
+     *                              std::string or std::vector<char>.
+     * @tparam  ConcurrencyOption   Type of the concurrency option.
+     */
+    template <typename Protocol, typename MessageContainer,
+              typename ConcurrencyOption>
+    class fragmenting_device
+        : public datagram_device<Protocol, MessageContainer,
+                                 ConcurrencyOption> {
+
+        using base_type =
+            datagram_device<Protocol, MessageContainer, ConcurrencyOption>;
+
+      public:
+        using typename base_type::endpoint_type;
+        using clock = std::chrono::steady_clock;
+
+        fragmenting_device() = delete;
+
+        /**
+         * Constructor
+         *
+         * @param [in,out]  ctx     The context.
+         * @param           config  Fragment size and reassembly limits.
+         *
+         * @throws  std::invalid_argument   If frag_config::mtu leaves no
+         *                                  room for a payload.
+         */
+        fragmenting_device(boost::asio::io_context& ctx,
+                           frag_config config = frag_config())
+            : base_type(ctx), config_(config) {
+
+            if (config_.mtu <= detail::frag_header_size)
+                throw std::invalid_argument(
+                    "fragmenting_device: mtu must exceed the fragment header");
+
+            reassembly_.apply([&](auto& r) { r.configure(config_); });
+
+            // a tick that already expired still runs after the timer was
+            // cancelled, it must not touch a destroyed device
+            std::weak_ptr<void> alive = alive_;
+
+            // a short timeout must not turn the timer into a busy loop
+            timer_ = o::io::every(ctx, std::max(config_.timeout / 4,
+                                                std::chrono::milliseconds(10)))
+                         .repeat([this, alive](boost::system::error_code ec) {
+                             if (ec || alive.expired()) return true;
+                             reassembly_.apply([](auto& r) {
+                                 r.expire(clock::now());
+                             });
+                             return false;
+                         });
+        }
+
+        virtual ~fragmenting_device() {
+            alive_.reset();
+            o::io::weak_timer_cancel(timer_);
+        }
+
+        /**
+         * Send a message, split into as many fragments as needed. Every
+         * fragment passes the pacer and the send queue on its own.
+         * Messages that need more than 65535 fragments are rejected with
+         * message_size.
+         *
+         * @param   endpoint    The endpoint.
+         * @param   message     The message.
+         */
+        void dgram_write(endpoint_type endpoint,
+                         MessageContainer&& message) override {
+
+            auto payload = config_.mtu - detail::frag_header_size;
+            auto count = std::max<std::size_t>(
+                1, (message.size() + payload - 1) / payload);
+
+            if (count > detail::frag_max_count ||
+                message.size() > config_.max_message)
+                return this->dgram_error_impl(
+                    base_type::error_case::connect,
+                    boost::asio::error::message_size);
+
+            detail::frag_header hdr{next_id_++,
+                                    0,
+                                    static_cast<std::uint16_t>(count),
+                                    static_cast<std::uint32_t>(
+                                        message.size())};
+
+            std::vector<char> fragment;
+
+            for (std::size_t i = 0; i < count; ++i) {
+                hdr.index = static_cast<std::uint16_t>(i);
+
+                auto size = hdr.fragment_size(i);
+                auto* first = message.data() + hdr.offset(i);
+
+                fragment.resize(detail::frag_header_size + size);
+                hdr.write(fragment.data());
+                std::copy(first, first + size,
+                          fragment.begin() + detail::frag_header_size);
+
+                base_type::dgram_write(
+                    endpoint,
+                    MessageContainer(fragment.begin(), fragment.end()));
+            }
+        }
+
+        /**
+         * @return  The reassembly counters.
+         */
+        frag_stats dgram_frag_stats() {
+            frag_stats out;
+            reassembly_.apply([&](auto& r) { out = r.stats(); });
+            out.malformed = malformed_.load(std::memory_order_relaxed);
+            return out;
+        }
+
+        void on_dgram_received_from(const endpoint_type& remote,
+                                    MessageContainer&& message) override {
+
+            detail::frag_header hdr;
+
+            if (!hdr.read(message.data(), message.size())) {
+                malformed_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            if (hdr.count == 1) {
+                message.erase(message.begin(),
+                              message.begin() + detail::frag_header_size);
+
+                return base_type::on_dgram_received_from(
+                    remote, std::forward<MessageContainer>(message));
+            }
+
+            bool complete = false;
+            MessageContainer data;
+
+            reassembly_.apply([&](auto& r) {
+                complete = r.add(clock::now(), remote, hdr,
+                                 std::forward<MessageContainer>(message), data);
+            });
+
+            if (complete)
+                base_type::on_dgram_received_from(remote, std::move(data));
+        }
+
+      private:
+        using reassembler_type =
+            detail::frag_reassembler<endpoint_type, MessageContainer>;
+
+        frag_config config_;
+        std::atomic<std::uint32_t> next_id_{0};
+        std::atomic<std::uint64_t> malformed_{0};
+        o::ccy::opt_safe_visitable<reassembler_type, ConcurrencyOption>
+            reassembly_;
+        o::io::weak_steady_timer timer_;
+        std::shared_ptr<void> alive_ = std::make_shared<bool>(true);
+    };
+
+} // namespace o::io::net
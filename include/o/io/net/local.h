@@ -0,0 +1,211 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+/**
+ * @file
+ *
+ * Helpers for unix domain sockets. datagram_device can be used with
+ * boost::asio::local::datagram_protocol, the endpoints created here work
+ * with stream sockets as well.
+ */
+
+#include "../../types.h"
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <string>
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#endif
+
+namespace o::io::net::local {
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS) || defined(DOXY_GENERATE)
+
+    /** unix domain datagram protocol */
+    using datagram_protocol = boost::asio::local::datagram_protocol;
+
+    /** unix domain stream protocol */
+    using stream_protocol = boost::asio::local::stream_protocol;
+
+#if defined(O_NET_LINUX) || defined(DOXY_GENERATE)
+    /**
+     * Create an endpoint in the linux abstract socket namespace. Abstract
+     * sockets do not appear in the file system and disappear with the last
+     * socket bound to them, so there is no stale socket file to remove.
+     *
+     * @tparam  Protocol    datagram_protocol or stream_protocol.
+     * @param   name        The name, without the leading null byte.
+     *
+     * @returns The endpoint.
+     */
+    template <typename Protocol = datagram_protocol>
+    typename Protocol::endpoint abstract_endpoint(const std::string& name) {
+        return typename Protocol::endpoint(std::string(1, '\0') + name);
+    }
+#endif
+
+    /**
+     * @return  true if the endpoint is in the abstract namespace.
+     */
+    template <typename Endpoint>
+    bool is_abstract(const Endpoint& endpoint) {
+        auto path = endpoint.path();
+        return !path.empty() && path[0] == '\0';
+    }
+
+    /**
+     * Remove the socket file a previous process left behind at the path of
+     * `endpoint`, so it can be bound again. Does nothing for abstract or
+     * unnamed endpoints.
+     *
+     * @param   endpoint    The endpoint.
+     *
+     * @returns false if the file existed and could not be removed.
+     */
+    template <typename Endpoint>
+    bool remove_stale(const Endpoint& endpoint) {
+
+        auto path = endpoint.path();
+
+        if (path.empty() || is_abstract(endpoint)) return true;
+
+        return ::unlink(path.c_str()) == 0 || errno == ENOENT;
+    }
+
+    /** maximum number of file descriptors passed with one call */
+    constexpr std::size_t max_passed_fds = 16;
+
+    /**
+     * Pass file descriptors to the peer of a connected unix domain socket
+     * (SCM_RIGHTS). The descriptors stay open in this process. Blocks until
+     * they were sent.
+     *
+     * @param           sock    A connected unix domain socket.
+     * @param           fds     The descriptors, at most max_passed_fds.
+     * @param [out]     ec      Set to indicate an error.
+     */
+    template <typename Socket>
+    void send_fds(Socket& sock, const std::vector<int>& fds,
+                  boost::system::error_code& ec) {
+
+        if (fds.empty() || fds.size() > max_passed_fds)
+            return void(ec = boost::asio::error::invalid_argument);
+
+        char byte = 0;
+        ::iovec iov{&byte, 1};
+        alignas(::cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                                   max_passed_fds)];
+
+        ::msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+        auto* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+        int flags = 0;
+#if defined(MSG_NOSIGNAL)
+        flags |= MSG_NOSIGNAL;
+#endif
+
+        if (::sendmsg(sock.native_handle(), &msg, flags) < 0)
+            ec = boost::system::error_code(
+                errno, boost::asio::error::get_system_category());
+        else
+            ec.clear();
+    }
+
+    /**
+     * Receive file descriptors that were sent with send_fds(). Blocks until
+     * they arrived. The caller owns the returned descriptors.
+     *
+     * @param           sock    A connected unix domain socket.
+     * @param [out]     ec      Set to indicate an error.
+     *
+     * @returns The descriptors.
+     */
+    template <typename Socket>
+    std::vector<int> receive_fds(Socket& sock, boost::system::error_code& ec) {
+
+        char byte;
+        ::iovec iov{&byte, 1};
+        alignas(::cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                                   max_passed_fds)];
+
+        ::msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        std::vector<int> fds;
+
+        int flags = 0;
+#if defined(MSG_CMSG_CLOEXEC)
+        flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+        auto res = ::recvmsg(sock.native_handle(), &msg, flags);
+
+        if (res <= 0) {
+            ec = res < 0 ? boost::system::error_code(
+                               errno, boost::asio::error::get_system_category())
+                         : boost::asio::error::eof;
+            return fds;
+        }
+
+        for (auto* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+
+            if (cmsg->cmsg_level != SOL_SOCKET ||
+                cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            auto first = fds.size();
+
+            fds.resize(first + count);
+            std::memcpy(fds.data() + first, CMSG_DATA(cmsg),
+                        count * sizeof(int));
+        }
+
+        ec.clear();
+        return fds;
+    }
+
+#endif
+
+} // namespace o::io::net::local
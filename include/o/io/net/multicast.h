@@ -0,0 +1,167 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include <boost/asio.hpp>
+#include <cstring>
+#include <string>
+
+#if defined(O_NET_POSIX)
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+namespace o::io::net {
+
+#if defined(O_NET_POSIX) || defined(DOXY_GENERATE)
+    /**
+     * Get the index of a network interface, as required to select the
+     * interface of a multicast group membership.
+     *
+     * @param   name    The name of the interface, for example "eth0".
+     *
+     * @returns The index of the interface or 0 if there is no such
+     *          interface.
+     */
+    inline unsigned int interface_index(const std::string& name) {
+        return ::if_nametoindex(name.c_str());
+    }
+#endif
+
+    namespace detail {
+
+        inline void dgram_to_sockaddr(const boost::asio::ip::address& addr,
+                                      ::sockaddr_storage& storage) {
+            boost::asio::ip::udp::endpoint endp(addr, 0);
+            std::memset(&storage, 0, sizeof(storage));
+            std::memcpy(&storage, endp.data(), endp.size());
+        }
+
+        /**
+         * Join or leave a multicast group, optionally restricted to a single
+         * source (source-specific multicast).
+         *
+         * @param [in,out]  sock    The socket.
+         * @param           join    Join if true, leave otherwise.
+         * @param           group   The multicast group.
+         * @param           source  The source or nullptr for any source.
+         * @param           iface   Index of the interface or 0 to let the
+         *                          system choose.
+         * @param [out]     ec      Set to indicate an error.
+         */
+        template <typename Socket>
+        void dgram_group_membership(Socket& sock, bool join,
+                                    const boost::asio::ip::address& group,
+                                    const boost::asio::ip::address* source,
+                                    unsigned int iface,
+                                    boost::system::error_code& ec) {
+#if defined(MCAST_JOIN_GROUP)
+            int level = group.is_v4() ? IPPROTO_IP : IPPROTO_IPV6;
+            int res;
+
+            if (!source) {
+                ::group_req req{};
+                req.gr_interface = iface;
+                dgram_to_sockaddr(group, req.gr_group);
+
+                res = ::setsockopt(sock.native_handle(), level,
+                                   join ? MCAST_JOIN_GROUP : MCAST_LEAVE_GROUP,
+                                   &req, sizeof(req));
+            } else {
+                ::group_source_req req{};
+                req.gsr_interface = iface;
+                dgram_to_sockaddr(group, req.gsr_group);
+                dgram_to_sockaddr(*source, req.gsr_source);
+
+                res = ::setsockopt(sock.native_handle(), level,
+                                   join ? MCAST_JOIN_SOURCE_GROUP
+                                        : MCAST_LEAVE_SOURCE_GROUP,
+                                   &req, sizeof(req));
+            }
+
+            if (res < 0)
+                ec = boost::system::error_code(
+                    errno, boost::asio::error::get_system_category());
+            else
+                ec.clear();
+#else
+            if (source) {
+                ec = boost::asio::error::operation_not_supported;
+                return;
+            }
+
+            namespace mc = boost::asio::ip::multicast;
+
+            if (group.is_v4() && join)
+                sock.set_option(mc::join_group(group.to_v4()), ec);
+            else if (group.is_v4())
+                sock.set_option(mc::leave_group(group.to_v4()), ec);
+            else if (join)
+                sock.set_option(mc::join_group(group.to_v6(), iface), ec);
+            else
+                sock.set_option(mc::leave_group(group.to_v6(), iface), ec);
+#endif
+        }
+
+        /**
+         * Ask the kernel to report the destination address of every
+         * datagram as ancillary data.
+         *
+         * @param [in,out]  sock    The socket.
+         * @param           family  The address family of the socket.
+         * @param [out]     ec      Set to indicate an error.
+         */
+        template <typename Socket>
+        void dgram_enable_pktinfo(Socket& sock, int family,
+                                  boost::system::error_code& ec) {
+            ec.clear();
+#if defined(O_NET_LINUX)
+            int on = 1;
+            int res = 0;
+
+            if (family == AF_INET)
+                res = ::setsockopt(sock.native_handle(), IPPROTO_IP, IP_PKTINFO,
+                                   &on, sizeof(on));
+            else if (family == AF_INET6) {
+                res = ::setsockopt(sock.native_handle(), IPPROTO_IPV6,
+                                   IPV6_RECVPKTINFO, &on, sizeof(on));
+
+                // v4-mapped traffic on dual stack sockets, may fail
+                if (!res)
+                    ::setsockopt(sock.native_handle(), IPPROTO_IP, IP_PKTINFO,
+                                 &on, sizeof(on));
+            }
+
+            if (res < 0)
+                ec = boost::system::error_code(
+                    errno, boost::asio::error::get_system_category());
+#endif
+        }
+    } // namespace detail
+
+} // namespace o::io::net
@@ -0,0 +1,626 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+/**
+ * @file
+ *
+ * Replays udp datagrams recorded in a pcap or pcapng file into the handlers
+ * of a datagram device, for benchmarks and to reproduce problems without a
+ * network.
+ */
+
+#include "../../types.h"
+#include "../histogram.h"
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(O_NET_POSIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace o::io::net {
+
+#if defined(O_NET_POSIX) || defined(DOXY_GENERATE)
+
+    /** How pcap_replay schedules the recorded datagrams */
+    enum class replay_timing {
+        /** deliver every datagram as soon as the previous handler returned */
+        fastest,
+        /** keep the gaps between the datagrams as recorded */
+        original
+    };
+
+    /** Counters of a replay */
+    struct replay_stats {
+        /** datagrams delivered to the device */
+        std::uint64_t delivered = 0;
+        /** payload bytes delivered to the device */
+        std::uint64_t bytes = 0;
+        /** packets that were not complete udp datagrams, e.g. tcp, ip
+         * fragments or truncated captures */
+        std::uint64_t skipped = 0;
+        /** wall clock time of the replay */
+        std::chrono::nanoseconds elapsed{0};
+    };
+
+    namespace detail {
+
+        // Reads the fields of a capture file in the byte order it was
+        // written in.
+        struct pcap_fields {
+            bool swapped = false;
+
+            std::uint16_t u16(const unsigned char* p) const {
+                std::uint16_t v;
+                std::memcpy(&v, p, sizeof(v));
+                return swapped ? __builtin_bswap16(v) : v;
+            }
+
+            std::uint32_t u32(const unsigned char* p) const {
+                std::uint32_t v;
+                std::memcpy(&v, p, sizeof(v));
+                return swapped ? __builtin_bswap32(v) : v;
+            }
+        };
+
+        inline std::uint16_t pcap_be16(const unsigned char* p) {
+            return static_cast<std::uint16_t>(p[0] << 8 | p[1]);
+        }
+
+        // A udp datagram found in a captured packet.
+        struct pcap_datagram {
+            const unsigned char* payload;
+            std::size_t size;
+            boost::asio::ip::udp::endpoint source;
+        };
+
+        // Find the udp datagram in an ip packet. Returns false for anything
+        // else, including fragments and datagrams that were truncated by
+        // the capture.
+        inline bool pcap_parse_ip(const unsigned char* p, std::size_t len,
+                                  pcap_datagram& out) {
+
+            if (len < 1) return false;
+
+            const unsigned char* udp;
+            std::size_t left;
+
+            if ((p[0] >> 4) == 4) {
+
+                std::size_t ihl = (p[0] & 0x0f) * 4;
+
+                if (len < 20 || ihl < 20 || len < ihl || p[9] != 17 ||
+                    pcap_be16(p + 2) < ihl || (pcap_be16(p + 6) & 0x3fff))
+                    return false;
+
+                boost::asio::ip::address_v4::bytes_type addr;
+                std::memcpy(addr.data(), p + 12, addr.size());
+                out.source.address(boost::asio::ip::address_v4(addr));
+
+                udp = p + ihl;
+                left = std::min<std::size_t>(len, pcap_be16(p + 2)) - ihl;
+
+            } else if ((p[0] >> 4) == 6) {
+
+                if (len < 40) return false;
+
+                unsigned next = p[6];
+                std::size_t off = 40;
+
+                // hop-by-hop, routing and destination options
+                while ((next == 0 || next == 43 || next == 60) &&
+                       off + 8 <= len) {
+                    next = p[off];
+                    off += (p[off + 1] + 1) * 8;
+                }
+
+                if (next != 17 || off > len) return false;
+
+                boost::asio::ip::address_v6::bytes_type addr;
+                std::memcpy(addr.data(), p + 8, addr.size());
+                out.source.address(boost::asio::ip::address_v6(addr));
+
+                udp = p + off;
+                left = len - off;
+
+            } else
+                return false;
+
+            if (left < 8) return false;
+
+            std::size_t udp_len = pcap_be16(udp + 4);
+
+            if (udp_len < 8 || udp_len > left) return false;
+
+            out.source.port(pcap_be16(udp));
+            out.payload = udp + 8;
+            out.size = udp_len - 8;
+
+            return true;
+        }
+
+        // Find the udp datagram in a packet with the given link type.
+        inline bool pcap_parse_link(std::uint32_t linktype,
+                                    const unsigned char* p, std::size_t len,
+                                    pcap_datagram& out) {
+
+            std::size_t off = 0;
+            std::uint16_t ethertype = 0;
+
+            switch (linktype) {
+            case 0:   // NULL
+            case 108: // LOOP
+                return len > 4 && pcap_parse_ip(p + 4, len - 4, out);
+            case 1: // ethernet
+                if (len < 14) return false;
+                ethertype = pcap_be16(p + 12);
+                off = 14;
+                // vlan tags
+                while ((ethertype == 0x8100 || ethertype == 0x88a8) &&
+                       off + 4 <= len) {
+                    ethertype = pcap_be16(p + off + 2);
+                    off += 4;
+                }
+                break;
+            case 113: // linux cooked capture
+                if (len < 16) return false;
+                ethertype = pcap_be16(p + 14);
+                off = 16;
+                break;
+            case 276: // linux cooked capture v2
+                if (len < 20) return false;
+                ethertype = pcap_be16(p);
+                off = 20;
+                break;
+            case 12:  // RAW on some systems
+            case 14:  // RAW on others
+            case 101: // RAW
+            case 228: // IPV4
+            case 229: // IPV6
+                return pcap_parse_ip(p, len, out);
+            default:
+                return false;
+            }
+
+            if (ethertype != 0x0800 && ethertype != 0x86dd) return false;
+
+            return off < len && pcap_parse_ip(p + off, len - off, out);
+        }
+
+        // Calls f(timestamp_ns, linktype, data, caplen) for every packet of
+        // a pcap or pcapng file. Returns false if the file is malformed.
+        template <typename F>
+        bool pcap_for_each(const unsigned char* p, std::size_t size, F&& f) {
+
+            if (size < 24) return false;
+
+            std::uint32_t magic;
+            std::memcpy(&magic, p, sizeof(magic));
+
+            pcap_fields fields;
+
+            // classic pcap, microsecond or nanosecond timestamps
+            if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 ||
+                magic == 0xa1b23c4d || magic == 0x4d3cb2a1) {
+
+                fields.swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+                std::uint64_t frac_ns =
+                    (magic == 0xa1b23c4d || magic == 0x4d3cb2a1) ? 1 : 1000;
+                std::uint32_t linktype = fields.u32(p + 20) & 0x0fffffff;
+
+                std::size_t off = 24;
+
+                while (off + 16 <= size) {
+                    std::uint32_t caplen = fields.u32(p + off + 8);
+
+                    if (caplen > size - off - 16) return false;
+
+                    std::uint64_t ts =
+                        fields.u32(p + off) * std::uint64_t(1000000000) +
+                        fields.u32(p + off + 4) * frac_ns;
+
+                    f(ts, linktype, p + off + 16, std::size_t(caplen));
+                    off += 16 + caplen;
+                }
+
+                return off == size;
+            }
+
+            // pcapng, a sequence of blocks
+            if (magic != 0x0a0d0d0a) return false;
+
+            struct interface {
+                std::uint32_t linktype;
+                // timestamp units per second, and the shift if binary
+                long double units;
+            };
+
+            std::vector<interface> interfaces;
+            std::uint64_t last_ts = 0;
+            std::size_t off = 0;
+
+            while (off + 12 <= size) {
+
+                std::uint32_t type;
+                std::memcpy(&type, p + off, sizeof(type));
+
+                if (type == 0x0a0d0d0a) {
+                    // section header, determines the byte order
+                    std::uint32_t bom;
+                    std::memcpy(&bom, p + off + 8, sizeof(bom));
+
+                    if (bom != 0x1a2b3c4d && bom != 0x4d3c2b1a) return false;
+
+                    fields.swapped = bom == 0x4d3c2b1a;
+                    interfaces.clear();
+                } else
+                    type = fields.u32(p + off);
+
+                std::uint32_t len = fields.u32(p + off + 4);
+
+                if (len < 12 || len % 4 || len > size - off) return false;
+
+                const unsigned char* body = p + off + 8;
+                std::size_t body_len = len - 12;
+
+                if (type == 1 && body_len >= 8) {
+                    // interface description
+                    interface itf{fields.u16(body), 1000000.0L};
+
+                    // look for the timestamp resolution option
+                    std::size_t opt = 8;
+                    while (opt + 4 <= body_len) {
+                        auto code = fields.u16(body + opt);
+                        auto opt_len = fields.u16(body + opt + 2);
+
+                        if (code == 0 || opt + 4 + opt_len > body_len) break;
+
+                        if (code == 9 && opt_len >= 1) {
+                            auto res = body[opt + 4];
+                            itf.units = (res & 0x80)
+                                            ? std::ldexp(1.0L, res & 0x7f)
+                                            : std::pow(10.0L, res);
+                        }
+
+                        opt += 4 + ((opt_len + 3) & ~3u);
+                    }
+
+                    interfaces.push_back(itf);
+
+                } else if (type == 6 && body_len >= 20) {
+                    // enhanced packet
+                    auto id = fields.u32(body);
+                    auto caplen = fields.u32(body + 12);
+
+                    if (id >= interfaces.size() || caplen > body_len - 20)
+                        return false;
+
+                    std::uint64_t raw =
+                        std::uint64_t(fields.u32(body + 4)) << 32 |
+                        fields.u32(body + 8);
+
+                    auto ns = raw / interfaces[id].units * 1e9L;
+
+                    // a crafted resolution can scale the timestamp beyond
+                    // 64 bits
+                    if (!(ns < std::ldexp(1.0L, 64))) return false;
+
+                    last_ts = static_cast<std::uint64_t>(ns);
+
+                    f(last_ts, interfaces[id].linktype, body + 20,
+                      std::size_t(caplen));
+
+                } else if (type == 3 && body_len >= 4) {
+                    // simple packet, no timestamp
+                    if (interfaces.empty()) return false;
+
+                    auto caplen = std::min<std::size_t>(fields.u32(body),
+                                                        body_len - 4);
+
+                    f(last_ts, interfaces[0].linktype, body + 4, caplen);
+                }
+
+                off += len;
+            }
+
+            return off == size;
+        }
+    } // namespace detail
+
+    /**
+     * Replays the udp datagrams of a capture file into a datagram device.
+     * Every datagram is passed to on_dgram_received_from() of the device,
+     * with the payload and the source endpoint as recorded. Everything
+     * else in the capture is skipped.
+     *
+     * The file is mapped into memory, so the replay itself does not
+     * allocate besides the message containers handed to the device. The
+     * device does not have to be bound, but handlers that send will fail
+     * on an unbound socket.
+     *
+     * The time spent in the handler is recorded for every datagram, see
+     * handler_latency(). With replay_timing::original, the delay between
+     * the recorded time of a datagram and the time it was delivered is
+     * recorded as well, see schedule_lag(). It shows whether the handlers
+     * keep up with the recorded rate.
+     *
+     * Supports classic pcap files with microsecond or nanosecond
+     * timestamps and pcapng files, with ethernet, linux cooked, loopback
+     * and raw ip link types.
+     *
+     * @tparam  Device  The device, a datagram_device or a class derived from
+     *                  it, for the udp protocol.
+     */
+    template <typename Device>
+    class pcap_replay {
+
+        static_assert(std::is_same<typename Device::protocol_type,
+                                   boost::asio::ip::udp>::value,
+                      "pcap_replay only replays udp datagrams");
+
+      public:
+        using clock = std::chrono::steady_clock;
+
+        /**
+         * Constructor
+         *
+         * @param [in,out]  device  The device to pass the datagrams to.
+         */
+        explicit pcap_replay(Device& device) : device_(device) {}
+
+        pcap_replay(const pcap_replay&) = delete;
+        pcap_replay& operator=(const pcap_replay&) = delete;
+
+        ~pcap_replay() { close(); }
+
+        /**
+         * Map a capture file.
+         *
+         * @param   path    Path of the file.
+         * @param [out] ec  Set on error.
+         */
+        void open(const std::string& path, boost::system::error_code& ec) {
+
+            close();
+
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct ::stat st;
+
+            if (fd < 0 || ::fstat(fd, &st) < 0) {
+                ec = last_error_impl();
+                if (fd >= 0) ::close(fd);
+                return;
+            }
+
+            auto* base = st.st_size > 0
+                             ? ::mmap(nullptr, st.st_size, PROT_READ,
+                                      MAP_PRIVATE, fd, 0)
+                             : MAP_FAILED;
+
+            if (base == MAP_FAILED) {
+                ec = st.st_size > 0 ? last_error_impl()
+                                    : make_error_code(
+                                          boost::system::errc::bad_message);
+                ::close(fd);
+                return;
+            }
+
+            ::close(fd);
+            ::madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+            data_ = static_cast<const unsigned char*>(base);
+            size_ = static_cast<std::size_t>(st.st_size);
+            ec = {};
+        }
+
+        /**
+         * Unmap the capture file.
+         */
+        void close() {
+            if (data_)
+                ::munmap(const_cast<unsigned char*>(data_), size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+
+        /**
+         * Replay the whole file on the calling thread. Can be called again
+         * to replay the file once more, the statistics are reset.
+         *
+         * @param   timing  How to schedule the datagrams.
+         * @param   speed   With replay_timing::original, a factor applied
+         *                  to the recorded rate, 2.0 replays twice as fast.
+         *                  Must be positive.
+         * @param [out] ec  Set if no file is open, the speed is not
+         *                  positive or the file is malformed. The datagrams
+         *                  before the malformed part were replayed.
+         */
+        void replay(replay_timing timing, double speed,
+                    boost::system::error_code& ec) {
+
+            using namespace std::chrono;
+
+            stats_ = replay_stats();
+            latency_.reset();
+            lag_.reset();
+
+            if (!data_) {
+                ec = make_error_code(boost::system::errc::bad_file_descriptor);
+                return;
+            }
+
+            if (timing == replay_timing::original && !(speed > 0)) {
+                ec = make_error_code(boost::system::errc::invalid_argument);
+                return;
+            }
+
+            bool first = true;
+            std::uint64_t first_ts = 0;
+            std::uint64_t last_ts = 0;
+            auto start = clock::now();
+
+            bool ok = detail::pcap_for_each(
+                data_, size_,
+                [&](std::uint64_t ts, std::uint32_t linktype,
+                    const unsigned char* p, std::size_t len) {
+                    detail::pcap_datagram dgram;
+
+                    if (!detail::pcap_parse_link(linktype, p, len, dgram)) {
+                        ++stats_.skipped;
+                        return;
+                    }
+
+                    if (first) {
+                        first = false;
+                        first_ts = last_ts = ts;
+                        start = clock::now();
+                    }
+
+                    // merged captures can go back in time, such datagrams
+                    // are delivered right after the previous one
+                    last_ts = ts = std::max(ts, last_ts);
+
+                    if (timing == replay_timing::original) {
+                        // a very low speed must not overflow the offset
+                        auto offset = std::min((ts - first_ts) / speed, 9e18);
+                        auto due =
+                            start + duration_cast<clock::duration>(nanoseconds(
+                                        static_cast<std::int64_t>(offset)));
+                        wait_until_impl(due);
+                        lag_.record(clock::now() - due);
+                    }
+
+                    auto* payload =
+                        reinterpret_cast<const char*>(dgram.payload);
+                    auto begin = clock::now();
+
+                    device_.on_dgram_received_from(
+                        dgram.source,
+                        typename Device::message_type(payload,
+                                                      payload + dgram.size));
+
+                    latency_.record(clock::now() - begin);
+
+                    ++stats_.delivered;
+                    stats_.bytes += dgram.size;
+                });
+
+            stats_.elapsed = duration_cast<nanoseconds>(clock::now() - start);
+            ec = ok ? boost::system::error_code()
+                    : make_error_code(boost::system::errc::bad_message);
+        }
+
+        /**
+         * Replay the whole file as fast as possible.
+         *
+         * @param [out] ec  Set if no file is open or the file is malformed.
+         */
+        void replay(boost::system::error_code& ec) {
+            replay(replay_timing::fastest, 1.0, ec);
+        }
+
+        /** counters of the last replay */
+        const replay_stats& stats() const { return stats_; }
+
+        /** time spent in the handlers of the device, in nanoseconds */
+        const o::io::histogram& handler_latency() const { return latency_; }
+
+        /** how late datagrams were delivered with replay_timing::original,
+         * in nanoseconds */
+        const o::io::histogram& schedule_lag() const { return lag_; }
+
+        /**
+         * Write a report of the last replay.
+         *
+         * @param [in,out]  os  The stream to write to.
+         */
+        void write_report(std::ostream& os) const {
+
+            double secs =
+                std::chrono::duration<double>(stats_.elapsed).count();
+
+            os << "delivered=" << stats_.delivered
+               << " bytes=" << stats_.bytes << " skipped=" << stats_.skipped
+               << " seconds=" << secs;
+
+            if (secs > 0)
+                os << " rate=" << static_cast<std::uint64_t>(
+                                      stats_.delivered / secs)
+                   << "/s";
+
+            os << "\nhandler ns: ";
+            latency_.write_summary(os);
+
+            if (lag_.count()) {
+                os << "\nlag ns: ";
+                lag_.write_summary(os);
+            }
+
+            os << "\n";
+        }
+
+      private:
+        // sleep for most of the wait, spin for the rest to be accurate
+        static void wait_until_impl(clock::time_point due) {
+
+            constexpr auto spin = std::chrono::microseconds(100);
+
+            auto now = clock::now();
+
+            if (due - now > spin) std::this_thread::sleep_until(due - spin);
+
+            while (clock::now() < due) {}
+        }
+
+        static boost::system::error_code last_error_impl() {
+            return boost::system::error_code(
+                errno, boost::asio::error::get_system_category());
+        }
+
+        Device& device_;
+        const unsigned char* data_ = nullptr;
+        std::size_t size_ = 0;
+        replay_stats stats_;
+        o::io::histogram latency_;
+        o::io::histogram lag_;
+    };
+
+#endif
+
+} // namespace o::io::net
@@ -0,0 +1,791 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include "../timer.h"
+#include "udp_device.h"
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace o::io::net {
+
+    /**
+     * How a reliable channel hands messages to the application.
+     */
+    enum class rel_delivery {
+        /** in the order they were sent */
+        ordered,
+        /** as soon as they arrive, every message exactly once */
+        unordered
+    };
+
+    /**
+     * Tuning parameters of a reliable_device.
+     */
+    struct rel_config {
+        /** interval of the retransmission timer */
+        std::chrono::milliseconds tick{5};
+        /** retransmission timeout before the first round trip was measured */
+        std::chrono::milliseconds initial_rto{100};
+        /** lower bound of the retransmission timeout */
+        std::chrono::milliseconds min_rto{10};
+        /** upper bound of the retransmission timeout */
+        std::chrono::milliseconds max_rto{2000};
+        /** transmissions of a message before the peer is given up */
+        unsigned max_transmissions = 10;
+        /** initial congestion window in messages */
+        double initial_window = 4;
+        /** upper bound of the congestion window in messages */
+        double max_window = 1024;
+        /** time without traffic after which the state of a peer is dropped */
+        std::chrono::milliseconds peer_timeout{60000};
+        /** number of peers that get state when they send to the device */
+        std::size_t max_peers = 4096;
+        /** bytes of out of order messages held per peer */
+        std::size_t max_buffered = std::size_t(4) << 20;
+    };
+
+    namespace detail {
+
+        enum class rel_packet : std::uint8_t { data = 1, ack = 2 };
+
+        // data: type, channel, incarnation (4), seq (4)
+        // ack:  type, channel, incarnation (4), cumulative ack (4),
+        //       selective acks (4)
+        //
+        // The incarnation is chosen at random whenever a device creates the
+        // state of a peer. Acks echo the incarnation of the data they
+        // acknowledge.
+        constexpr std::size_t rel_data_header = 10;
+        constexpr std::size_t rel_ack_size = 14;
+
+        inline void rel_put_u32(char* out, std::uint32_t value) {
+            out[0] = static_cast<char>(value >> 24);
+            out[1] = static_cast<char>(value >> 16);
+            out[2] = static_cast<char>(value >> 8);
+            out[3] = static_cast<char>(value);
+        }
+
+        inline std::uint32_t rel_get_u32(const char* in) {
+            auto byte = [&](int i) {
+                return static_cast<std::uint32_t>(
+                    static_cast<unsigned char>(in[i]));
+            };
+            return byte(0) << 24 | byte(1) << 16 | byte(2) << 8 | byte(3);
+        }
+
+        // Extend a 32 bit sequence number that was received on the wire to
+        // the 64 bit sequence number closest to `reference`.
+        inline std::uint64_t rel_unwrap(std::uint32_t wire,
+                                        std::uint64_t reference) {
+            auto delta = static_cast<std::int32_t>(
+                wire - static_cast<std::uint32_t>(reference));
+            auto out = static_cast<std::int64_t>(reference) + delta;
+            return out < 0 ? wire : static_cast<std::uint64_t>(out);
+        }
+
+        /**
+         * Receiving side of a reliable channel. Tracks which sequence
+         * numbers arrived and holds messages that arrived out of order.
+         *
+         * @tparam  MessageContainer    Type of the message.
+         */
+        template <typename MessageContainer>
+        class rel_receiver {
+
+          public:
+            // Messages further ahead than this are dropped, the sender
+            // retransmits them once the gap is closed.
+            static constexpr std::uint64_t max_ahead = 4096;
+
+            /**
+             * Accept a message. Appends everything that can be delivered
+             * now to `out`. Messages that have to be held back are counted
+             * in `buffered` and dropped if that would exceed `limit`.
+             */
+            void receive(std::uint32_t wire_seq, MessageContainer&& payload,
+                         rel_delivery mode,
+                         std::vector<MessageContainer>& out,
+                         std::size_t& buffered, std::size_t limit) {
+
+                auto seq = rel_unwrap(wire_seq, next_);
+
+                if (seq < next_ || seq >= next_ + max_ahead ||
+                    ahead_.count(seq))
+                    return;
+
+                if (mode == rel_delivery::unordered) {
+                    out.push_back(std::move(payload));
+                    ahead_.emplace(seq, MessageContainer());
+                } else {
+                    if (seq != next_ && buffered + payload.size() > limit)
+                        return;
+
+                    buffered += payload.size();
+                    ahead_.emplace(seq, std::move(payload));
+                }
+
+                for (auto it = ahead_.begin();
+                     it != ahead_.end() && it->first == next_;
+                     it = ahead_.erase(it), ++next_) {
+                    buffered -= it->second.size();
+
+                    if (mode == rel_delivery::ordered)
+                        out.push_back(std::move(it->second));
+                }
+            }
+
+            // Write the cumulative ack and a bitmap of the 32 sequence
+            // numbers that follow it.
+            void write_ack(char* out) const {
+
+                std::uint32_t bits = 0;
+
+                for (const auto& held : ahead_) {
+                    auto bit = held.first - next_ - 1;
+                    if (bit >= 32) break;
+                    bits |= std::uint32_t(1) << bit;
+                }
+
+                rel_put_u32(out, static_cast<std::uint32_t>(next_));
+                rel_put_u32(out + 4, bits);
+            }
+
+          private:
+            std::uint64_t next_ = 0;
+            std::map<std::uint64_t, MessageContainer> ahead_;
+        };
+
+        /**
+         * Sending side of a reliable channel. Keeps sent messages until
+         * they are acknowledged, estimates the round trip time and limits
+         * the messages in flight with a congestion window that grows with
+         * slow start and additive increase and shrinks on loss.
+         *
+         * @tparam  MessageContainer    Type of the message.
+         */
+        template <typename MessageContainer>
+        class rel_sender {
+
+          public:
+            using clock = std::chrono::steady_clock;
+
+            explicit rel_sender(const rel_config& config)
+                : config_(&config), rto_(config.initial_rto)
+                , window_(config.initial_window) {}
+
+            // Queue a packet. Its sequence number is written into the data
+            // header, the incarnation must already be set.
+            void push(MessageContainer&& packet) {
+                waiting_.push_back(std::forward<MessageContainer>(packet));
+            }
+
+            // Move packets that fit into the window to `out`.
+            template <typename Out>
+            void transmit(clock::time_point now, Out&& out) {
+
+                while (!waiting_.empty() && in_flight_ < window_) {
+                    segment seg{next_seq_++,
+                                std::move(waiting_.front()), now, 1};
+                    waiting_.pop_front();
+
+                    rel_put_u32(&seg.packet[6],
+                                static_cast<std::uint32_t>(seg.seq));
+
+                    out(MessageContainer(seg.packet));
+
+                    unacked_.push_back(std::move(seg));
+                    ++in_flight_;
+                }
+            }
+
+            // Process an acknowledgement. Retransmissions triggered by
+            // selective acks are passed to `out`.
+            template <typename Out>
+            void acknowledge(clock::time_point now, std::uint32_t wire_cum,
+                             std::uint32_t bits, Out&& out) {
+
+                if (unacked_.empty()) return;
+
+                auto cum = rel_unwrap(wire_cum, unacked_.front().seq);
+
+                std::size_t newly_acked = 0;
+
+                while (!unacked_.empty() && unacked_.front().seq < cum) {
+                    auto& seg = unacked_.front();
+
+                    if (!seg.acked) {
+                        acked(now, seg);
+                        ++newly_acked;
+                    }
+
+                    unacked_.pop_front();
+                }
+
+                std::uint64_t highest_sacked = 0;
+
+                for (auto& seg : unacked_) {
+                    auto bit = seg.seq - cum - 1;
+
+                    if (seg.seq > cum && bit < 32 && (bits >> bit) & 1) {
+                        if (!seg.acked) {
+                            seg.acked = true;
+                            acked(now, seg);
+                            ++newly_acked;
+                        }
+                        highest_sacked = seg.seq;
+                    }
+                }
+
+                grow(newly_acked);
+
+                // a message that is missing while three later ones arrived
+                // is considered lost. The window shrinks once per ack.
+                bool lost = false;
+
+                for (auto& seg : unacked_) {
+                    if (seg.seq >= highest_sacked) break;
+
+                    if (seg.acked || ++seg.dups != 3) continue;
+
+                    if (!lost) shrink();
+
+                    lost = true;
+                    retransmit(now, seg, out);
+                }
+            }
+
+            // Retransmit messages whose timeout expired. Returns false if
+            // a message exceeded the maximum number of transmissions.
+            template <typename Out>
+            bool expire(clock::time_point now, Out&& out) {
+
+                bool expired = false;
+                std::size_t budget = 0;
+
+                for (auto& seg : unacked_) {
+                    if (seg.acked || now - seg.sent_at < rto_) continue;
+
+                    if (seg.transmissions >= config_->max_transmissions)
+                        return false;
+
+                    if (!expired) {
+                        expired = true;
+                        shrink();
+                        window_ = 1;
+                        budget = std::max<std::size_t>(1, ssthresh_);
+                    }
+
+                    if (!budget--) break;
+
+                    retransmit(now, seg, out);
+                }
+
+                if (expired)
+                    rto_ = std::min<clock::duration>(rto_ * 2,
+                                                     config_->max_rto);
+
+                return true;
+            }
+
+            bool idle() const { return unacked_.empty() && waiting_.empty(); }
+
+            clock::duration rto() const { return rto_; }
+
+            clock::duration srtt() const { return srtt_; }
+
+            double window() const { return window_; }
+
+            std::uint64_t retransmissions() const { return retransmissions_; }
+
+          private:
+            struct segment {
+                std::uint64_t seq;
+                MessageContainer packet;
+                clock::time_point sent_at;
+                unsigned transmissions;
+                unsigned dups = 0;
+                bool acked = false;
+            };
+
+            void acked(clock::time_point now, const segment& seg) {
+
+                --in_flight_;
+
+                // Karn: only measure messages that were sent once
+                if (seg.transmissions == 1) sample(now - seg.sent_at);
+            }
+
+            // RFC 6298 round trip estimation
+            void sample(clock::duration rtt) {
+
+                if (srtt_ == clock::duration::zero()) {
+                    srtt_ = rtt;
+                    rttvar_ = rtt / 2;
+                } else {
+                    auto err = rtt > srtt_ ? rtt - srtt_ : srtt_ - rtt;
+                    rttvar_ = (rttvar_ * 3 + err) / 4;
+                    srtt_ = (srtt_ * 7 + rtt) / 8;
+                }
+
+                rto_ = std::clamp<clock::duration>(srtt_ + rttvar_ * 4,
+                                                   config_->min_rto,
+                                                   config_->max_rto);
+            }
+
+            void grow(std::size_t acked) {
+                for (; acked; --acked)
+                    window_ += window_ < ssthresh_ ? 1 : 1 / window_;
+
+                window_ = std::min(window_, config_->max_window);
+            }
+
+            void shrink() {
+                ssthresh_ = std::max(window_ / 2, 2.0);
+                window_ = ssthresh_;
+            }
+
+            template <typename Out>
+            void retransmit(clock::time_point now, segment& seg, Out&& out) {
+                seg.sent_at = now;
+                seg.dups = 0;
+                ++seg.transmissions;
+                ++retransmissions_;
+                out(MessageContainer(seg.packet));
+            }
+
+            const rel_config* config_;
+            std::uint64_t next_seq_ = 0;
+            std::deque<MessageContainer> waiting_;
+            std::deque<segment> unacked_;
+            std::size_t in_flight_ = 0;
+            clock::duration rto_;
+            clock::duration srtt_ = clock::duration::zero();
+            clock::duration rttvar_ = clock::duration::zero();
+            double window_;
+            double ssthresh_ = 1e9;
+            std::uint64_t retransmissions_ = 0;
+        };
+    } // namespace detail
+
+    /**
+     * A datagram device that adds reliable channels on top of UDP.
+     *
+     * Every peer endpoint has up to 256 independent channels. Messages on
+     * a channel carry a sequence number and are acknowledged with a
+     * cumulative ack plus a bitmap of the 32 messages that follow it.
+     * Unacknowledged messages are retransmitted after a timeout derived
+     * from the measured round trip time, or as soon as three later
+     * messages were acknowledged. The number of messages in flight per
+     * channel is limited by a congestion window.
+     *
+     * A channel is either ordered or unordered (see rel_channel()). Since
+     * every channel has its own sequence space, a lost message only holds
+     * back later messages on the same ordered channel.
+     *
+     * Retransmissions are driven by a timer created with o::io::every()
+     * that ticks every rel_config::tick. The timer also drops the state of
+     * peers that neither sent nor received anything for
+     * rel_config::peer_timeout, both peers should use the same timeout.
+     * Datagrams from new peers are ignored while rel_config::max_peers
+     * peers have state.
+     *
+     * Every time a device creates the state of a peer it picks a random
+     * incarnation that is sent with every data packet and echoed in the
+     * acks. A peer that restarted, or dropped the state after
+     * rel_config::peer_timeout, starts over with sequence number 0 under a
+     * new incarnation. The receiver then discards what it knew about the
+     * old one, and the sender ignores acks for an incarnation other than
+     * its own, so old acks never acknowledge new messages.
+     *
+     * @tparam  Protocol            Type of the protocol.
+     * @tparam  MessageContainer    Type of the message container. A
+     *                              contiguous container of char like
+     *                              std::string or std::vector<char>.
+     * @tparam  ConcurrencyOption   Type of the concurrency option.
+     */
+    template <typename Protocol, typename MessageContainer,
+              typename ConcurrencyOption>
+    class reliable_device
+        : public datagram_device<Protocol, MessageContainer,
+                                 ConcurrencyOption> {
+
+        using base_type =
+            datagram_device<Protocol, MessageContainer, ConcurrencyOption>;
+
+      public:
+        using typename base_type::endpoint_type;
+        using clock = std::chrono::steady_clock;
+
+        reliable_device() = delete;
+
+        /**
+         * Constructor
+         *
+         * @param [in,out]  ctx     The context.
+         * @param           config  Tuning parameters.
+         */
+        reliable_device(boost::asio::io_context& ctx,
+                        rel_config config = rel_config())
+            : base_type(ctx), config_(config) {
+
+            // a tick that already expired still runs after the timer was
+            // cancelled, it must not touch a destroyed device
+            std::weak_ptr<void> alive = alive_;
+
+            timer_ = o::io::every(ctx, config_.tick)
+                         .repeat([this, alive](boost::system::error_code ec) {
+                             if (ec || alive.expired()) return true;
+                             rel_tick_impl();
+                             return false;
+                         });
+        }
+
+        virtual ~reliable_device() {
+            alive_.reset();
+            o::io::weak_timer_cancel(timer_);
+        }
+
+        /**
+         * Called when a message was received on a reliable channel.
+         *
+         * @param   remote  The peer that sent the message.
+         * @param   channel The channel the message was sent on.
+         * @param   message The message.
+         */
+        virtual void on_rel_received(const endpoint_type& remote,
+                                     std::uint8_t channel,
+                                     MessageContainer&& message) = 0;
+
+        /**
+         * Called when a message to `remote` was not acknowledged after
+         * rel_config::max_transmissions attempts. All state of the peer is
+         * discarded, including messages that were not sent yet.
+         *
+         * @param   remote  The peer.
+         */
+        virtual void on_rel_peer_lost(const endpoint_type&) {}
+
+        /**
+         * Set the delivery mode of a channel. Both peers must use the same
+         * mode. Channels are ordered by default.
+         *
+         * @param   channel The channel.
+         * @param   mode    The delivery mode.
+         */
+        void rel_channel(std::uint8_t channel, rel_delivery mode) {
+            state_.apply([&](auto& state) { state.modes[channel] = mode; });
+        }
+
+        /**
+         * Send a message on a reliable channel.
+         *
+         * @param   remote  The peer.
+         * @param   channel The channel.
+         * @param   message The message.
+         */
+        void rel_send(const endpoint_type& remote, std::uint8_t channel,
+                      const MessageContainer& message) {
+
+            MessageContainer packet;
+            packet.resize(detail::rel_data_header + message.size());
+            packet[0] = static_cast<char>(detail::rel_packet::data);
+            packet[1] = static_cast<char>(channel);
+            std::copy(message.begin(), message.end(),
+                      packet.begin() + detail::rel_data_header);
+
+            std::vector<MessageContainer> out;
+            auto now = clock::now();
+
+            state_.apply([&](auto& state) {
+                auto* p = peer_for(state, remote, now, false);
+                auto& sender = p->sender(channel, config_);
+
+                detail::rel_put_u32(&packet[2], p->incarnation);
+
+                sender.push(std::move(packet));
+                sender.transmit(now, [&](MessageContainer&& p) {
+                    out.push_back(std::move(p));
+                });
+            });
+
+            for (auto& p : out) this->dgram_write(remote, std::move(p));
+        }
+
+        /**
+         * @return  The smoothed round trip time to `remote` on `channel`,
+         *          zero if it was not measured yet.
+         */
+        clock::duration rel_srtt(const endpoint_type& remote,
+                                 std::uint8_t channel) {
+            clock::duration out = clock::duration::zero();
+
+            state_.apply([&](auto& state) {
+                auto it = state.peers.find(remote);
+                if (it == state.peers.end()) return;
+
+                auto ch = it->second.senders.find(channel);
+                if (ch != it->second.senders.end()) out = ch->second.srtt();
+            });
+
+            return out;
+        }
+
+        void on_dgram_received(MessageContainer&&) override {}
+
+        void on_dgram_sent() override {}
+
+        void on_dgram_received_from(const endpoint_type& remote,
+                                    MessageContainer&& message) override {
+
+            if (message.size() < 2) return;
+
+            auto type = static_cast<detail::rel_packet>(message[0]);
+            auto channel = static_cast<std::uint8_t>(message[1]);
+
+            if (type == detail::rel_packet::data &&
+                message.size() >= detail::rel_data_header)
+                return rel_on_data_impl(remote, channel, std::move(message));
+
+            if (type == detail::rel_packet::ack &&
+                message.size() >= detail::rel_ack_size)
+                rel_on_ack_impl(remote, channel, message);
+        }
+
+      private:
+        using sender_type = detail::rel_sender<MessageContainer>;
+
+        struct peer {
+            std::map<std::uint8_t, sender_type> senders;
+            std::map<std::uint8_t, detail::rel_receiver<MessageContainer>>
+                receivers;
+            clock::time_point last_active;
+            std::size_t buffered = 0;
+            // incarnation of our state, sent with our data
+            std::uint32_t incarnation = 0;
+            // incarnation of the data the peer sends, 0 if none arrived
+            std::uint32_t remote = 0;
+            // the previous remote incarnation, its late packets are ignored
+            std::uint32_t retired = 0;
+
+            sender_type& sender(std::uint8_t channel,
+                                const rel_config& config) {
+                return senders.try_emplace(channel, config).first->second;
+            }
+
+            bool idle() const {
+                return std::all_of(senders.begin(), senders.end(),
+                                   [](const auto& ch) {
+                                       return ch.second.idle();
+                                   });
+            }
+        };
+
+        struct rel_state {
+            std::map<endpoint_type, peer> peers;
+            std::map<std::uint8_t, rel_delivery> modes;
+            std::mt19937 rng{std::random_device()()};
+        };
+
+        // The state of `remote`, marked active at `now`. A new peer is not
+        // created if `limited` and rel_config::max_peers is reached.
+        peer* peer_for(rel_state& state, const endpoint_type& remote,
+                       clock::time_point now, bool limited) const {
+
+            auto it = state.peers.find(remote);
+
+            if (it == state.peers.end()) {
+                if (limited && state.peers.size() >= config_.max_peers)
+                    return nullptr;
+
+                it = state.peers.try_emplace(remote).first;
+
+                while (!it->second.incarnation)
+                    it->second.incarnation = state.rng();
+            }
+
+            it->second.last_active = now;
+            return &it->second;
+        }
+
+        static rel_delivery mode_of(const rel_state& state,
+                                    std::uint8_t channel) {
+            auto it = state.modes.find(channel);
+            return it == state.modes.end() ? rel_delivery::ordered
+                                           : it->second;
+        }
+
+        void rel_on_data_impl(const endpoint_type& remote,
+                              std::uint8_t channel,
+                              MessageContainer&& message) {
+
+            std::vector<MessageContainer> delivered;
+            char ack[detail::rel_ack_size];
+            bool accepted = false;
+
+            auto incarnation = detail::rel_get_u32(&message[2]);
+            auto seq = detail::rel_get_u32(&message[6]);
+
+            message.erase(message.begin(),
+                          message.begin() + detail::rel_data_header);
+
+            ack[0] = static_cast<char>(detail::rel_packet::ack);
+            ack[1] = static_cast<char>(channel);
+            detail::rel_put_u32(ack + 2, incarnation);
+
+            state_.apply([&](auto& state) {
+                auto* p = peer_for(state, remote, clock::now(), true);
+                if (!p || !incarnation || incarnation == p->retired) return;
+
+                // the peer started over, forget the old sequence numbers
+                if (incarnation != p->remote) {
+                    if (p->remote) {
+                        p->retired = p->remote;
+                        p->receivers.clear();
+                        p->buffered = 0;
+                    }
+                    p->remote = incarnation;
+                }
+
+                auto& receiver = p->receivers[channel];
+
+                receiver.receive(seq, std::move(message),
+                                 mode_of(state, channel), delivered,
+                                 p->buffered, config_.max_buffered);
+
+                receiver.write_ack(ack + 6);
+                accepted = true;
+            });
+
+            if (!accepted) return;
+
+            // acknowledge duplicates as well, the last ack may have been
+            // lost
+            this->dgram_write(remote, MessageContainer(ack, ack + sizeof(ack)));
+
+            for (auto& msg : delivered)
+                on_rel_received(remote, channel, std::move(msg));
+        }
+
+        void rel_on_ack_impl(const endpoint_type& remote,
+                             std::uint8_t channel,
+                             const MessageContainer& message) {
+
+            std::vector<MessageContainer> out;
+            auto now = clock::now();
+
+            state_.apply([&](auto& state) {
+                auto it = state.peers.find(remote);
+                if (it == state.peers.end()) return;
+
+                it->second.last_active = now;
+
+                // an ack for data of an earlier incarnation
+                if (detail::rel_get_u32(&message[2]) !=
+                    it->second.incarnation)
+                    return;
+
+                auto ch = it->second.senders.find(channel);
+                if (ch == it->second.senders.end()) return;
+
+                auto emit = [&](MessageContainer&& p) {
+                    out.push_back(std::move(p));
+                };
+
+                ch->second.acknowledge(now, detail::rel_get_u32(&message[6]),
+                                       detail::rel_get_u32(&message[10]),
+                                       emit);
+                ch->second.transmit(now, emit);
+            });
+
+            for (auto& p : out) this->dgram_write(remote, std::move(p));
+        }
+
+        // Retransmit expired messages, drop peers that stopped answering
+        // and forget peers without traffic.
+        void rel_tick_impl() {
+
+            std::vector<std::pair<endpoint_type, MessageContainer>> out;
+            std::vector<endpoint_type> lost;
+            auto now = clock::now();
+
+            state_.apply([&](auto& state) {
+                auto& peers = state.peers;
+
+                for (auto it = peers.begin(); it != peers.end();) {
+                    if (now - it->second.last_active >= config_.peer_timeout &&
+                        it->second.idle()) {
+                        it = peers.erase(it);
+                        continue;
+                    }
+
+                    bool alive = true;
+
+                    for (auto& ch : it->second.senders) {
+                        alive = ch.second.expire(
+                            now, [&](MessageContainer&& p) {
+                                out.emplace_back(it->first, std::move(p));
+                            });
+
+                        if (!alive) break;
+
+                        ch.second.transmit(now, [&](MessageContainer&& p) {
+                            out.emplace_back(it->first, std::move(p));
+                        });
+                    }
+
+                    if (alive) {
+                        ++it;
+                        continue;
+                    }
+
+                    lost.push_back(it->first);
+                    it = peers.erase(it);
+                }
+            });
+
+            for (auto& p : out)
+                if (std::find(lost.begin(), lost.end(), p.first) == lost.end())
+                    this->dgram_write(p.first, std::move(p.second));
+
+            for (auto& remote : lost) on_rel_peer_lost(remote);
+        }
+
+        rel_config config_;
+        o::ccy::opt_safe_visitable<rel_state, ConcurrencyOption> state_;
+        o::io::weak_steady_timer timer_;
+        std::shared_ptr<void> alive_ = std::make_shared<bool>(true);
+    };
+
+} // namespace o::io::net
@@ -25,61 +25,408 @@
 
 #pragma once
 
-#include <map>
+#include <atomic>
+#include <chrono>
+#include <type_traits>
 
 #include <boost/asio.hpp>
 
 #include "../io_app_base.h"
+#include "../messages/shared_message.h"
+#include "../timing_wheel.h"
+#include "session_registry.h"
+#include "stream_session.h"
+#include "traffic_stats.h"
 
 namespace o::io::net::server {
 
+    namespace detail {
+
+        // true if Session has the timeout feature, see session_activity
+        template < typename Session, typename = void >
+        struct sess_timeout_enabled : std::false_type {};
+
+        template < typename Session >
+        struct sess_timeout_enabled<
+            Session, std::void_t< decltype( Session::timeout_enabled ) > >
+            : std::bool_constant< Session::timeout_enabled > {};
+    } // namespace detail
+
+    /// A stream server. Accepts connections on its own io context, creates a
+    /// Session for every connection and keeps it in sessions(), a sharded
+    /// session_registry, until it is closed.
+    ///
+    /// Session is usually derived from stream_session and must be
+    /// constructible from a connected `Session::socket_type`, unless
+    /// sess_make() is overridden. With o::ccy::safe, every session runs on a
+    /// strand of its own, so its handlers never run concurrently, while
+    /// different sessions are served in parallel by all threads of the
+    /// server.
+    ///
+    /// If Session has the timeout feature, sess_idle_timeout() closes idle
+    /// sessions, using a timing wheel ticked by a single timer.
     template < typename Session, typename ConcurrencyOption >
     class server_base : public o::io::io_app_base< ConcurrencyOption > {
 
       public:
-        using sessions_map = std::map< size_t, std::shared_ptr< Session > >;
-        using sessions_type =
-            o::ccy::opt_safe_visitable< sessions_map, ConcurrencyOption >;
+        using session_type = Session;
+        using protocol_type = typename Session::protocol_type;
+        using endpoint_type = typename protocol_type::endpoint;
+        using socket_type = typename protocol_type::socket;
+        using acceptor_type = typename protocol_type::acceptor;
+
+        using sessions_type = session_registry< Session, ConcurrencyOption >;
+
+        // the acceptor runs on a strand, so shutdown() can close it while
+        // accept handlers run on other threads
+        server_base()
+            : acceptor_( boost::asio::make_strand( this->context() ) ),
+              retry_timer_( acceptor_.get_executor() ),
+              idle_timer_( acceptor_.get_executor() ) {}
+
+        virtual ~server_base() = default;
+
+        /// open the acceptor, bind it to the endpoint and start listening.
+        /// errors are reported to on_server_error()
+        void listen( const endpoint_type& endpoint,
+                     int backlog =
+                         boost::asio::socket_base::max_listen_connections ) {
+
+            boost::system::error_code ec;
+
+            acceptor_.open( endpoint.protocol(), ec );
+
+            if constexpr ( o::type_traits::is_ip_protocol<
+                               protocol_type >::value )
+                if ( !ec )
+                    acceptor_.set_option(
+                        boost::asio::socket_base::reuse_address( true ), ec );
+
+            if ( !ec )
+                acceptor_.bind( endpoint, ec );
 
+            if ( !ec )
+                acceptor_.listen( backlog, ec );
+
+            if ( ec )
+                on_server_error( ec );
+        }
+
+        /// the endpoint the server is listening on
+        endpoint_type local_endpoint() const {
+            boost::system::error_code ec;
+            return acceptor_.local_endpoint( ec );
+        }
+
+        /// start accepting and run the server on the given number of threads
         template < typename Opt = ConcurrencyOption >
         typename ccy::opt_enable_if_safe< Opt >::type start( int threads ) {
-            this->app_begin_op( threads );
+            sess_accept_impl();
+            sess_idle_start_impl();
+            this->app_launch( threads );
         }
 
-        /// start the server
-        void start() { this->app_begin_op(); }
+        /// start accepting. launches a thread, unless the concurrency option
+        /// is o::ccy::none, then the server runs on the thread that calls
+        /// run()
+        void start() {
+            sess_accept_impl();
+            sess_idle_start_impl();
 
-        /// close all connections, delete all sessions, shut down all sessions and
-        /// wait for them to exit
-        void shutdown() {
-            sess_close_all();
-            this->app_end_op();
+            if constexpr ( ccy::opt_app_manages_threads<
+                               ConcurrencyOption >::value )
+                this->app_launch();
         }
 
-        /// delete all closed/aborted sessions
-        void sess_cleanup() {
-            sessions_.apply( []( auto& sessions ) {
+        /// stop accepting, close all connections, wait for the threads of
+        /// the server to exit and delete all closed sessions
+        void shutdown() {
+
+            // sessions are inserted on the strand of the acceptor, so they
+            // are closed there after the acceptor. an accept handler that is
+            // running finishes first, later ones see the closed acceptor
+            boost::asio::dispatch( acceptor_.get_executor(), [this]() {
+                boost::system::error_code ec;
+                acceptor_.close( ec );
+                retry_timer_.cancel( ec );
+                idle_timer_.cancel( ec );
 
+                sess_close_all();
             } );
+
+            this->app_allow_exit();
+
+            if constexpr ( ccy::opt_app_manages_threads<
+                               ConcurrencyOption >::value )
+                this->app_join();
+
+            sess_cleanup();
+        }
+
+        /// close sessions without a read or write for longer than the
+        /// timeout, with boost::asio::error::timed_out. sessions are checked
+        /// once per resolution, so a session is closed at most one
+        /// resolution late. call before start(). only available if the
+        /// sessions have the timeout feature
+        template < typename S = Session >
+        std::enable_if_t< detail::sess_timeout_enabled< S >::value >
+        sess_idle_timeout( std::chrono::steady_clock::duration timeout,
+                           std::chrono::steady_clock::duration resolution =
+                               std::chrono::seconds( 1 ) ) {
+
+            idle_timeout_ = timeout;
+            idle_resolution_ = std::max( resolution,
+                                         std::chrono::steady_clock::duration(
+                                             std::chrono::milliseconds( 1 ) ) );
+
+            // the wheel spans the timeout, longer waits are rescheduled
+            idle_wheel_ = o::io::timing_wheel< session_handle >( std::min(
+                sess_idle_ticks_impl( idle_timeout_ ) + 1, max_idle_slots ) );
         }
 
-        /// close all connections and delete all sessions
+        /// reclaim all closed sessions now, instead of waiting for the
+        /// reaper. takes the lock of a shard for a bounded batch at a time
+        void sess_cleanup() {
+            while ( sessions_.reap() )
+                ;
+        }
+
+        /// close all connections. the sessions are reclaimed by the reaper
+        /// as they close
         void sess_close_all() {
+            sessions_.for_each( []( const auto& sess ) { sess->close(); } );
+        }
+
+        /// queue the same message on every session. the bytes are not
+        /// copied, every session holds a reference to them until they were
+        /// written. returns the number of sessions
+        std::size_t
+        sess_broadcast( const o::io::messages::shared_message& message ) {
+            return sess_broadcast( message,
+                                   []( const Session& ) { return true; } );
+        }
 
-            sessions_.apply( []( auto& sessions ) {
-                for ( auto& [key, sess] : sessions )
-                    if ( sess )
-                        sess->close();
+        /// queue the same message on every session for which the filter,
+        /// called with the session, returns true
+        template < typename Filter >
+        std::size_t
+        sess_broadcast( const o::io::messages::shared_message& message,
+                        Filter&& filter ) {
+            std::size_t count = 0;
 
-                sessions.clear();
+            sessions_.for_each( [&]( const auto& sess ) {
+                if ( filter( *sess ) ) {
+                    sess->write( message );
+                    ++count;
+                }
             } );
+
+            return count;
+        }
+
+        /// the session of a handle, nullptr once it was deleted
+        std::shared_ptr< Session > sess_find( session_handle handle ) {
+            return sessions_.find( handle );
+        }
+
+        /// number of current sessions
+        std::size_t sess_count() const { return sessions_.size(); }
+
+        /// traffic counters of all current sessions, summed. only available
+        /// if the sessions derive from traffic_stats with the statistics
+        /// feature enabled
+        template < typename S = Session >
+        std::enable_if_t< S::statistics_enabled, traffic_snapshot >
+        sess_traffic() {
+            traffic_snapshot out;
+            sessions_.for_each(
+                [&]( const auto& sess ) { out += sess->traffic(); } );
+            return out;
+        }
+
+        /// add the handler latencies of all current sessions to a histogram
+        template < typename S = Session >
+        std::enable_if_t< S::statistics_enabled >
+        sess_handler_latency( o::io::histogram& out ) {
+            sessions_.for_each(
+                [&]( const auto& sess ) { sess->handler_latency( out ); } );
         }
 
         sessions_type& sessions() { return sessions_; }
 
         const sessions_type& sessions() const { return sessions_; }
 
+      protected:
+        /// create the session for an accepted connection. the default
+        /// constructs a Session from the socket
+        virtual std::shared_ptr< Session > sess_make( socket_type&& sock ) {
+            return std::make_shared< Session >( std::move( sock ) );
+        }
+
+        /// called when accepting fails. accepting continues unless the
+        /// acceptor was closed
+        virtual void on_server_error( boost::system::error_code ec ) {}
+
       private:
+        void sess_accept_impl() {
+
+            // sockets get the plain executor of the context, sessions put
+            // their own strand on top with ccy::safe
+            acceptor_.async_accept(
+                this->context().get_executor(),
+                [this]( boost::system::error_code ec, socket_type sock ) {
+                    on_accepted_impl( ec, std::move( sock ) );
+                } );
+        }
+
+        void on_accepted_impl( boost::system::error_code ec,
+                               socket_type sock ) {
+
+            if ( ec == boost::asio::error::operation_aborted ||
+                 !acceptor_.is_open() )
+                return;
+
+            if ( ec ) {
+                on_server_error( ec );
+
+                // out of descriptors, give sessions time to close
+                if ( ec == boost::asio::error::no_descriptors ||
+                     ec == boost::asio::error::no_buffer_space ||
+                     ec == boost::asio::error::no_memory ) {
+                    retry_timer_.expires_after(
+                        std::chrono::milliseconds( 100 ) );
+                    return retry_timer_.async_wait(
+                        [this]( boost::system::error_code ec ) {
+                            if ( !ec )
+                                sess_accept_impl();
+                        } );
+                }
+
+                return sess_accept_impl();
+            }
+
+            // accept the next connection while this one is set up
+            sess_accept_impl();
+
+            auto sess = sess_make( std::move( sock ) );
+
+            if ( !sess )
+                return;
+
+            auto handle = sessions_.insert( sess );
+
+            // the registry is full, drop the connection
+            if ( !handle )
+                return;
+
+            // the wheel is only used on the strand of the acceptor
+            if constexpr ( detail::sess_timeout_enabled< Session >::value )
+                if ( idle_timeout_.count() > 0 )
+                    idle_wheel_.schedule(
+                        handle, sess_idle_ticks_impl( idle_timeout_ ) );
+
+            boost::asio::dispatch(
+                sess->get_executor(), [this, sess, handle]() {
+                    sess->start(
+                        [this, handle]() { sess_retire_impl( handle ); } );
+                } );
+        }
+
+        // closed sessions are only marked and reclaimed in batches from the
+        // io context, so a disconnect storm neither holds locks for long
+        // nor destroys sessions in the handlers of other sessions
+        void sess_retire_impl( session_handle handle ) {
+            if ( sessions_.retire( handle ) )
+                sess_schedule_reap_impl();
+        }
+
+        void sess_schedule_reap_impl() {
+            if ( reaping_.exchange( true ) )
+                return;
+
+            boost::asio::post( this->context(),
+                               [this]() { sess_reap_impl(); } );
+        }
+
+        // one batch per turn, so other handlers run in between
+        void sess_reap_impl() {
+            sessions_.reap();
+
+            if ( sessions_.retired() )
+                return boost::asio::post( this->context(),
+                                          [this]() { sess_reap_impl(); } );
+
+            reaping_.store( false );
+
+            // a session retired after the check above
+            if ( sessions_.retired() )
+                sess_schedule_reap_impl();
+        }
+
+        // sessions are not moved in the wheel when they are active. when
+        // their slot is reached, they are closed if they were idle for the
+        // whole timeout, or scheduled again for the rest of it otherwise
+        void sess_idle_start_impl() {
+            if constexpr ( detail::sess_timeout_enabled< Session >::value ) {
+                if ( idle_timeout_.count() <= 0 )
+                    return;
+
+                idle_next_ = std::chrono::steady_clock::now();
+                sess_idle_tick_impl();
+            }
+        }
+
+        void sess_idle_tick_impl() {
+            idle_next_ += idle_resolution_;
+            idle_timer_.expires_at( idle_next_ );
+
+            idle_timer_.async_wait( [this]( boost::system::error_code ec ) {
+                // a tick that expired before shutdown() cancelled the timer
+                // still runs, it must not arm the timer again
+                if ( ec || !acceptor_.is_open() )
+                    return;
+
+                auto now = std::chrono::steady_clock::now();
+
+                idle_wheel_.advance( [&]( session_handle handle ) {
+                    auto sess = sessions_.find( handle );
+
+                    if ( !sess )
+                        return;
+
+                    auto idle = now - sess->last_activity();
+
+                    if ( idle >= idle_timeout_ )
+                        sess->close( boost::asio::error::timed_out );
+                    else
+                        idle_wheel_.schedule(
+                            handle,
+                            sess_idle_ticks_impl( idle_timeout_ - idle ) );
+                } );
+
+                sess_idle_tick_impl();
+            } );
+        }
+
+        std::size_t
+        sess_idle_ticks_impl( std::chrono::steady_clock::duration d ) const {
+            return std::size_t( ( d + idle_resolution_ -
+                                  std::chrono::steady_clock::duration( 1 ) ) /
+                                idle_resolution_ );
+        }
+
+        static constexpr const std::size_t max_idle_slots = 4096;
+
         sessions_type sessions_;
+        std::atomic< bool > reaping_{ false };
+        acceptor_type acceptor_;
+        boost::asio::steady_timer retry_timer_;
+
+        boost::asio::steady_timer idle_timer_;
+        o::io::timing_wheel< session_handle > idle_wheel_{ 1 };
+        std::chrono::steady_clock::duration idle_timeout_{ 0 };
+        std::chrono::steady_clock::duration idle_resolution_{
+            std::chrono::seconds( 1 ) };
+        std::chrono::steady_clock::time_point idle_next_;
     };
 }
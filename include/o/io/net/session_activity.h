@@ -0,0 +1,88 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include <atomic>
+#include <chrono>
+
+namespace o::io::net {
+
+    /**
+     * The time of the last activity of a session, compiled away unless
+     * Enabled is true. Sessions derive from it and touch it from their io
+     * handlers, server_base uses it to close idle sessions.
+     *
+     * Touching is a single relaxed store, it neither locks nor allocates
+     * and does not move the session in any timer structure.
+     *
+     * @tparam  Enabled Whether to keep the time.
+     */
+    template <bool Enabled>
+    class session_activity {
+      public:
+        static constexpr const bool timeout_enabled = false;
+
+      protected:
+        void activity_touch() {}
+    };
+
+    template <>
+    class session_activity<true> {
+
+      public:
+        using clock = std::chrono::steady_clock;
+
+        static constexpr const bool timeout_enabled = true;
+
+        session_activity() { activity_touch(); }
+
+        /** @returns The time of the last activity. */
+        clock::time_point last_activity() const {
+            return clock::time_point(
+                clock::duration(last_.load(std::memory_order_relaxed)));
+        }
+
+      protected:
+        void activity_touch() {
+            last_.store(clock::now().time_since_epoch().count(),
+                        std::memory_order_relaxed);
+        }
+
+      private:
+        std::atomic<clock::rep> last_{0};
+    };
+
+    /**
+     * The session_activity for a session with the given feature tags.
+     * Keeps the time if o::sessions::features::timeout is one of the tags.
+     */
+    template <typename... Features>
+    using session_activity_for = session_activity<
+        o::sessions::has_feature<o::sessions::features::timeout,
+                                 Features...>::value>;
+
+} // namespace o::io::net
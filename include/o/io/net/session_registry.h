@@ -0,0 +1,386 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace o::io::net::server {
+
+    /**
+     * Refers to an entry of a session_registry. Holds the shard and the
+     * slot of the entry and the generation of the slot, so a handle of an
+     * erased session never finds the session that reuses its slot. A
+     * default constructed handle refers to nothing.
+     */
+    struct session_handle {
+
+        static constexpr const unsigned index_bits = 24;
+        static constexpr const unsigned shard_bits = 8;
+
+        std::uint64_t value = 0;
+
+        session_handle() = default;
+
+        explicit session_handle(std::uint64_t v) : value(v) {}
+
+        session_handle(std::uint32_t generation, std::size_t shard,
+                       std::uint32_t index)
+            : value((std::uint64_t(generation) << 32) |
+                    (std::uint64_t(shard) << index_bits) | index) {}
+
+        std::uint32_t generation() const { return std::uint32_t(value >> 32); }
+
+        std::size_t shard() const {
+            return (value >> index_bits) & ((1u << shard_bits) - 1);
+        }
+
+        std::uint32_t index() const {
+            return std::uint32_t(value) & ((1u << index_bits) - 1);
+        }
+
+        explicit operator bool() const { return value != 0; }
+
+        bool operator==(const session_handle& other) const {
+            return value == other.value;
+        }
+
+        bool operator!=(const session_handle& other) const {
+            return value != other.value;
+        }
+    };
+
+    /**
+     * The sessions of a server, split into shards that are locked
+     * separately. An insert goes to the next shard in turn, lookups and
+     * erasures by handle only lock the shard of the handle and take
+     * constant time.
+     *
+     * The slots of a shard are allocated in slabs that never move, freed
+     * slots are reused before a new slab is allocated.
+     *
+     * Closed sessions are retired, which only marks their slot, and are
+     * reclaimed later by reap(). Neither reap() nor for_each() hold a lock
+     * for more than batch_size sessions, and sessions are never destroyed
+     * under a lock.
+     *
+     * @tparam  T                   Type of the sessions.
+     * @tparam  ConcurrencyOption   Type of the concurrency option, shards
+     *                              are only locked with o::ccy::safe.
+     * @tparam  Shards              Number of shards, at most 256.
+     */
+    template <typename T, typename ConcurrencyOption,
+              std::size_t Shards =
+                  o::ccy::is_safe<ConcurrencyOption>::value ? 16 : 1>
+    class session_registry {
+
+        static_assert(Shards > 0 &&
+                          Shards <= (1u << session_handle::shard_bits),
+                      "invalid number of shards");
+
+      public:
+        using value_type = std::shared_ptr<T>;
+
+        /** number of slots allocated at once */
+        static constexpr const std::size_t slab_size = 1024;
+
+        /** maximum number of sessions handled per lock */
+        static constexpr const std::size_t batch_size = 64;
+
+        session_registry() : shards_(new shard[Shards]) {}
+
+        session_registry(const session_registry&) = delete;
+        session_registry& operator=(const session_registry&) = delete;
+
+        /**
+         * Add a session.
+         *
+         * @returns The handle of the session, or an empty handle if the
+         *          shard is full.
+         */
+        session_handle insert(value_type value) {
+
+            auto shard_id =
+                Shards == 1
+                    ? 0
+                    : next_shard_.fetch_add(1, std::memory_order_relaxed) %
+                          Shards;
+
+            session_handle handle;
+
+            shards_[shard_id].state.apply([&](auto& state) {
+                if (state.free == no_slot) {
+                    if (state.slabs.size() * slab_size >=
+                        (1u << session_handle::index_bits))
+                        return;
+                    grow_impl(state);
+                }
+
+                auto index = state.free;
+                auto& entry = state.at(index);
+
+                state.free = entry.next_free;
+                entry.value = std::move(value);
+
+                state.count.fetch_add(1, std::memory_order_relaxed);
+                handle = session_handle(entry.generation, shard_id, index);
+            });
+
+            return handle;
+        }
+
+        /**
+         * Remove a session right away.
+         *
+         * @returns true if the session was found.
+         */
+        bool erase(session_handle handle) {
+            value_type removed;
+
+            with_entry_impl(handle, [&](auto& state, auto& entry) {
+                state.count.fetch_sub(1, std::memory_order_relaxed);
+                removed = release_impl(state, entry, handle.index());
+            });
+
+            // the session is destroyed outside of the lock
+            return removed != nullptr;
+        }
+
+        /** @returns The session, or nullptr if it was retired or erased. */
+        value_type find(session_handle handle) {
+            value_type found;
+
+            with_entry_impl(handle,
+                            [&](auto&, auto& entry) { found = entry.value; });
+
+            return found;
+        }
+
+        /**
+         * Mark a session as closed. It is not found or visited anymore,
+         * but only reclaimed by the next reap(). Constant time, nothing is
+         * destroyed.
+         *
+         * @returns true if the session was found.
+         */
+        bool retire(session_handle handle) {
+            bool found = false;
+
+            with_entry_impl(handle, [&](auto& state, auto& entry) {
+                entry.retired = true;
+                entry.next_free = state.dead;
+                state.dead = handle.index();
+
+                state.count.fetch_sub(1, std::memory_order_relaxed);
+                found = true;
+            });
+
+            if (found) retired_.fetch_add(1);
+
+            return found;
+        }
+
+        /**
+         * Reclaim retired sessions, batch_size of them per lock. The
+         * sessions are destroyed after the lock was released.
+         *
+         * @param   max Maximum number of sessions to reclaim.
+         *
+         * @returns The number of reclaimed sessions.
+         */
+        std::size_t reap(std::size_t max = batch_size) {
+            std::array<value_type, batch_size> batch;
+            std::size_t total = 0;
+
+            auto first = next_reap_.fetch_add(1, std::memory_order_relaxed);
+
+            for (std::size_t n = 0; n < Shards && total < max; ++n) {
+                auto& sh = shards_[(first + n) % Shards];
+
+                for (std::size_t got = batch_size;
+                     got == batch_size && total < max; total += got) {
+
+                    auto limit = std::min(batch_size, max - total);
+                    got = 0;
+
+                    sh.state.apply([&](auto& state) {
+                        while (state.dead != no_slot && got < limit) {
+                            auto index = state.dead;
+                            auto& entry = state.at(index);
+
+                            state.dead = entry.next_free;
+                            batch[got++] = release_impl(state, entry, index);
+                        }
+                    });
+
+                    retired_.fetch_sub(got);
+
+                    for (std::size_t i = 0; i < got; ++i) batch[i] = nullptr;
+                }
+            }
+
+            return total;
+        }
+
+        /** @returns The number of retired sessions not reclaimed yet. */
+        std::size_t retired() const { return retired_.load(); }
+
+        /**
+         * Call a function with every session that was not retired. The
+         * sessions are collected batch_size at a time under the lock of
+         * their shard and visited after it was released, so the function
+         * may insert, retire and erase sessions. Sessions inserted or
+         * removed during the visit may or may not be visited.
+         */
+        template <typename Function>
+        void for_each(Function&& f) {
+            std::array<value_type, batch_size> visit;
+
+            for (std::size_t i = 0; i < Shards; ++i) {
+                for (std::size_t cursor = 0, end = 1; cursor < end;) {
+                    std::size_t got = 0;
+
+                    shards_[i].state.apply([&](auto& state) {
+                        end = state.slabs.size() * slab_size;
+
+                        // scan at most one slab per lock
+                        auto stop = std::min(end, cursor + slab_size);
+
+                        for (; cursor < stop && got < batch_size; ++cursor) {
+                            auto& entry = state.at(std::uint32_t(cursor));
+                            if (entry.value && !entry.retired)
+                                visit[got++] = entry.value;
+                        }
+                    });
+
+                    for (std::size_t k = 0; k < got; ++k) {
+                        f(visit[k]);
+                        visit[k] = nullptr;
+                    }
+                }
+            }
+        }
+
+        /** @returns The number of sessions that were not retired. */
+        std::size_t size() const {
+            std::size_t count = 0;
+            for (std::size_t i = 0; i < Shards; ++i)
+                count += (*shards_[i].state).count.load(
+                    std::memory_order_relaxed);
+            return count;
+        }
+
+        bool empty() const { return size() == 0; }
+
+        static constexpr std::size_t shards() { return Shards; }
+
+      private:
+        static constexpr const std::uint32_t no_slot = ~std::uint32_t(0);
+
+        // a free slot is linked into the free list, a retired one into the
+        // dead list, both through next_free
+        struct entry {
+            value_type value;
+            std::uint32_t generation = 1;
+            std::uint32_t next_free = no_slot;
+            bool retired = false;
+        };
+
+        struct shard_state {
+            std::vector<std::unique_ptr<entry[]>> slabs;
+            std::uint32_t free = no_slot;
+            std::uint32_t dead = no_slot;
+
+            // written under the lock, read without it by size()
+            std::atomic<std::size_t> count{0};
+
+            entry& at(std::uint32_t index) {
+                return slabs[index / slab_size][index % slab_size];
+            }
+        };
+
+        struct alignas(64) shard {
+            o::ccy::opt_safe_visitable<shard_state, ConcurrencyOption> state;
+        };
+
+        static void grow_impl(shard_state& state) {
+            auto base = std::uint32_t(state.slabs.size() * slab_size);
+
+            state.slabs.emplace_back(new entry[slab_size]);
+
+            // link the new slots in order, in front of the free list
+            auto& slab = state.slabs.back();
+            for (std::size_t i = 0; i < slab_size; ++i)
+                slab[i].next_free = i + 1 < slab_size
+                                        ? base + std::uint32_t(i + 1)
+                                        : state.free;
+
+            state.free = base;
+        }
+
+        static value_type release_impl(shard_state& state, entry& e,
+                                       std::uint32_t index) {
+            value_type value = std::move(e.value);
+
+            e.value = nullptr;
+            e.retired = false;
+            if (++e.generation == 0) e.generation = 1;
+            e.next_free = state.free;
+            state.free = index;
+
+            return value;
+        }
+
+        // call f with the state and the entry of the handle, if the handle
+        // refers to a session that was not retired
+        template <typename Function>
+        void with_entry_impl(session_handle handle, Function&& f) {
+            if (!handle || handle.shard() >= Shards) return;
+
+            shards_[handle.shard()].state.apply([&](auto& state) {
+                auto index = handle.index();
+                if (index >= state.slabs.size() * slab_size) return;
+
+                auto& e = state.at(index);
+                if (e.value && !e.retired &&
+                    e.generation == handle.generation())
+                    f(state, e);
+            });
+        }
+
+        std::unique_ptr<shard[]> shards_;
+        std::atomic<std::size_t> next_shard_{0};
+        std::atomic<std::size_t> next_reap_{0};
+        std::atomic<std::size_t> retired_{0};
+    };
+
+} // namespace o::io::net::server
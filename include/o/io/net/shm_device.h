@@ -0,0 +1,675 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+/**
+ * @file
+ *
+ * A message transport between processes on the same host through a pair of
+ * ring buffers in shared memory. Only available on linux.
+ */
+
+#include "../../types.h"
+#include "dgram_busy_poll.h"
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#if defined(O_NET_LINUX)
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace o::io::net {
+
+#if defined(O_NET_LINUX) || defined(DOXY_GENERATE)
+
+    namespace detail {
+
+        /**
+         * Control block of a ring in shared memory. Producer and consumer
+         * indices live on separate cache lines. Both are byte positions
+         * that only grow, the offset into the ring is the position modulo
+         * the capacity.
+         */
+        struct shm_ring_header {
+            static constexpr std::uint64_t magic_value = 0x6f2d73686d72696e;
+
+            std::uint64_t magic;
+            std::uint64_t capacity;
+
+            alignas(64) std::atomic<std::uint64_t> head;
+            alignas(64) std::atomic<std::uint64_t> tail;
+            // set by a consumer that is about to sleep on the doorbell
+            alignas(64) std::atomic<std::uint32_t> waiting;
+        };
+
+        static_assert(std::atomic<std::uint64_t>::is_always_lock_free &&
+                          std::atomic<std::uint32_t>::is_always_lock_free,
+                      "shared memory rings need address free atomics");
+
+        constexpr std::size_t shm_header_space = 256;
+        constexpr std::uint32_t shm_pad_record = 0xffffffff;
+
+        // a ring holds at least one record of 8 bytes, and record lengths
+        // must stay below shm_pad_record
+        constexpr std::size_t shm_min_capacity = 16;
+        constexpr std::size_t shm_max_capacity = std::size_t(1) << 32;
+
+        static_assert(sizeof(shm_ring_header) <= shm_header_space, "");
+
+        inline std::size_t shm_align(std::size_t size) {
+            return (size + 7) & ~std::size_t(7);
+        }
+
+        /**
+         * A single producer, single consumer ring of variable sized
+         * records in shared memory. A record is a 4 byte length followed
+         * by the payload, padded to 8 bytes. A record that does not fit in
+         * front of the end of the ring is preceded by a padding record that
+         * tells the consumer to wrap around.
+         *
+         * Producer and consumer each cache the index of the other side and
+         * only read the shared one when the cached value is not enough, so
+         * under load the cache lines move between cores once per batch
+         * rather than once per record.
+         */
+        class shm_ring {
+
+          public:
+            shm_ring() = default;
+
+            // Use `bytes` of shared memory at `base` as the producer or the
+            // consumer. If `init` is set, the ring is reset, otherwise the
+            // header must be valid. The capacity must be a multiple of 8
+            // between shm_min_capacity and shm_max_capacity.
+            bool attach(char* base, std::size_t bytes, bool init,
+                        bool producer) {
+
+                if (bytes < shm_header_space + shm_min_capacity) return false;
+
+                auto capacity = bytes - shm_header_space;
+
+                if (capacity % 8 || capacity > shm_max_capacity) return false;
+
+                hdr_ = reinterpret_cast<shm_ring_header*>(base);
+                data_ = base + shm_header_space;
+
+                if (init) {
+                    new (hdr_) shm_ring_header();
+                    hdr_->capacity = capacity;
+                    hdr_->head.store(0, std::memory_order_relaxed);
+                    hdr_->tail.store(0, std::memory_order_relaxed);
+                    hdr_->waiting.store(0, std::memory_order_relaxed);
+                    hdr_->magic = shm_ring_header::magic_value;
+                }
+
+                if (hdr_->magic != shm_ring_header::magic_value ||
+                    hdr_->capacity != capacity)
+                    return false;
+
+                capacity_ = hdr_->capacity;
+                corrupt_ = false;
+                pos_ = producer ? hdr_->head.load() : hdr_->tail.load();
+                cached_ = producer ? hdr_->tail.load() : pos_;
+
+                return true;
+            }
+
+            std::size_t capacity() const { return capacity_; }
+
+            std::size_t max_record() const {
+                return capacity_ / 2 - sizeof(std::uint64_t);
+            }
+
+            // -- producer side
+
+            // Append a record. Returns false if the ring is full.
+            bool write(const char* data, std::size_t size) {
+
+                auto need = shm_align(sizeof(std::uint64_t) + size);
+                auto offset = pos_ % capacity_;
+                auto contiguous = capacity_ - offset;
+                auto total = contiguous < need ? contiguous + need : need;
+
+                if (pos_ + total - cached_ > capacity_) {
+                    cached_ = hdr_->tail.load(std::memory_order_acquire);
+
+                    if (pos_ + total - cached_ > capacity_) return false;
+                }
+
+                if (contiguous < need) {
+                    put_length(offset, shm_pad_record);
+                    pos_ += contiguous;
+                    offset = 0;
+                }
+
+                put_length(offset, static_cast<std::uint32_t>(size));
+                std::memcpy(data_ + offset + sizeof(std::uint64_t), data,
+                            size);
+
+                pos_ += need;
+                hdr_->head.store(pos_, std::memory_order_release);
+
+                return true;
+            }
+
+            // Whether the consumer has to be woken up after a write. Clears
+            // the flag, so only one producer write rings the doorbell.
+            bool take_waiter() {
+                // order the head update before reading the flag, pairs with
+                // the fence in prepare_wait()
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                return hdr_->waiting.load(std::memory_order_relaxed) &&
+                       hdr_->waiting.exchange(0, std::memory_order_relaxed);
+            }
+
+            // -- consumer side
+
+            // Call f(data, size) for up to `max` records, or until f
+            // returns false. Returns the number of records consumed. The
+            // shared memory is written by the peer, so every record is
+            // checked against the ring and the bytes the producer
+            // published. Reading stops at an invalid one and corrupt()
+            // returns true from then on.
+            template <typename F>
+            std::size_t read(F&& f, std::size_t max) {
+
+                std::size_t count = 0;
+
+                if (corrupt_) return 0;
+
+                if (pos_ == cached_)
+                    cached_ = hdr_->head.load(std::memory_order_acquire);
+
+                if (cached_ - pos_ > capacity_) corrupt_ = true;
+
+                while (!corrupt_ && pos_ != cached_ && count < max) {
+                    auto offset = pos_ % capacity_;
+                    auto contiguous = capacity_ - offset;
+                    auto available = cached_ - pos_;
+
+                    if (contiguous < sizeof(std::uint64_t)) {
+                        corrupt_ = true;
+                        break;
+                    }
+
+                    auto size = get_length(offset);
+
+                    if (size == shm_pad_record) {
+                        if (contiguous > available) corrupt_ = true;
+                        else pos_ += contiguous;
+                        continue;
+                    }
+
+                    auto need = shm_align(sizeof(std::uint64_t) + size);
+
+                    if (size > max_record() || need > contiguous ||
+                        need > available) {
+                        corrupt_ = true;
+                        break;
+                    }
+
+                    bool more = f(static_cast<const char*>(
+                                      data_ + offset + sizeof(std::uint64_t)),
+                                  static_cast<std::size_t>(size));
+
+                    pos_ += need;
+                    ++count;
+
+                    if (!more) break;
+                }
+
+                // release the space once per batch
+                if (count) hdr_->tail.store(pos_, std::memory_order_release);
+
+                return count;
+            }
+
+            // The peer wrote a record that does not fit the ring.
+            bool corrupt() const { return corrupt_; }
+
+            bool empty() {
+                if (pos_ != cached_) return false;
+                cached_ = hdr_->head.load(std::memory_order_acquire);
+                return pos_ == cached_;
+            }
+
+            // Announce that the consumer will sleep. Returns false if a
+            // record arrived in the meantime, the consumer must not sleep
+            // then.
+            bool prepare_wait() {
+                hdr_->waiting.store(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                if (hdr_->head.load(std::memory_order_relaxed) == pos_)
+                    return true;
+
+                hdr_->waiting.store(0, std::memory_order_relaxed);
+                return false;
+            }
+
+          private:
+            void put_length(std::size_t offset, std::uint32_t length) {
+                std::memcpy(data_ + offset, &length, sizeof(length));
+            }
+
+            std::uint32_t get_length(std::size_t offset) const {
+                std::uint32_t length;
+                std::memcpy(&length, data_ + offset, sizeof(length));
+                return length;
+            }
+
+            shm_ring_header* hdr_ = nullptr;
+            char* data_ = nullptr;
+            std::size_t capacity_ = 0;
+            // own index and cached index of the other side
+            std::uint64_t pos_ = 0;
+            std::uint64_t cached_ = 0;
+            bool corrupt_ = false;
+        };
+    } // namespace detail
+
+    /**
+     * A device that exchanges messages with another process through two
+     * single producer, single consumer rings in a shared memory segment.
+     *
+     * One side calls shm_create(), which allocates the segment with
+     * memfd_create() and two eventfd doorbells, and passes the returned
+     * descriptors to the other side, for example with local::send_fds().
+     * The other side calls shm_attach() with them.
+     *
+     * A message is copied into the ring once by the writer and handed to
+     * on_shm_received() in place on the reader side. The reader only sleeps
+     * on the doorbell when its ring is empty, and a writer only rings the
+     * doorbell if the reader is asleep, so a busy pair exchanges messages
+     * without system calls. With shm_receive_spin(), the reader polls the
+     * ring for a while before it goes to sleep, which avoids the wake up
+     * latency for messages that arrive back to back.
+     *
+     * Writes from multiple threads are serialized with a mutex if the
+     * concurrency option is o::ccy::safe.
+     *
+     * @tparam  MessageContainer    Type of the message container. Must be
+     *                              constructible from a pair of char
+     *                              iterators.
+     * @tparam  ConcurrencyOption   Type of the concurrency option.
+     */
+    template <typename MessageContainer, typename ConcurrencyOption>
+    class shm_device {
+
+      public:
+        shm_device() = delete;
+
+        /**
+         * Constructor
+         *
+         * @param [in,out]  ctx The context the doorbell is waited on.
+         */
+        explicit shm_device(boost::asio::io_context& ctx) : doorbell_(ctx) {}
+
+        shm_device(const shm_device&) = delete;
+        shm_device& operator=(const shm_device&) = delete;
+
+        virtual ~shm_device() { shm_close(); }
+
+        /**
+         * Handles a received message.
+         *
+         * @param   message The message.
+         */
+        virtual void on_dgram_received(MessageContainer&& message) = 0;
+
+        /**
+         * Handles a received message in place. The memory is only valid
+         * until this function returns. The default implementation copies
+         * the message and calls on_dgram_received().
+         *
+         * @param   data    The first byte of the message.
+         * @param   size    The size of the message.
+         */
+        virtual void on_shm_received(const char* data, std::size_t size) {
+            on_dgram_received(MessageContainer(data, data + size));
+        }
+
+        /**
+         * Handles errors of the doorbell or while setting up the rings.
+         * If the peer wrote an invalid record into the ring, the device is
+         * closed and bad_message is reported.
+         *
+         * @param   ec  The error.
+         */
+        virtual void on_dgram_error(boost::system::error_code) {}
+
+        /**
+         * Create the shared memory segment and the doorbells and attach to
+         * them. The returned descriptors must be passed to the peer, which
+         * calls shm_attach() with them. They can be closed once they were
+         * passed.
+         *
+         * @param   capacity    Size of each of the two rings in bytes, at
+         *                      least 16 and at most 4 GiB. It is rounded up
+         *                      to a multiple of 8. The largest message is
+         *                      half of it. Other sizes are rejected with
+         *                      invalid_argument.
+         *
+         * @returns The segment, the doorbell of the peer and this side's
+         *          doorbell, empty on error.
+         */
+        std::vector<int> shm_create(std::size_t capacity = 1 << 22) {
+
+            if (capacity < detail::shm_min_capacity ||
+                capacity > detail::shm_max_capacity) {
+                on_dgram_error(boost::asio::error::invalid_argument);
+                return {};
+            }
+
+            auto ring_bytes =
+                detail::shm_header_space + detail::shm_align(capacity);
+
+            int mem = ::memfd_create("liboh-shm", MFD_CLOEXEC);
+            int peer_bell = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            int own_bell = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+            std::vector<int> fds{mem, peer_bell, own_bell};
+
+            if (mem < 0 || peer_bell < 0 || own_bell < 0 ||
+                ::ftruncate(mem, ring_bytes * 2) < 0 ||
+                !shm_map_impl(mem, ring_bytes, 0, true) ||
+                !shm_bells_impl(peer_bell, own_bell)) {
+                report_errno_impl();
+                close_fds_impl(fds);
+                shm_close();
+                return {};
+            }
+
+            return fds;
+        }
+
+        /**
+         * Attach to the segment created by the peer with shm_create(). The
+         * descriptors can be closed afterwards.
+         *
+         * @param   fds The descriptors returned by shm_create().
+         */
+        void shm_attach(const std::vector<int>& fds) {
+
+            if (fds.size() != 3)
+                return on_dgram_error(boost::asio::error::invalid_argument);
+
+            auto size = ::lseek(fds[0], 0, SEEK_END);
+
+            if (size <= 0 || !shm_map_impl(fds[0], size / 2, 1, false) ||
+                !shm_bells_impl(fds[2], fds[1])) {
+                report_errno_impl();
+                shm_close();
+            }
+        }
+
+        /**
+         * Poll the ring for up to `max_spin` after it ran empty, before
+         * sleeping on the doorbell. The actual time follows the gap
+         * between messages, see dgram_receive_busy_poll(). Call before
+         * shm_create() or shm_attach().
+         *
+         * @param   max_spin    Maximum time to spin.
+         */
+        void shm_receive_spin(std::chrono::microseconds max_spin) {
+            spin_ = std::make_unique<detail::dgram_spin_budget>(max_spin);
+        }
+
+        /**
+         * Write a message to the peer.
+         *
+         * @param   data    The first byte of the message.
+         * @param   size    The size of the message.
+         *
+         * @returns false if the ring is full or the message is too large.
+         */
+        bool shm_write(const char* data, std::size_t size) {
+
+            if (closed_ || !mapping_ || size > max_message_)
+                return false;
+
+            bool written = false;
+            bool ring = false;
+
+            tx_ring_.apply([&](auto& tx) {
+                written = tx.write(data, size);
+                ring = written && tx.take_waiter();
+            });
+
+            if (ring) {
+                std::uint64_t one = 1;
+                auto res = ::write(peer_bell_, &one, sizeof(one));
+                (void)res;
+            }
+
+            return written;
+        }
+
+        /**
+         * Write a message to the peer.
+         *
+         * @param   message The message.
+         *
+         * @returns false if the ring is full or the message is too large.
+         */
+        bool shm_write(const MessageContainer& message) {
+            return shm_write(message.data(), message.size());
+        }
+
+        /**
+         * Detach from the shared memory and close the doorbells. May be
+         * called from on_shm_received(), the memory is released once the
+         * handler returns.
+         */
+        void shm_close() {
+
+            boost::system::error_code ec;
+            doorbell_.close(ec);
+
+            if (peer_bell_ >= 0) ::close(peer_bell_);
+            peer_bell_ = -1;
+
+            if (mapping_ && !draining_) ::munmap(mapping_, mapping_size_);
+            mapping_ = draining_ ? mapping_ : nullptr;
+            closed_ = true;
+        }
+
+      private:
+        bool shm_map_impl(int fd, std::size_t ring_bytes, int side,
+                          bool init) {
+
+            auto* base = static_cast<char*>(
+                ::mmap(nullptr, ring_bytes * 2, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0));
+
+            if (base == MAP_FAILED) return false;
+
+            closed_ = false;
+            mapping_ = base;
+            mapping_size_ = ring_bytes * 2;
+
+            // side 0 writes the first ring and reads the second one
+            char* tx = base + ring_bytes * side;
+            char* rx = base + ring_bytes * (1 - side);
+
+            bool ok = rx_.attach(rx, ring_bytes, init, false);
+
+            tx_ring_.apply([&](auto& ring) {
+                ok = ring.attach(tx, ring_bytes, init, true) && ok;
+                max_message_ = ok ? ring.max_record() : 0;
+            });
+
+            // a segment with bad sizes or headers is reported as such
+            if (!ok) errno = EINVAL;
+
+            return ok;
+        }
+
+        // Take over duplicates of the doorbells and start waiting.
+        bool shm_bells_impl(int peer_bell, int own_bell) {
+
+            peer_bell_ = ::fcntl(peer_bell, F_DUPFD_CLOEXEC, 0);
+            int own = ::fcntl(own_bell, F_DUPFD_CLOEXEC, 0);
+
+            if (peer_bell_ < 0 || own < 0) {
+                if (own >= 0) ::close(own);
+                return false;
+            }
+
+            boost::system::error_code ec;
+            doorbell_.assign(own, ec);
+
+            if (ec) {
+                ::close(own);
+                return false;
+            }
+
+            shm_wait_impl();
+            return true;
+        }
+
+        void shm_wait_impl() {
+
+            if (!rx_.prepare_wait()) {
+                // a message arrived while preparing to sleep
+                return boost::asio::post(doorbell_.get_executor(),
+                                         [this]() { on_shm_ready_impl({}); });
+            }
+
+            doorbell_.async_wait(
+                boost::asio::posix::descriptor_base::wait_read,
+                [this](boost::system::error_code ec) {
+                    on_shm_ready_impl(ec);
+                });
+        }
+
+        void on_shm_ready_impl(boost::system::error_code ec) {
+
+            if (ec) {
+                if (ec != boost::asio::error::operation_aborted)
+                    on_dgram_error(ec);
+                return;
+            }
+
+            if (closed_) return;
+
+            std::uint64_t signals;
+            auto res = ::read(doorbell_.native_handle(), &signals,
+                              sizeof(signals));
+            (void)res;
+
+            shm_drain_impl();
+
+            if (!closed_) shm_wait_impl();
+        }
+
+        // Deliver everything in the ring, then spin for more if enabled.
+        void shm_drain_impl() {
+
+            using clock = detail::dgram_spin_budget::clock;
+
+            constexpr std::size_t max_batch = 256;
+            constexpr int max_rounds = 64;
+
+            auto deliver = [this](const char* data, std::size_t size) {
+                on_shm_received(data, size);
+                return !closed_;
+            };
+
+            draining_ = true;
+
+            for (int round = 0; round < max_rounds && !closed_; ++round) {
+
+                if (rx_.read(deliver, max_batch)) {
+                    if (spin_) spin_->arrived(clock::now());
+                    continue;
+                }
+
+                // the ring cannot be read past a broken record
+                if (rx_.corrupt()) {
+                    on_dgram_error(boost::system::errc::make_error_code(
+                        boost::system::errc::bad_message));
+                    shm_close();
+                    break;
+                }
+
+                if (!spin_) break;
+
+                auto deadline = clock::now() + spin_->budget();
+
+                while (rx_.empty() && clock::now() < deadline) {}
+
+                if (rx_.empty()) break;
+            }
+
+            draining_ = false;
+
+            // shm_close() was called by a handler
+            if (closed_ && mapping_) {
+                ::munmap(mapping_, mapping_size_);
+                mapping_ = nullptr;
+            }
+        }
+
+        void report_errno_impl() {
+            on_dgram_error(boost::system::error_code(
+                errno, boost::asio::error::get_system_category()));
+        }
+
+        static void close_fds_impl(const std::vector<int>& fds) {
+            for (auto fd : fds)
+                if (fd >= 0) ::close(fd);
+        }
+
+        detail::shm_ring rx_;
+        // guarded by a mutex with o::ccy::safe, for concurrent writers
+        o::ccy::opt_safe_visitable<detail::shm_ring, ConcurrencyOption>
+            tx_ring_;
+        std::size_t max_message_ = 0;
+        char* mapping_ = nullptr;
+        std::size_t mapping_size_ = 0;
+        bool draining_ = false;
+        bool closed_ = false;
+        int peer_bell_ = -1;
+        boost::asio::posix::stream_descriptor doorbell_;
+        std::unique_ptr<detail::dgram_spin_budget> spin_;
+    };
+
+#endif
+
+} // namespace o::io::net
@@ -0,0 +1,90 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+/**
+ * @file
+ *
+ * Socket options that are not provided by boost::asio
+ */
+
+#include "../../types.h"
+#include <boost/asio/detail/socket_option.hpp>
+#include <boost/asio/detail/socket_types.hpp>
+
+#if defined(O_NET_LINUX)
+#include <netinet/udp.h>
+#endif
+
+namespace o::io::net::options {
+
+#if defined(SO_REUSEPORT) || defined(DOXY_GENERATE)
+    /**
+     * Allow multiple sockets to bind to the same address and port. On linux,
+     * the kernel will distribute incoming datagrams between these sockets.
+     */
+    using reuse_port =
+        boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+#if defined(SO_TIMESTAMPNS) || defined(DOXY_GENERATE)
+    /**
+     * Report the time a datagram arrived at the kernel with nanosecond
+     * resolution as ancillary data.
+     */
+    using timestamp_ns =
+        boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_TIMESTAMPNS>;
+#endif
+
+#if defined(SO_BUSY_POLL) || defined(DOXY_GENERATE)
+    /**
+     * Time in microseconds a blocking or non-blocking receive may busy poll
+     * the device queue for new packets. Raising it above the
+     * net.core.busy_read sysctl requires CAP_NET_ADMIN.
+     */
+    using busy_poll =
+        boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_BUSY_POLL>;
+#endif
+
+#if defined(UDP_GRO) || defined(DOXY_GENERATE)
+    /**
+     * Allow the kernel to coalesce multiple received UDP datagrams of the
+     * same flow into one larger buffer (generic receive offload).
+     */
+    using udp_gro =
+        boost::asio::detail::socket_option::boolean<SOL_UDP, UDP_GRO>;
+#endif
+
+#if defined(UDP_SEGMENT) || defined(DOXY_GENERATE)
+    /**
+     * Segment size used to split large UDP sends into multiple datagrams
+     * (generic segmentation offload). 0 disables segmentation.
+     */
+    using udp_segment =
+        boost::asio::detail::socket_option::integer<SOL_UDP, UDP_SEGMENT>;
+#endif
+
+} // namespace o::io::net::options
@@ -0,0 +1,575 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include "../messages/shared_message.h"
+#include "session_activity.h"
+#include "traffic_stats.h"
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+namespace o::io::net::server {
+
+    namespace detail {
+
+        // memory for the asynchronous operations of one kind a session
+        // has in flight: the operation, and the completion that starts
+        // the next one. each block is sized by the first operation it
+        // holds, the heap is used if both are taken.
+        class handler_slot {
+          public:
+            void* allocate(std::size_t size) {
+                for (auto& block : blocks_) {
+                    if (block.used) continue;
+
+                    if (size > block.size) {
+                        auto n = (size + sizeof(std::max_align_t) - 1) /
+                                 sizeof(std::max_align_t);
+                        block.storage.reset(new std::max_align_t[n]);
+                        block.size = n * sizeof(std::max_align_t);
+                    }
+
+                    block.used = true;
+                    return block.storage.get();
+                }
+
+                return ::operator new(size);
+            }
+
+            void deallocate(void* ptr) {
+                for (auto& block : blocks_)
+                    if (ptr == block.storage.get()) {
+                        block.used = false;
+                        return;
+                    }
+
+                ::operator delete(ptr);
+            }
+
+          private:
+            struct block {
+                std::unique_ptr<std::max_align_t[]> storage;
+                std::size_t size = 0;
+                bool used = false;
+            };
+
+            block blocks_[2];
+        };
+
+        template <typename T>
+        struct handler_slot_allocator {
+            using value_type = T;
+
+            explicit handler_slot_allocator(handler_slot& slot) noexcept
+                : slot(&slot) {}
+
+            template <typename U>
+            handler_slot_allocator(
+                const handler_slot_allocator<U>& other) noexcept
+                : slot(other.slot) {}
+
+            T* allocate(std::size_t n) {
+                return static_cast<T*>(slot->allocate(sizeof(T) * n));
+            }
+
+            void deallocate(T* ptr, std::size_t) { slot->deallocate(ptr); }
+
+            template <typename U>
+            bool operator==(const handler_slot_allocator<U>& other) const {
+                return slot == other.slot;
+            }
+
+            template <typename U>
+            bool operator!=(const handler_slot_allocator<U>& other) const {
+                return slot != other.slot;
+            }
+
+            handler_slot* slot;
+        };
+
+        // a buffer sequence referring to buffers owned by the session, so
+        // async_write does not copy them
+        struct const_buffer_range {
+            using value_type = boost::asio::const_buffer;
+            using const_iterator = const boost::asio::const_buffer*;
+
+            const_iterator begin() const { return first; }
+            const_iterator end() const { return last; }
+
+            const_iterator first;
+            const_iterator last;
+        };
+
+        // a completion handler that allocates from a handler_slot
+        template <typename Handler>
+        struct slot_handler {
+            using allocator_type = handler_slot_allocator<void>;
+
+            allocator_type get_allocator() const noexcept {
+                return allocator_type(*slot);
+            }
+
+            template <typename... Args>
+            void operator()(Args&&... args) {
+                handler(std::forward<Args>(args)...);
+            }
+
+            handler_slot* slot;
+            Handler handler;
+        };
+
+        template <typename Handler>
+        slot_handler<std::decay_t<Handler>>
+        make_slot_handler(handler_slot& slot, Handler&& handler) {
+            return {&slot, std::forward<Handler>(handler)};
+        }
+    } // namespace detail
+
+    /**
+     * A connection of a stream server, see server_base.
+     *
+     * Received bytes are read into a buffer that is reused for the
+     * lifetime of the session and passed to on_sess_received(), which
+     * returns how many of them it consumed. Bytes that were not consumed,
+     * like an incomplete message, stay in the buffer and are passed again
+     * together with the next read. The buffer starts small and only grows
+     * up to the maximum when a message does not fit, so idle connections
+     * stay cheap.
+     *
+     * Messages passed to write() are appended to a queue, which is written
+     * with a single gather write per flush. The queue keeps its capacity,
+     * so a session in steady state does not allocate, neither for reading
+     * nor for writing. The asynchronous operations of a session are
+     * allocated from memory the session keeps for them as well. write()
+     * and close() can be called from any thread.
+     *
+     * With o::ccy::safe, every session runs its handlers on a strand of
+     * its own, so the handlers of one session never run concurrently. The
+     * strand is kept as its concrete type and bound to the handlers, the
+     * socket itself keeps the plain executor of the io context. The
+     * socket must belong to a boost::asio::io_context.
+     *
+     * With o::sessions::features::statistics the session counts its
+     * traffic, with o::sessions::features::timeout it keeps the time of
+     * its last read or write, see server_base::sess_idle_timeout().
+     *
+     * @tparam  Protocol            The stream protocol, e.g.
+     *                              boost::asio::ip::tcp or
+     *                              local::stream_protocol.
+     * @tparam  MessageContainer    Type of the messages to write. Must have
+     *                              data() and size().
+     * @tparam  ConcurrencyOption   Type of the concurrency option.
+     * @tparam  Features            Feature tags, see
+     *                              o::sessions::features.
+     */
+    template <typename Protocol, typename MessageContainer,
+              typename ConcurrencyOption, typename... Features>
+    class stream_session
+        : public std::enable_shared_from_this<stream_session<
+              Protocol, MessageContainer, ConcurrencyOption, Features...>>,
+          public traffic_stats<
+              o::sessions::has_feature<o::sessions::features::statistics,
+                                       Features...>::value>,
+          public session_activity_for<Features...> {
+
+      public:
+        using protocol_type = Protocol;
+        using endpoint_type = typename Protocol::endpoint;
+        using socket_type = typename Protocol::socket;
+
+        /// the executor all handlers of the session run on, with
+        /// o::ccy::safe a strand of the io context of the socket
+        using executor_type = std::conditional_t<
+            o::ccy::is_safe<ConcurrencyOption>::value,
+            boost::asio::strand<boost::asio::io_context::executor_type>,
+            typename socket_type::executor_type>;
+
+        /** default initial size of the read buffer */
+        static constexpr const std::size_t default_read_size = 4096;
+
+        /** default maximum size of the read buffer */
+        static constexpr const std::size_t default_max_read_size = 1 << 20;
+
+        /**
+         * Constructor
+         *
+         * @param   sock    The connected socket.
+         */
+        explicit stream_session(socket_type&& sock)
+            : sock_(std::move(sock)), exec_(sess_executor_impl(sock_)) {}
+
+        stream_session(const stream_session&) = delete;
+        stream_session& operator=(const stream_session&) = delete;
+
+        virtual ~stream_session() {
+            tx_.apply([](auto& tx) { tx_release_impl(tx.pending); });
+            tx_release_impl(inflight_);
+        }
+
+        /**
+         * Handles received bytes.
+         *
+         * @param   data    The received bytes that were not consumed yet.
+         *                  Only valid until this function returns.
+         * @param   size    Number of bytes.
+         *
+         * @returns The number of bytes consumed. The rest is passed again
+         *          after the next read.
+         */
+        virtual std::size_t on_sess_received(const char* data,
+                                             std::size_t size) = 0;
+
+        /**
+         * Called once the session was registered with the server, before
+         * the first read.
+         */
+        virtual void on_sess_started() {}
+
+        /**
+         * Called once when the session is closed, by the peer, because of
+         * an error or by close().
+         *
+         * @param   ec  The reason, boost::asio::error::eof if the peer
+         *              closed the connection.
+         */
+        virtual void on_sess_closed(boost::system::error_code ec) {}
+
+        /**
+         * Set the initial and the maximum size of the read buffer. A
+         * session that receives more than the maximum without consuming
+         * anything is closed with boost::asio::error::message_size. Call
+         * before the session is started.
+         *
+         * @param   initial The initial size.
+         * @param   max     The maximum size.
+         */
+        void read_buffer_size(std::size_t initial, std::size_t max) {
+            rx_.resize(std::max<std::size_t>(initial, 1));
+            rx_max_ = std::max(max, rx_.size());
+        }
+
+        /**
+         * Queue a message. Can be called from any thread. Messages written
+         * after the session was closed are discarded. If the message
+         * supports send notifications, notify_send() is called when it is
+         * queued and notify_send_done() once it was written or discarded.
+         *
+         * @param   message The message.
+         */
+        void write(MessageContainer&& message) {
+            if constexpr (notify_messages) message.notify_send();
+
+            sess_queue_impl(
+                tx_message(std::forward<MessageContainer>(message)));
+        }
+
+        /**
+         * Queue a shared message without copying its bytes, the session
+         * holds a reference until it was written.
+         *
+         * @param   message The message.
+         */
+        void write(const o::io::messages::shared_message& message) {
+            sess_queue_impl(tx_message(message));
+        }
+
+        /**
+         * Close the connection. Queued messages that were not written yet
+         * are discarded. Can be called from any thread.
+         */
+        void close() { close(boost::asio::error::operation_aborted); }
+
+        /**
+         * Close the connection.
+         *
+         * @param   reason  Passed to on_sess_closed().
+         */
+        void close(boost::system::error_code reason) {
+            boost::asio::dispatch(exec_,
+                                  [self = this->shared_from_this(), reason]() {
+                                      self->sess_close_impl(reason);
+                                  });
+        }
+
+        /** @returns true once the session was closed */
+        bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+        /** @returns The endpoint of the peer. */
+        endpoint_type remote_endpoint() const {
+            boost::system::error_code ec;
+            return sock_.remote_endpoint(ec);
+        }
+
+        socket_type& socket() { return sock_; }
+
+        const executor_type& get_executor() const { return exec_; }
+
+        /**
+         * Start reading. Called by the server, on the executor of the
+         * session. A session that was closed before it was started is not
+         * started, `on_closed` is called right away.
+         *
+         * @param   on_closed   Called after on_sess_closed(), used by the
+         *                      server to forget the session.
+         */
+        void start(std::function<void()> on_closed) {
+            if (closed()) {
+                if (on_closed) on_closed();
+                return;
+            }
+
+            on_closed_ = std::move(on_closed);
+
+            if (rx_.empty()) rx_.resize(default_read_size);
+
+            on_sess_started();
+
+            if (!closed()) sess_read_impl();
+        }
+
+      private:
+        using shared_message = o::io::messages::shared_message;
+
+        // messages that are not shared_messages themselves are notified
+        // when queued and released, if they support it
+        static constexpr const bool notify_messages =
+            o::messages::is_send_notification_supported<
+                MessageContainer>::value &&
+            !std::is_same<MessageContainer, shared_message>::value;
+
+        // the queue holds both kinds of messages, unless they are the same
+        using tx_message = std::conditional_t<
+            std::is_same<MessageContainer, shared_message>::value,
+            shared_message, std::variant<MessageContainer, shared_message>>;
+
+        static boost::asio::const_buffer tx_buffer_impl(const tx_message& m) {
+            if constexpr (std::is_same<tx_message, shared_message>::value)
+                return {m.data(), m.size()};
+            else
+                return std::visit(
+                    [](const auto& message) {
+                        return boost::asio::const_buffer(message.data(),
+                                                         message.size());
+                    },
+                    m);
+        }
+
+        static void tx_release_impl(std::vector<tx_message>& messages) {
+            if constexpr (notify_messages)
+                for (auto& m : messages)
+                    if (auto message = std::get_if<MessageContainer>(&m))
+                        message->notify_send_done();
+
+            messages.clear();
+        }
+
+        void sess_queue_impl(tx_message&& message) {
+
+            if (closed()) {
+                if constexpr (notify_messages)
+                    if (auto m = std::get_if<MessageContainer>(&message))
+                        m->notify_send_done();
+                return;
+            }
+
+            bool start = false;
+
+            tx_.apply([&](auto& tx) {
+                tx.pending.push_back(std::move(message));
+                if (!tx.writing) tx.writing = start = true;
+            });
+
+            if (!start) return;
+
+            // flush right away when called from a handler of the session
+            if constexpr (o::ccy::is_safe<ConcurrencyOption>::value)
+                if (exec_.running_in_this_thread()) return sess_flush_impl();
+
+            // only one flush is dispatched at a time
+            boost::asio::dispatch(
+                exec_, detail::make_slot_handler(
+                           flush_slot_, [self = this->shared_from_this()]() {
+                               self->sess_flush_impl();
+                           }));
+        }
+
+        static executor_type sess_executor_impl(socket_type& sock) {
+            if constexpr (o::ccy::is_safe<ConcurrencyOption>::value)
+                return executor_type(
+                    static_cast<boost::asio::io_context&>(
+                        boost::asio::query(sock.get_executor(),
+                                           boost::asio::execution::context))
+                        .get_executor());
+            else
+                return sock.get_executor();
+        }
+
+        void sess_read_impl() {
+
+            if (rx_used_ == rx_.size()) {
+                if (rx_.size() >= rx_max_)
+                    return sess_close_impl(boost::asio::error::message_size);
+
+                rx_.resize(std::min(rx_.size() * 2, rx_max_));
+            }
+
+            sock_.async_read_some(
+                boost::asio::buffer(rx_.data() + rx_used_,
+                                    rx_.size() - rx_used_),
+                boost::asio::bind_executor(
+                    exec_, detail::make_slot_handler(
+                               rx_slot_, [self = this->shared_from_this()](
+                                             boost::system::error_code ec,
+                                             std::size_t bytes) {
+                                   self->on_sess_read_impl(ec, bytes);
+                               })));
+        }
+
+        void on_sess_read_impl(boost::system::error_code ec,
+                               std::size_t bytes) {
+
+            if (ec) return sess_close_impl(ec);
+
+            rx_used_ += bytes;
+
+            this->stats_in(1, bytes);
+            this->activity_touch();
+
+            std::size_t consumed = 0;
+
+            this->stats_handler(
+                [&] { consumed = on_sess_received(rx_.data(), rx_used_); });
+
+            if (closed()) return;
+
+            if (consumed >= rx_used_)
+                rx_used_ = 0;
+            else if (consumed) {
+                std::memmove(rx_.data(), rx_.data() + consumed,
+                             rx_used_ - consumed);
+                rx_used_ -= consumed;
+            }
+
+            sess_read_impl();
+        }
+
+        // Write everything that is queued. Runs on the executor of the
+        // session, only one flush is in progress at a time.
+        void sess_flush_impl() {
+
+            if (closed()) return;
+
+            tx_.apply([&](auto& tx) { std::swap(tx.pending, inflight_); });
+
+            buffers_.clear();
+            for (const auto& message : inflight_)
+                buffers_.push_back(tx_buffer_impl(message));
+
+            boost::asio::async_write(
+                sock_,
+                detail::const_buffer_range{buffers_.data(),
+                                           buffers_.data() + buffers_.size()},
+                boost::asio::bind_executor(
+                    exec_, detail::make_slot_handler(
+                               tx_slot_, [self = this->shared_from_this()](
+                                             boost::system::error_code ec,
+                                             std::size_t bytes) {
+                                   self->on_sess_written_impl(ec, bytes);
+                               })));
+        }
+
+        void on_sess_written_impl(boost::system::error_code ec,
+                                  std::size_t bytes) {
+
+            if (ec) return sess_close_impl(ec);
+
+            this->stats_out(inflight_.size(), bytes);
+            this->activity_touch();
+
+            // releases the references of shared messages
+            tx_release_impl(inflight_);
+
+            bool more = false;
+
+            tx_.apply([&](auto& tx) {
+                if (tx.pending.empty())
+                    tx.writing = false;
+                else
+                    more = true;
+            });
+
+            if (more) sess_flush_impl();
+        }
+
+        void sess_close_impl(boost::system::error_code ec) {
+
+            if (closed_.exchange(true, std::memory_order_acq_rel)) return;
+
+            boost::system::error_code ignored;
+            sock_.shutdown(socket_type::shutdown_both, ignored);
+            sock_.close(ignored);
+
+            tx_.apply([](auto& tx) { tx_release_impl(tx.pending); });
+            tx_release_impl(inflight_);
+
+            on_sess_closed(ec);
+
+            if (on_closed_) on_closed_();
+        }
+
+        // state shared between writers and the flushing executor
+        struct tx_state {
+            std::vector<tx_message> pending;
+            bool writing = false;
+        };
+
+        socket_type sock_;
+        executor_type exec_;
+
+        std::vector<char> rx_;
+        std::size_t rx_used_ = 0;
+        std::size_t rx_max_ = default_max_read_size;
+        detail::handler_slot rx_slot_;
+
+        o::ccy::opt_safe_visitable<tx_state, ConcurrencyOption> tx_;
+        std::vector<tx_message> inflight_;
+        std::vector<boost::asio::const_buffer> buffers_;
+        detail::handler_slot tx_slot_;
+        detail::handler_slot flush_slot_;
+
+        std::atomic<bool> closed_{false};
+        std::function<void()> on_closed_;
+    };
+
+} // namespace o::io::net::server
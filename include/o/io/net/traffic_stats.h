@@ -0,0 +1,264 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+/**
+ * @file
+ *
+ * Traffic counters for devices and sessions, enabled with the
+ * o::sessions::features::statistics feature tag.
+ */
+
+#include "../../types.h"
+#include "../histogram.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#if defined(O_NET_LINUX)
+#include <linux/sock_diag.h>
+#include <sys/socket.h>
+#endif
+
+namespace o::io::net {
+
+    /** Counters of a device or session, summed over all threads */
+    struct traffic_snapshot {
+        /** messages received */
+        std::uint64_t packets_in = 0;
+        /** payload bytes received */
+        std::uint64_t bytes_in = 0;
+        /** messages sent */
+        std::uint64_t packets_out = 0;
+        /** payload bytes sent */
+        std::uint64_t bytes_out = 0;
+        /** errors, indexed by the error_case of the device */
+        std::array<std::uint64_t, 3> errors{};
+        /** datagrams the kernel dropped because the receive queue of the
+         * socket was full, 0 where this is unknown */
+        std::uint64_t rx_drops = 0;
+
+        traffic_snapshot& operator+=(const traffic_snapshot& other) {
+            packets_in += other.packets_in;
+            bytes_in += other.bytes_in;
+            packets_out += other.packets_out;
+            bytes_out += other.bytes_out;
+            for (std::size_t i = 0; i < errors.size(); ++i)
+                errors[i] += other.errors[i];
+            rx_drops += other.rx_drops;
+            return *this;
+        }
+    };
+
+    namespace detail {
+
+        // Index of the calling thread into the shards of traffic_stats.
+        // Threads are numbered in the order they first count something.
+        inline std::size_t traffic_thread_index() {
+            static std::atomic<std::size_t> next{0};
+            static thread_local std::size_t index =
+                next.fetch_add(1, std::memory_order_relaxed);
+            return index;
+        }
+
+        // Number of datagrams the kernel dropped on a socket, because its
+        // receive buffer was full. 0 if unknown.
+        inline std::uint64_t dgram_rx_drops(int fd) {
+#if defined(O_NET_LINUX) && defined(SO_MEMINFO)
+            std::uint32_t info[SK_MEMINFO_VARS] = {};
+            ::socklen_t len = sizeof(info);
+
+            if (::getsockopt(fd, SOL_SOCKET, SO_MEMINFO, info, &len) == 0 &&
+                len > SK_MEMINFO_DROPS * sizeof(std::uint32_t))
+                return info[SK_MEMINFO_DROPS];
+#endif
+            return 0;
+        }
+    } // namespace detail
+
+    /**
+     * Traffic counters, compiled away unless Enabled is true. Devices and
+     * sessions derive from it and count from their io handlers.
+     *
+     * Every thread counts into a shard of its own, on a separate cache
+     * line, so threads that receive for the same device do not contend.
+     * Reading the counters sums the shards. If more threads than shards
+     * count, some of them share a shard, which stays correct but is no
+     * longer free of contention. The histogram of the handler times is
+     * allocated by the first handler timed on a shard, so shards of
+     * threads that only send stay small.
+     *
+     * @tparam  Enabled Whether to count.
+     * @tparam  Shards  Number of shards, 1 for single threaded users.
+     */
+    template <bool Enabled, std::size_t Shards = 1>
+    class traffic_stats {
+      public:
+        static constexpr const bool statistics_enabled = false;
+
+      protected:
+        void stats_in(std::size_t, std::size_t) {}
+        void stats_out(std::size_t, std::size_t) {}
+        void stats_error(std::size_t) {}
+
+        template <typename Handler>
+        void stats_handler(Handler&& handler) {
+            handler();
+        }
+    };
+
+    template <std::size_t Shards>
+    class traffic_stats<true, Shards> {
+
+      public:
+        static constexpr const bool statistics_enabled = true;
+
+        traffic_stats() : shards_(new shard[Shards]) {}
+
+        /**
+         * @returns The counters, summed over all threads.
+         */
+        traffic_snapshot traffic() const {
+
+            traffic_snapshot out;
+
+            for (std::size_t i = 0; i < Shards; ++i) {
+                const auto& c = shards_[i].counters;
+                out.packets_in += load(c[packets_in]);
+                out.bytes_in += load(c[bytes_in]);
+                out.packets_out += load(c[packets_out]);
+                out.bytes_out += load(c[bytes_out]);
+                for (std::size_t e = 0; e < out.errors.size(); ++e)
+                    out.errors[e] += load(c[errors + e]);
+            }
+
+            return out;
+        }
+
+        /**
+         * Add the time spent in the receive handlers, in nanoseconds, to a
+         * histogram.
+         *
+         * @param [in,out]  out The histogram.
+         */
+        void handler_latency(o::io::histogram& out) const {
+            for (std::size_t i = 0; i < Shards; ++i)
+                if (auto* latency = shards_[i].latency.load(
+                        std::memory_order_acquire))
+                    out.merge(*latency);
+        }
+
+      protected:
+        void stats_in(std::size_t packets, std::size_t bytes) {
+            auto& c = local().counters;
+            add(c[packets_in], packets);
+            add(c[bytes_in], bytes);
+        }
+
+        void stats_out(std::size_t packets, std::size_t bytes) {
+            auto& c = local().counters;
+            add(c[packets_out], packets);
+            add(c[bytes_out], bytes);
+        }
+
+        void stats_error(std::size_t error_case) {
+            if (error_case < 3) add(local().counters[errors + error_case], 1);
+        }
+
+        // Call a receive handler and record the time it took.
+        template <typename Handler>
+        void stats_handler(Handler&& handler) {
+            auto begin = std::chrono::steady_clock::now();
+            handler();
+            latency_of(local()).record(std::chrono::steady_clock::now() -
+                                       begin);
+        }
+
+      private:
+        enum counter : std::size_t {
+            packets_in,
+            bytes_in,
+            packets_out,
+            bytes_out,
+            errors,
+            counter_count = errors + 3
+        };
+
+        struct alignas(64) shard {
+            std::array<std::atomic<std::uint64_t>, counter_count> counters{};
+            std::atomic<o::io::histogram*> latency{nullptr};
+
+            ~shard() { delete latency.load(std::memory_order_relaxed); }
+        };
+
+        shard& local() {
+            if constexpr (Shards == 1) return shards_[0];
+            return shards_[detail::traffic_thread_index() % Shards];
+        }
+
+        // The histogram of a shard. Threads sharing the shard may race to
+        // create it, the loser deletes its copy.
+        static o::io::histogram& latency_of(shard& s) {
+
+            auto* current = s.latency.load(std::memory_order_acquire);
+
+            if (current) return *current;
+
+            auto created = std::make_unique<o::io::histogram>();
+
+            if (s.latency.compare_exchange_strong(current, created.get(),
+                                                  std::memory_order_acq_rel))
+                return *created.release();
+
+            return *current;
+        }
+
+        static void add(std::atomic<std::uint64_t>& c, std::uint64_t n) {
+            c.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        static std::uint64_t load(const std::atomic<std::uint64_t>& c) {
+            return c.load(std::memory_order_relaxed);
+        }
+
+        std::unique_ptr<shard[]> shards_;
+    };
+
+    /**
+     * The traffic_stats for a device or session with the given concurrency
+     * option and feature tags. Counts if o::sessions::features::statistics
+     * is one of the tags, with a shard per thread under o::ccy::safe.
+     */
+    template <typename ConcurrencyOption, typename... Features>
+    using traffic_stats_for = traffic_stats<
+        o::sessions::has_feature<o::sessions::features::statistics,
+                                 Features...>::value,
+        o::ccy::is_safe<ConcurrencyOption>::value ? 16 : 1>;
+
+} // namespace o::io::net
@@ -25,10 +25,25 @@
 
 #pragma once
 
+#include "../../ccy/rcu_slot.h"
 #include "../../types.h"
+#include "../histogram.h"
+#include "../timer.h"
+#include "dgram_batch.h"
+#include "dgram_buffer_pool.h"
+#include "dgram_dispatch.h"
+#include "dgram_busy_poll.h"
+#include "dgram_offload.h"
+#include "dgram_pacer.h"
+#include "dgram_send_queue.h"
+#include "multicast.h"
+#include "socket_options.h"
+#include "traffic_stats.h"
+#include <map>
+#include <vector>
 #include <boost/asio.hpp>
-#include <boost/optional.hpp>
 #include <functional>
+#include <memory>
 
 namespace o::io::net {
 
@@ -41,10 +56,17 @@ namespace o::io::net {
      * @tparam  ThreadOption    Type of the thread option.
      */
     template <typename Protocol, typename MessageContainer,
-              typename ConcurrencyOption>
-    class datagram_device {
+              typename ConcurrencyOption, typename... Features>
+    class datagram_device
+        : public traffic_stats_for<ConcurrencyOption, Features...> {
+
+        using stats_type = traffic_stats_for<ConcurrencyOption, Features...>;
 
       public:
+        using protocol_type = Protocol;
+        using endpoint_type = typename Protocol::endpoint;
+        using message_type = MessageContainer;
+
         struct use_v6 {};
 
         enum class error_case { connect, bind, read };
@@ -71,6 +93,57 @@ namespace o::io::net {
          */
         virtual void on_dgram_received(MessageContainer&&) = 0;
 
+        /**
+         * Handles a received datagram together with the endpoint it was
+         * received from. Override this instead of on_dgram_received() when
+         * more than one receive may be outstanding (see
+         * dgram_receive_depth()), since last_remote() is shared by all of
+         * them. The default implementation stores the endpoint as
+         * last_remote() and calls on_dgram_received().
+         *
+         * @param   remote  The endpoint the datagram was received from.
+         * @param   message The received datagram.
+         */
+        virtual void on_dgram_received_from(const endpoint_type& remote,
+                                            MessageContainer&& message) {
+            last_remote_endp_ = remote;
+            on_dgram_received(std::forward<MessageContainer>(message));
+        }
+
+        /**
+         * Handles a batch of received datagrams. Will only be called if
+         * batched receiving was enabled with dgram_receive_batched(). The
+         * default implementation passes every datagram of the batch to
+         * on_dgram_received().
+         *
+         * @param   batch   The received datagrams. The batch and the memory
+         *                  it references are only valid until this function
+         *                  returns.
+         */
+        virtual void on_dgram_batch(const dgram_batch<Protocol>& batch) {
+            for (const auto& dgram : batch)
+                on_dgram_received_from(
+                    dgram.remote(),
+                    dgram_message_impl(dgram.data(), dgram.size()));
+        }
+
+        /**
+         * Handles a datagram that was received into a pooled buffer. Will
+         * only be called if pooled receiving was enabled with
+         * dgram_receive_pooled(). The buffer returns to the pool as soon as
+         * the last reference to it is released, so it may be kept beyond
+         * this call. The default implementation copies the datagram and
+         * passes it to on_dgram_received_from().
+         *
+         * @param   remote  The endpoint the datagram was received from.
+         * @param   dgram   The received datagram.
+         */
+        virtual void on_dgram_buffer(const endpoint_type& remote,
+                                     pooled_dgram&& dgram) {
+            on_dgram_received_from(
+                remote, dgram_message_impl(dgram.data(), dgram.size()));
+        }
+
         /**
          * Called when a send operation completes.
          *
@@ -79,6 +152,28 @@ namespace o::io::net {
          */
         virtual void on_dgram_sent() = 0;
 
+        /**
+         * Called when a batch of queued datagrams was handed to the
+         * operating system. Will only be called if queued sending was
+         * enabled with dgram_send_batched(). The default implementation
+         * calls on_dgram_sent() once per batch.
+         *
+         * @param   count   Number of datagrams in the batch.
+         */
+        virtual void on_dgram_batch_sent(std::size_t) { on_dgram_sent(); }
+
+        /**
+         * Called when a bounded send queue reached its high watermark
+         * (`congested` is true) and when it drained to its low watermark
+         * again (`congested` is false). Producers should slow down in
+         * between. Only called if the send queue was bounded with
+         * dgram_send_bounded().
+         *
+         * @param   congested   Whether the queue is above its high
+         *                      watermark.
+         */
+        virtual void on_dgram_backpressure(bool) {}
+
         /**
          * Executes the UDP error action
          *
@@ -91,6 +186,308 @@ namespace o::io::net {
         virtual void on_dgram_error(error_case eca,
                                     boost::system::error_code eco) {}
 
+        /**
+         * Receive up to `count` datagrams per readiness event instead of
+         * arming one receive operation per datagram. On linux, this will
+         * use recvmmsg. The datagrams will be passed to on_dgram_batch().
+         * Must be called before the socket is bound.
+         *
+         * @param   count       Maximum number of datagrams per batch.
+         * @param   max_size    Maximum size of a single datagram.
+         */
+        void dgram_receive_batched(std::size_t count,
+                                   std::size_t max_size = 4096) {
+            batch_rx_ =
+                std::make_unique<detail::dgram_batch_receiver<Protocol>>(
+                    count, max_size);
+        }
+
+        /**
+         * Receive datagrams into buffers taken from a pool instead of a
+         * single streambuf and pass them to on_dgram_buffer() without
+         * copying. Has no effect if batched receiving is enabled. Must be
+         * called before the socket is bound.
+         *
+         * @param   buffer_size Size of a single buffer. Larger datagrams
+         *                      will be truncated.
+         * @param   count       Number of buffers to allocate upfront.
+         */
+        void dgram_receive_pooled(std::size_t buffer_size = 4096,
+                                  std::size_t count = 16) {
+            rx_pool_ = std::make_unique<dgram_buffer_pool>(buffer_size, count);
+        }
+
+        /**
+         * Enable UDP generic receive offload. The kernel may then coalesce
+         * consecutive datagrams of a flow into a single buffer, which will
+         * be split back into the original datagrams before they are passed
+         * to on_dgram_batch(). This implies batched receiving with buffers
+         * large enough to hold a coalesced message. Only supported on
+         * linux, on other platforms only batched receiving is enabled. Must
+         * be called before the socket is bound.
+         *
+         * @param   count   Maximum number of coalesced messages per batch.
+         */
+        void dgram_receive_gro(std::size_t count = 8) {
+            rx_gro_ = true;
+            dgram_receive_batched(count, dgram_offload_max_size);
+        }
+
+        /**
+         * Let the kernel timestamp every datagram on arrival
+         * (SO_TIMESTAMPNS). The timestamps are available through
+         * dgram_view::timestamp() in on_dgram_batch(), and the delay
+         * between arrival and the invocation of the batch handler is
+         * recorded in dgram_rx_delay(). Kernel timestamps are delivered as
+         * ancillary data, so this implies batched receiving if it was not
+         * enabled already. Only supported on linux. Must be called before
+         * the socket is bound.
+         *
+         * @param   count   Maximum number of datagrams per batch, if
+         *                  batched receiving was not enabled yet.
+         */
+        void dgram_receive_timestamps(std::size_t count = 16) {
+            rx_delay_ = std::make_unique<o::io::histogram>();
+            if (!batch_rx_) dgram_receive_batched(count);
+        }
+
+        /**
+         * Histogram of the delay between the arrival of a datagram at the
+         * kernel and the invocation of on_dgram_batch() in nanoseconds.
+         *
+         * @returns The histogram or nullptr, if kernel timestamps were not
+         *          enabled with dgram_receive_timestamps().
+         */
+        const o::io::histogram* dgram_rx_delay() const {
+            return rx_delay_.get();
+        }
+
+        /**
+         * Let the kernel report the destination address and the receiving
+         * interface of every datagram (IP_PKTINFO). They are available
+         * through dgram_view::destination() and
+         * dgram_view::interface_index() in on_dgram_batch(). This is
+         * required to tell datagrams for different multicast groups
+         * apart on a single socket and implies batched receiving if it was
+         * not enabled already. Only supported on linux. Must be called
+         * before the socket is bound.
+         *
+         * @param   count   Maximum number of datagrams per batch, if
+         *                  batched receiving was not enabled yet.
+         */
+        void dgram_receive_destination(std::size_t count = 16) {
+            rx_pktinfo_ = true;
+            if (!batch_rx_) dgram_receive_batched(count);
+        }
+
+        /**
+         * Keep `depth` receive operations outstanding instead of one. Every
+         * receive operation owns its buffer and sender endpoint, so on a
+         * multithreaded io_context up to `depth` datagrams can be handled
+         * in parallel. Handlers should then use on_dgram_received_from() or
+         * on_dgram_buffer() and reply with dgram_write(), since
+         * last_remote() and dgram_reply() would race. Has no effect if
+         * batched receiving is enabled. Must be called before the socket is
+         * bound.
+         *
+         * @param   depth       Number of outstanding receive operations.
+         * @param   max_size    Maximum size of a single datagram. Ignored
+         *                      if pooled receiving is enabled.
+         */
+        void dgram_receive_depth(std::size_t depth,
+                                 std::size_t max_size = 4096) {
+            rx_slots_ = std::vector<receive_slot>(depth);
+
+            for (auto& slot : rx_slots_) slot.buffer.resize(max_size);
+        }
+
+        /**
+         * Low latency mode for devices that run on a dedicated core. After
+         * a datagram was handled, the socket is polled without blocking for
+         * up to `max_spin` before the device waits for the reactor again,
+         * which saves the wake up of the io thread when datagrams arrive
+         * back to back. The actual spin time follows the observed time
+         * between datagrams, so an idle socket does not spin at all. If
+         * `kernel_poll` is not zero, SO_BUSY_POLL is set as well, so the
+         * kernel polls the device queue during the non-blocking receives.
+         * Has no effect if pooled receiving is enabled and should only be
+         * used with a single outstanding receive. Must be called before the
+         * socket is bound.
+         *
+         * @param   max_spin    Maximum time to spin for the next datagram.
+         * @param   kernel_poll Value for SO_BUSY_POLL, 0 to leave it unset.
+         */
+        void dgram_receive_busy_poll(
+            std::chrono::microseconds max_spin = std::chrono::microseconds(50),
+            std::chrono::microseconds kernel_poll =
+                std::chrono::microseconds(0)) {
+            rx_spin_ = std::make_unique<detail::dgram_spin_budget>(max_spin);
+            rx_busy_poll_ = kernel_poll;
+        }
+
+        /**
+         * Queue outgoing datagrams instead of starting one send operation
+         * per datagram. The queue will be flushed as soon as it holds
+         * `max_batch` datagrams, or at the latest `max_latency` after the
+         * first datagram was queued. On linux, a flush will use sendmmsg.
+         * Must be called before the first datagram is written.
+         *
+         * @param   max_batch   Maximum number of datagrams per system call.
+         * @param   max_latency Maximum time a datagram may wait in the queue
+         *                      before a flush is started.
+         */
+        void dgram_send_batched(std::size_t max_batch,
+                                std::chrono::microseconds max_latency =
+                                    std::chrono::microseconds(100)) {
+            tx_ = std::make_unique<send_queue_type>(sock_.get_executor(),
+                                                    max_batch, max_latency);
+        }
+
+        /**
+         * Pace outgoing datagrams with a token bucket. At most `rate`
+         * datagrams per second are sent, and up to `burst` datagrams may be
+         * sent back to back after a quiet period. Datagrams that exceed the
+         * rate are held back and released by a single timer, which fires at
+         * most once per `resolution` and releases everything that became
+         * due in the meantime. Datagrams released late keep their credit,
+         * so the rate holds over time even though the timer is coarse. Can
+         * be combined with dgram_send_paced_per_destination(). The held
+         * back datagrams are only limited if dgram_send_bounded() is used.
+         * Must be called before the first datagram is written.
+         *
+         * @param   rate        Datagrams per second, no limit if it is not
+         *                      positive.
+         * @param   burst       Maximum number of datagrams sent back to back.
+         * @param   resolution  Minimum time between two releases.
+         */
+        void dgram_send_paced(double rate, std::size_t burst,
+                              std::chrono::microseconds resolution =
+                                  std::chrono::microseconds(100)) {
+            dgram_pace_init_impl(resolution);
+
+            pace_->state.apply(
+                [&](auto& paced) { paced.pacer.limit_global(rate, burst); });
+        }
+
+        /**
+         * Pace outgoing datagrams with one token bucket per destination
+         * endpoint. A destination that exceeds its rate does not hold back
+         * datagrams for other destinations. See dgram_send_paced().
+         *
+         * @param   rate        Datagrams per second and destination.
+         * @param   burst       Maximum number of datagrams sent back to back
+         *                      to one destination.
+         * @param   resolution  Minimum time between two releases.
+         */
+        void dgram_send_paced_per_destination(
+            double rate, std::size_t burst,
+            std::chrono::microseconds resolution =
+                std::chrono::microseconds(100)) {
+            dgram_pace_init_impl(resolution);
+
+            pace_->state.apply([&](auto& paced) {
+                paced.pacer.limit_destination(rate, burst);
+            });
+        }
+
+        /**
+         * Limit the number of datagrams in the send queue. A datagram that
+         * is written while `capacity` datagrams are queued is handled
+         * according to `policy`. on_dgram_backpressure() is called when the
+         * queue fills up to `capacity` and when it drained to half of it,
+         * see dgram_send_watermarks() to change these levels. Enables queued
+         * sending with a batch size of 32 if dgram_send_batched() was not
+         * called before. Must be called before the first datagram is
+         * written.
+         *
+         * If the device is paced, the datagrams held back by the pacer are
+         * limited to `capacity` as well and dropped by the same policy.
+         * The pacer never blocks, with block_producer it drops the newest
+         * datagram.
+         *
+         * @param   capacity    Maximum number of queued datagrams.
+         * @param   policy      What to do with datagrams that do not fit.
+         */
+        void dgram_send_bounded(
+            std::size_t capacity,
+            dgram_drop_policy policy = dgram_drop_policy::drop_newest) {
+
+            if (!tx_) dgram_send_batched(32);
+
+            tx_->capacity = capacity;
+            tx_->policy = policy;
+            dgram_send_watermarks(capacity, capacity / 2);
+
+            if (pace_)
+                pace_->state.apply([&](auto& paced) {
+                    paced.pacer.bound(capacity, policy);
+                });
+        }
+
+        /**
+         * Set the queue depths at which on_dgram_backpressure() is called.
+         * Must be called after dgram_send_bounded().
+         *
+         * @param   high    Depth at which the queue counts as congested.
+         * @param   low     Depth at which the queue is no longer congested.
+         */
+        void dgram_send_watermarks(std::size_t high, std::size_t low) {
+            tx_->high_watermark = high;
+            tx_->low_watermark = low;
+        }
+
+        /**
+         * @return  The current depth and counters of the send queue. All
+         *          zero if queued sending is not enabled. The drop counters
+         *          include datagrams dropped by the pacer.
+         */
+        dgram_send_stats dgram_tx_stats() const {
+
+            auto out = tx_ ? tx_->snapshot() : dgram_send_stats();
+
+            if (pace_)
+                pace_->state.apply([&](auto& paced) {
+                    out.dropped_newest += paced.pacer.dropped_newest();
+                    out.dropped_oldest += paced.pacer.dropped_oldest();
+                });
+
+            return out;
+        }
+
+        /**
+         * Open the socket without binding it, so options can be applied
+         * to dgram_sock() before dgram_sock_bind() is called.
+         *
+         * @param   protocol    The protocol to open the socket with.
+         */
+        void dgram_sock_open(const Protocol& protocol) {
+
+            boost::system::error_code ec;
+
+            if (!sock_.is_open()) sock_.open(protocol, ec);
+
+            if (ec) dgram_error_impl(error_case::bind, ec);
+        }
+
+        /**
+         * Set an option on the socket. Errors are reported to
+         * on_dgram_error() like those of dgram_sock_bind().
+         *
+         * @param   option  The option.
+         * @returns true if the option was set.
+         */
+        template <typename Option>
+        bool dgram_sock_option(const Option& option) {
+
+            boost::system::error_code ec;
+
+            sock_.set_option(option, ec);
+
+            if (ec) dgram_error_impl(error_case::bind, ec);
+
+            return !ec;
+        }
+
         /**
          * Bind the socket to an endpoint.
          *
@@ -107,11 +504,40 @@ namespace o::io::net {
 
             if (!sock_.is_open()) sock_.open(local_endp_.protocol());
 
+#if defined(UDP_GRO)
+            if (rx_gro_) sock_.set_option(options::udp_gro(true), ec);
+
+            if (ec) return dgram_error_impl(error_case::bind, ec);
+#endif
+
+#if defined(SO_TIMESTAMPNS)
+            if (rx_delay_) sock_.set_option(options::timestamp_ns(true), ec);
+
+            if (ec) return dgram_error_impl(error_case::bind, ec);
+#endif
+
+            if (rx_spin_) sock_.non_blocking(true, ec);
+
+            if (ec) return dgram_error_impl(error_case::bind, ec);
+
+#if defined(SO_BUSY_POLL)
+            if (rx_busy_poll_.count())
+                sock_.set_option(options::busy_poll(rx_busy_poll_.count()), ec);
+
+            if (ec) return dgram_error_impl(error_case::bind, ec);
+#endif
+
+            if (rx_pktinfo_)
+                detail::dgram_enable_pktinfo(
+                    sock_, local_endp_.protocol().family(), ec);
+
+            if (ec) return dgram_error_impl(error_case::bind, ec);
+
             sock_.bind(local_endp_, ec);
 
-            if (ec) return on_dgram_error(error_case::bind, ec);
+            if (ec) return dgram_error_impl(error_case::bind, ec);
 
-            dgram_do_receive_impl();
+            dgram_receive_start();
         }
 
         /**
@@ -123,6 +549,9 @@ namespace o::io::net {
          *
          * @param   port    The port.
          */
+        template <typename P = Protocol,
+                  typename = std::enable_if_t<
+                      o::type_traits::is_ip_protocol<P>::value>>
         void dgram_sock_bind(short port) {
             dgram_sock_bind(typename Protocol::endpoint(Protocol::v4(), port));
         }
@@ -137,6 +566,9 @@ namespace o::io::net {
          * @param   port    The port.
          * @param   v6hint  The 6hint.
          */
+        template <typename P = Protocol,
+                  typename = std::enable_if_t<
+                      o::type_traits::is_ip_protocol<P>::value>>
         void dgram_sock_bind(short port, use_v6 v6hint) {
             dgram_sock_bind(typename Protocol::endpoint(Protocol::v6(), port));
         }
@@ -144,80 +576,731 @@ namespace o::io::net {
         /**
          * close the socket
          */
-        void dgram_sock_close() {
+        virtual void dgram_sock_close() {
             if (sock_.is_open()) sock_.close();
         }
 
         /**
-         * send a message to the specified endpoint
+         * send a message to the specified endpoint. Can be overridden by
+         * devices that transform messages before they are paced and sent.
          *
          * @param           endpoint        The endpoint.
          * @param [in,out]  thing_to_send   The thing to send.
          */
-        void dgram_write(typename Protocol::endpoint endpoint,
-                         MessageContainer&& message) {
+        virtual void dgram_write(typename Protocol::endpoint endpoint,
+                                 MessageContainer&& message) {
 
-            MessageContainer* output_data =
-                new MessageContainer(std::forward<MessageContainer>(message));
+            if (pace_ && !dgram_pace_impl(endpoint, message)) return;
+
+            dgram_send_start(endpoint, std::forward<MessageContainer>(message));
+        }
+
+        /**
+         * Send a message that consists of multiple datagrams of
+         * `segment_size` bytes each with a single system call, using UDP
+         * generic segmentation offload. Only the last segment may be
+         * shorter. The kernel limits the total size to
+         * dgram_offload_max_size and the number of segments to
+         * dgram_offload_max_segments. Messages beyond these limits, and a
+         * `segment_size` of 0 or above 65535, are rejected with
+         * message_size. On platforms without GSO, the segments are sent one
+         * after another. on_dgram_sent() will be called once the whole
+         * message was sent.
+         *
+         * The message is sent right away. It is neither held back by
+         * dgram_send_paced() nor counted by the send queue of
+         * dgram_send_batched() and dgram_send_bounded().
+         *
+         * @param   endpoint        The endpoint.
+         * @param   message         The segments.
+         * @param   segment_size    The size of a single segment.
+         */
+        void dgram_write_segmented(typename Protocol::endpoint endpoint,
+                                   MessageContainer&& message,
+                                   std::size_t segment_size) {
+
+            if (!segment_size || segment_size > 65535 ||
+                message.size() > dgram_offload_max_size ||
+                (message.size() + segment_size - 1) / segment_size >
+                    dgram_offload_max_segments)
+                return dgram_error_impl(error_case::connect,
+                                        boost::asio::error::message_size);
+
+#if defined(O_NET_HAS_UDP_GSO)
+            auto* output_data = new segmented_write{
+                endpoint, std::forward<MessageContainer>(message),
+                segment_size};
+
+            sock_.async_wait(
+                boost::asio::socket_base::wait_write,
+                std::bind(&datagram_device::on_dgram_segmented_writable_impl,
+                          this, std::placeholders::_1, output_data));
+#else
+            dgram_send_segment_impl(new segmented_write{
+                endpoint, std::forward<MessageContainer>(message),
+                segment_size});
+#endif
+        }
+
+        void dgram_reply(MessageContainer&& message) {
+            dgram_write(last_remote(), std::forward<MessageContainer>(message));
+        }
+
+        void do_read() { dgram_do_receive_impl(); }
+
+        typename Protocol::endpoint& last_remote() { return last_remote_endp_; }
+
+        boost::asio::basic_datagram_socket<Protocol>& dgram_sock() {
+            return sock_;
+        }
+
+        /**
+         * Get the traffic counters of the device, including the datagrams
+         * the kernel dropped because the receive queue was full. Only
+         * available with the o::sessions::features::statistics feature tag.
+         * The time spent in the receive handlers can be read with
+         * handler_latency().
+         *
+         * @returns The counters, summed over all threads.
+         */
+        template <typename Stats = stats_type>
+        std::enable_if_t<Stats::statistics_enabled, traffic_snapshot>
+        traffic() const {
+            auto out = Stats::traffic();
+            out.rx_drops = detail::dgram_rx_drops(
+                const_cast<typename Protocol::socket&>(sock_).native_handle());
+            return out;
+        }
+
+      protected:
+        /**
+         * Start receiving after the socket was bound. Can be overridden by
+         * devices that replace the asio receive path.
+         */
+        virtual void dgram_receive_start() { dgram_do_receive_impl(); }
+
+        /**
+         * Send a datagram that passed the pacer. Can be overridden by
+         * devices that replace the asio send path.
+         */
+        virtual void dgram_send_start(const endpoint_type& endpoint,
+                                      MessageContainer&& message) {
+            dgram_send_impl(endpoint, std::forward<MessageContainer>(message));
+        }
+
+        // Count an error and pass it on.
+        void dgram_error_impl(error_case eca, boost::system::error_code ec) {
+            this->stats_error(static_cast<std::size_t>(eca));
+            on_dgram_error(eca, ec);
+        }
+
+        // Copy received bytes into a new message.
+        static MessageContainer dgram_message_impl(const char* data,
+                                                   std::size_t size) {
+            return MessageContainer(data, data + size);
+        }
+
+      private:
+        using send_queue_type =
+            detail::dgram_send_queue<Protocol, MessageContainer,
+                                     ConcurrencyOption>;
+
+        using pace_state_type =
+            detail::dgram_pace_state<Protocol, MessageContainer,
+                                     ConcurrencyOption>;
+
+        // A message waiting to be sent with dgram_write_segmented()
+        struct segmented_write {
+            endpoint_type remote;
+            MessageContainer message;
+            std::size_t segment_size;
+            // start of the next segment, without GSO
+            std::size_t offset = 0;
+        };
+
+        // Count a segmented write that completed and pass it on.
+        void on_dgram_segmented_sent_impl(segmented_write* output_data) {
+
+            auto size = output_data->message.size();
+            auto segment = output_data->segment_size;
+
+            delete output_data;
+
+            this->stats_out((size + segment - 1) / segment, size);
+
+            on_dgram_sent();
+        }
+
+#if defined(O_NET_HAS_UDP_GSO)
+        void on_dgram_segmented_writable_impl(boost::system::error_code ec,
+                                              segmented_write* output_data) {
+
+            if (!ec)
+                detail::dgram_send_segmented(
+                    sock_, output_data->remote, output_data->message.data(),
+                    output_data->message.size(), output_data->segment_size,
+                    ec);
+
+            if (ec == boost::asio::error::would_block)
+                return sock_.async_wait(
+                    boost::asio::socket_base::wait_write,
+                    std::bind(
+                        &datagram_device::on_dgram_segmented_writable_impl,
+                        this, std::placeholders::_1, output_data));
+
+            if (ec) {
+                delete output_data;
+                return dgram_error_impl(error_case::connect, ec);
+            }
+
+            on_dgram_segmented_sent_impl(output_data);
+        }
+#else
+        // Send the next segment of the message, the message is not copied.
+        void dgram_send_segment_impl(segmented_write* output_data) {
+
+            auto* data = static_cast<const char*>(
+                static_cast<const void*>(output_data->message.data()));
+
+            auto size = std::min(output_data->segment_size,
+                                 output_data->message.size() -
+                                     output_data->offset);
 
             sock_.async_send_to(
-                boost::asio::buffer(output_data->data(), output_data->size()),
-                endpoint,
-                std::bind(&datagram_device::dgram_on_send_done_impl, this,
+                boost::asio::buffer(data + output_data->offset, size),
+                output_data->remote,
+                std::bind(&datagram_device::on_dgram_segment_sent_impl, this,
                           std::placeholders::_1, output_data));
         }
 
-        void dgram_reply(MessageContainer&& message) {
+        void on_dgram_segment_sent_impl(boost::system::error_code ec,
+                                        segmented_write* output_data) {
+
+            if (ec) {
+                delete output_data;
+                return dgram_error_impl(error_case::connect, ec);
+            }
+
+            output_data->offset += output_data->segment_size;
+
+            if (output_data->offset < output_data->message.size())
+                return dgram_send_segment_impl(output_data);
+
+            on_dgram_segmented_sent_impl(output_data);
+        }
+#endif
+
+        // Hand a datagram that passed the pacer to the send queue or start a
+        // send operation for it.
+        void dgram_send_impl(const typename Protocol::endpoint& endpoint,
+                             MessageContainer&& message) {
+
+            if (tx_)
+                return dgram_enqueue_impl(
+                    endpoint, std::forward<MessageContainer>(message));
 
             MessageContainer* output_data =
                 new MessageContainer(std::forward<MessageContainer>(message));
 
             sock_.async_send_to(
                 boost::asio::buffer(output_data->data(), output_data->size()),
-                typename Protocol::endpoint(last_remote()),
+                endpoint,
                 std::bind(&datagram_device::dgram_on_send_done_impl, this,
                           std::placeholders::_1, output_data));
         }
 
-        void do_read() { dgram_do_receive_impl(); }
+        void dgram_pace_init_impl(std::chrono::microseconds resolution) {
 
-        typename Protocol::endpoint& last_remote() { return last_remote_endp_; }
+            if (!pace_)
+                pace_ = std::make_unique<pace_state_type>(sock_.get_executor(),
+                                                          resolution);
 
-        boost::asio::basic_datagram_socket<Protocol>& dgram_sock() {
-            return sock_;
+            pace_->state.apply([&](auto& paced) {
+                paced.pacer.resolution(resolution);
+
+                if (tx_) paced.pacer.bound(tx_->capacity, tx_->policy);
+            });
         }
 
-      private:
+        // Offer a datagram to the pacer. Returns true if it may be sent
+        // now, otherwise the pacer took the message and the release timer
+        // is scheduled.
+        bool dgram_pace_impl(const typename Protocol::endpoint& endpoint,
+                             MessageContainer& message) {
+
+            using clock = dgram_token_bucket::clock;
+
+            auto now = clock::now();
+            bool admitted = false;
+            bool arm = false;
+            clock::time_point due;
+            std::uint64_t generation = 0;
+
+            pace_->state.apply([&](auto& paced) {
+                admitted = paced.pacer.admit(now, endpoint, message);
+
+                if (admitted) return;
+
+                due = now + paced.pacer.resolution();
+
+                if (paced.timer_armed && paced.timer_due <= due) return;
+
+                paced.timer_armed = arm = true;
+                paced.timer_due = due;
+                generation = ++paced.timer_generation;
+            });
+
+            if (arm) dgram_arm_pace_timer_impl(due, generation);
+
+            return admitted;
+        }
+
+        void dgram_arm_pace_timer_impl(
+            dgram_token_bucket::clock::time_point due,
+            std::uint64_t generation) {
+
+            using clock = dgram_token_bucket::clock;
+
+            o::io::new_wait(o::io::steady_timer(pace_->timer),
+                            due - clock::now())
+                .then([this, generation](boost::system::error_code ec) {
+                    if (ec) return;
+
+                    auto now = clock::now();
+                    bool stale = false;
+                    bool arm = false;
+                    clock::time_point next_due;
+                    std::uint64_t next_generation = 0;
+
+                    std::vector<typename pace_state_type::entry_type> released;
+
+                    pace_->state.apply([&](auto& paced) {
+                        if (paced.timer_generation != generation) {
+                            stale = true;
+                            return;
+                        }
+
+                        next_due = paced.pacer.release(now, released);
+
+                        if (next_due == clock::time_point::max()) {
+                            paced.timer_armed = false;
+                            return;
+                        }
+
+                        next_due = std::max(next_due,
+                                            now + paced.pacer.resolution());
+                        paced.timer_due = next_due;
+                        next_generation = ++paced.timer_generation;
+                        arm = true;
+                    });
+
+                    if (stale) return;
+
+                    for (auto& entry : released)
+                        dgram_send_start(entry.remote,
+                                         std::move(entry.message));
+
+                    if (arm)
+                        dgram_arm_pace_timer_impl(next_due, next_generation);
+                });
+        }
+
+        // Append a datagram to the send queue. Start a flush if the queue
+        // is full or make sure a flush is scheduled.
+        void dgram_enqueue_impl(typename Protocol::endpoint endpoint,
+                                MessageContainer&& message) {
+
+            bool do_flush = false;
+            bool do_arm = false;
+            bool congested = false;
+
+            auto push = [&](auto& queue) {
+                if (tx_->bounded() && queue.depth >= tx_->capacity &&
+                    !dgram_make_room_impl(queue))
+                    return;
+
+                queue.pending.push_back(
+                    {endpoint, std::forward<MessageContainer>(message)});
+
+                congested = tx_->acquire(queue);
+
+                if (queue.flushing) return;
+
+                if (queue.pending.size() - queue.head >= tx_->max_batch)
+                    queue.flushing = do_flush = true;
+                else if (!queue.timer_armed)
+                    queue.timer_armed = do_arm = true;
+            };
+
+            if constexpr (o::ccy::is_safe<ConcurrencyOption>::value) {
+                if (tx_->bounded() &&
+                    tx_->policy == dgram_drop_policy::block_producer)
+                    tx_->state.apply_adopt([&](auto& queue, auto& mtx) {
+                        std::unique_lock<std::mutex> lock(mtx);
+
+                        if (queue.depth >= tx_->capacity) {
+                            ++tx_->stats.blocked;
+                            tx_->room.wait(lock, [&]() {
+                                return queue.depth < tx_->capacity;
+                            });
+                        }
+
+                        push(queue);
+                    });
+                else
+                    tx_->state.apply(push);
+            } else
+                tx_->state.apply(push);
+
+            if (congested) on_dgram_backpressure(true);
+
+            if (do_flush)
+                dgram_flush_begin_impl();
+            else if (do_arm)
+                dgram_arm_flush_timer_impl();
+        }
+
+        // The bounded queue is full. Drop the oldest pending datagram if the
+        // policy allows it. Returns false if the new datagram has to be
+        // dropped instead.
+        template <typename Queue>
+        bool dgram_make_room_impl(Queue& queue) {
+
+            if (tx_->policy != dgram_drop_policy::drop_oldest ||
+                queue.head == queue.pending.size()) {
+                ++tx_->stats.dropped_newest;
+                return false;
+            }
+
+            queue.pending[queue.head++].message = MessageContainer();
+            --queue.depth;
+            ++tx_->stats.dropped_oldest;
+
+            // keep the dropped prefix from growing while a flush is running
+            if (queue.head * 2 >= queue.pending.size()) {
+                queue.pending.erase(queue.pending.begin(),
+                                    queue.pending.begin() + queue.head);
+                queue.head = 0;
+            }
+
+            return true;
+        }
+
+        // `count` datagrams left the queue. Wake blocked producers and
+        // report the end of congestion.
+        void dgram_release_impl(std::size_t count) {
+
+            bool relieved = false;
+
+            tx_->state.apply(
+                [&](auto& queue) { relieved = tx_->release(queue, count); });
+
+            if (tx_->bounded() &&
+                tx_->policy == dgram_drop_policy::block_producer)
+                tx_->room.notify_all();
+
+            if (relieved) on_dgram_backpressure(false);
+        }
+
+        void dgram_arm_flush_timer_impl() {
+            o::io::new_wait(o::io::steady_timer(tx_->timer), tx_->max_latency)
+                .then([this](boost::system::error_code ec) {
+                    bool do_flush = false;
+
+                    tx_->state.apply([&](auto& queue) {
+                        queue.timer_armed = false;
+                        if (!ec && !queue.flushing &&
+                            queue.pending.size() > queue.head)
+                            queue.flushing = do_flush = true;
+                    });
+
+                    if (do_flush) dgram_flush_begin_impl();
+                });
+        }
+
+        // Take all pending datagrams and start sending them. Must only be
+        // called by the thread that set the flushing flag.
+        void dgram_flush_begin_impl() {
+            tx_->state.apply([&](auto& queue) {
+                std::swap(queue.pending, tx_->inflight);
+                tx_->inflight_pos = queue.head;
+                queue.head = 0;
+            });
+
+            dgram_flush_continue_impl();
+        }
+
+        void dgram_flush_continue_impl() {
+
+            auto& tx = *tx_;
+
+            while (tx.inflight_pos < tx.inflight.size()) {
+
+                boost::system::error_code ec;
+
+                auto count = std::min(tx.max_batch,
+                                      tx.inflight.size() - tx.inflight_pos);
+
+                auto sent = tx.sender.send(
+                    sock_, tx.inflight.data() + tx.inflight_pos, count, ec);
+
+                tx.inflight_pos += sent;
+
+                if (sent) {
+                    if constexpr (stats_type::statistics_enabled) {
+                        std::size_t bytes = 0;
+                        for (std::size_t i = tx.inflight_pos - sent;
+                             i < tx.inflight_pos; ++i)
+                            bytes += tx.inflight[i].message.size();
+                        this->stats_out(sent, bytes);
+                    }
+
+                    tx.stats.sent += sent;
+                    dgram_release_impl(sent);
+                    on_dgram_batch_sent(sent);
+                }
+
+                if (ec == boost::asio::error::would_block)
+                    return sock_.async_wait(
+                        boost::asio::socket_base::wait_write,
+                        std::bind(&datagram_device::on_dgram_writable_impl,
+                                  this, std::placeholders::_1));
+
+                // the datagram at the current position was rejected, drop it
+                if (ec) {
+                    dgram_error_impl(error_case::connect, ec);
+                    ++tx.inflight_pos;
+                    ++tx.stats.failed;
+                    dgram_release_impl(1);
+                }
+            }
+
+            dgram_flush_done_impl();
+        }
+
+        void on_dgram_writable_impl(boost::system::error_code ec) {
+
+            if (ec) {
+                auto dropped = tx_->inflight.size() - tx_->inflight_pos;
+                tx_->stats.failed += dropped;
+                dgram_release_impl(dropped);
+                dgram_error_impl(error_case::connect, ec);
+                return dgram_flush_done_impl();
+            }
+
+            dgram_flush_continue_impl();
+        }
+
+        // The inflight list was sent. Flush again if the queue filled up in
+        // the meantime, or schedule a flush for the remaining datagrams.
+        void dgram_flush_done_impl() {
+
+            bool do_flush = false;
+            bool do_arm = false;
+
+            tx_->inflight.clear();
+
+            tx_->state.apply([&](auto& queue) {
+                if (queue.pending.size() - queue.head >= tx_->max_batch) {
+                    do_flush = true;
+                    return;
+                }
+
+                queue.flushing = false;
+
+                if (queue.pending.size() > queue.head && !queue.timer_armed)
+                    queue.timer_armed = do_arm = true;
+            });
+
+            if (do_flush)
+                dgram_flush_begin_impl();
+            else if (do_arm)
+                dgram_arm_flush_timer_impl();
+        }
+
+        // Buffer and sender endpoint of one outstanding receive operation.
+        struct receive_slot {
+            std::vector<char> buffer;
+            endpoint_type remote;
+        };
+
         // Data was received. Call the user-handler and do another receive.
         void on_dgram_received_impl(boost::system::error_code ec,
-                                    size_t bytes_s) {
+                                    size_t bytes_s, receive_slot* slot) {
+
+            if (ec) return dgram_error_impl(error_case::read, ec);
+
+            this->stats_in(1, bytes_s);
+            this->stats_handler([&] {
+                on_dgram_received_from(
+                    slot->remote,
+                    dgram_message_impl(slot->buffer.data(), bytes_s));
+            });
+
+            if (rx_spin_ && !dgram_spin_impl([&](auto& ec) {
+                    auto bytes = sock_.receive_from(
+                        boost::asio::buffer(slot->buffer), slot->remote, 0, ec);
+
+                    if (ec) return false;
+
+                    this->stats_in(1, bytes);
+                    this->stats_handler([&] {
+                        on_dgram_received_from(
+                            slot->remote,
+                            dgram_message_impl(slot->buffer.data(), bytes));
+                    });
+
+                    return true;
+                }))
+                return;
+
+            dgram_do_receive_impl(*slot);
+        }
+
+        // A datagram was received into a pooled buffer. Pass on the
+        // buffer and do another receive.
+        void on_dgram_pooled_impl(boost::system::error_code ec,
+                                  size_t bytes_s, receive_slot* slot,
+                                  pooled_dgram&& dgram) {
+
+            if (ec) return dgram_error_impl(error_case::read, ec);
+
+            dgram.resize(bytes_s);
+
+            this->stats_in(1, bytes_s);
+            this->stats_handler(
+                [&] { on_dgram_buffer(slot->remote, std::move(dgram)); });
+
+            dgram_do_receive_impl(*slot);
+        }
 
-            if (ec) return on_dgram_error(error_case::read, ec);
+        // The socket is readable. Drain up to one batch and wait again.
+        void on_dgram_readable_impl(boost::system::error_code ec) {
 
-            buf_.commit(bytes_s);
+            if (ec) return dgram_error_impl(error_case::read, ec);
 
-            std::string out_bytes;
+            if (!dgram_receive_batch_impl(ec) && ec &&
+                ec != boost::asio::error::would_block)
+                return dgram_error_impl(error_case::read, ec);
 
-            on_dgram_received(boost::beast::buffers_to_string(buf_.data()));
+            if (rx_spin_ && !dgram_spin_impl([&](auto& ec) {
+                    return dgram_receive_batch_impl(ec);
+                }))
+                return;
 
-            buf_.consume(bytes_s);
-            
             dgram_do_receive_impl();
         }
 
+        // Receive one batch without blocking and pass it on. Returns false
+        // if nothing was received.
+        bool dgram_receive_batch_impl(boost::system::error_code& ec) {
+
+            auto batch = batch_rx_->receive(sock_, ec);
+
+            if (batch.empty()) return false;
+
+            if (rx_delay_) {
+                auto now = std::chrono::system_clock::now();
+
+                for (const auto& dgram : batch)
+                    if (dgram.timestamp().time_since_epoch().count())
+                        rx_delay_->record(now - dgram.timestamp());
+            }
+
+            if constexpr (stats_type::statistics_enabled) {
+                std::size_t bytes = 0;
+                for (const auto& dgram : batch) bytes += dgram.size();
+                this->stats_in(batch.size(), bytes);
+            }
+
+            this->stats_handler([&] { on_dgram_batch(batch); });
+
+            return true;
+        }
+
+        // Call receive(ec) until nothing arrived for the current spin
+        // budget. Gives control back to the reactor after a fixed number of
+        // receives, so other handlers on the io_context do not starve.
+        // Returns false if receiving failed.
+        template <typename Receive>
+        bool dgram_spin_impl(Receive receive) {
+
+            using clock = detail::dgram_spin_budget::clock;
+
+            constexpr int max_receives = 64;
+
+            auto now = clock::now();
+            rx_spin_->arrived(now);
+            auto deadline = now + rx_spin_->budget();
+
+            for (int received = 0; received < max_receives;) {
+
+                boost::system::error_code ec;
+
+                if (receive(ec)) {
+                    now = clock::now();
+                    rx_spin_->arrived(now);
+                    deadline = now + rx_spin_->budget();
+                    ++received;
+                    continue;
+                }
+
+                if (ec && ec != boost::asio::error::would_block) {
+                    dgram_error_impl(error_case::read, ec);
+                    return false;
+                }
+
+                if (clock::now() >= deadline) break;
+            }
+
+            return true;
+        }
+
         void dgram_do_receive_impl() {
+
+            if (batch_rx_)
+                return sock_.async_wait(
+                    boost::asio::socket_base::wait_read,
+                    std::bind(&datagram_device::on_dgram_readable_impl, this,
+                              std::placeholders::_1));
+
+            if (rx_slots_.empty()) dgram_receive_depth(1);
+
+            for (auto& slot : rx_slots_) dgram_do_receive_impl(slot);
+        }
+
+        void dgram_do_receive_impl(receive_slot& slot) {
+
+            if (rx_pool_) {
+                auto dgram = rx_pool_->acquire();
+                auto buffer = dgram.prepare();
+
+                return sock_.async_receive_from(
+                    buffer, slot.remote,
+                    [this, slot = &slot, dgram = std::move(dgram)](
+                        boost::system::error_code ec, size_t bytes_s) mutable {
+                        on_dgram_pooled_impl(ec, bytes_s, slot,
+                                             std::move(dgram));
+                    });
+            }
+
             sock_.async_receive_from(
-                buf_.prepare(4096), last_remote_endp_,
+                boost::asio::buffer(slot.buffer), slot.remote,
                 std::bind(&datagram_device::on_dgram_received_impl, this,
-                          std::placeholders::_1, std::placeholders::_2));
+                          std::placeholders::_1, std::placeholders::_2,
+                          &slot));
         }
 
         void dgram_on_send_done_impl(boost::system::error_code ec,
-                                     std::string* out_str) {
+                                     MessageContainer* output_data) {
+
+            auto size = output_data->size();
+
+            delete output_data;
 
-            if (ec) return on_dgram_error(error_case::connect, ec);
+            if (ec) return dgram_error_impl(error_case::connect, ec);
 
-            delete out_str;
+            this->stats_out(1, size);
 
             on_dgram_sent();
         }
@@ -225,7 +1308,16 @@ namespace o::io::net {
         typename Protocol::endpoint last_remote_endp_;
         typename Protocol::endpoint local_endp_;
 
-        boost::asio::streambuf buf_;
+        std::vector<receive_slot> rx_slots_;
+        std::unique_ptr<detail::dgram_batch_receiver<Protocol>> batch_rx_;
+        std::unique_ptr<dgram_buffer_pool> rx_pool_;
+        bool rx_gro_ = false;
+        bool rx_pktinfo_ = false;
+        std::unique_ptr<o::io::histogram> rx_delay_;
+        std::unique_ptr<detail::dgram_spin_budget> rx_spin_;
+        std::chrono::microseconds rx_busy_poll_{0};
+        std::unique_ptr<send_queue_type> tx_;
+        std::unique_ptr<pace_state_type> pace_;
         typename Protocol::socket sock_;
     };
 
@@ -244,67 +1336,362 @@ namespace o::io::net {
     struct dgram_port_mtx_base<o::ccy::none> {};
 
     template <typename Protocol, typename MessageContainer,
-              typename ConcurrencyOption>
+              typename ConcurrencyOption, typename... Features>
     class datagram_port
-        : public datagram_device<Protocol, MessageContainer, ConcurrencyOption>,
+        : public datagram_device<Protocol, MessageContainer, ConcurrencyOption,
+                                 Features...>,
           public dgram_port_mtx_base<ConcurrencyOption> {
 
-        using data_handler_type = std::function<void(std::string&&)>;
+        using data_handler_type = std::function<void(MessageContainer&&)>;
         using error_handler_type =
             std::function<void(boost::system::error_code)>;
+        using group_handler_type =
+            std::function<void(const dgram_view<Protocol>&)>;
+        using peer_handler_type = std::function<void(
+            const typename Protocol::endpoint&, MessageContainer&&)>;
+
+        using dispatcher_type =
+            dgram_flow_dispatcher<typename Protocol::endpoint,
+                                  MessageContainer>;
+
+        using device_type = datagram_device<Protocol, MessageContainer,
+                                            ConcurrencyOption, Features...>;
 
       public:
         explicit datagram_port(boost::asio::io_context& ctx)
-            : datagram_device<Protocol, MessageContainer, ConcurrencyOption>(
-                  ctx) {}
+            : device_type(ctx) {}
 
-        void on_dgram_received(MessageContainer&& data) override {
+        /**
+         * Bind the port to receive multicast datagrams. This enables
+         * batched receiving with destination addresses and allows other
+         * sockets to bind to the same endpoint. Groups can be joined with
+         * join_group() afterwards.
+         *
+         * @param   local_endp  The endpoint to bind to. Usually the any
+         *                      address with the port of the group.
+         * @param   batch       Maximum number of datagrams per batch.
+         */
+        void multicast_bind(const typename Protocol::endpoint& local_endp,
+                            std::size_t batch = 16) {
 
-            if (data_handler_) {
+            this->dgram_receive_batched(batch);
+            this->dgram_receive_destination();
+            this->dgram_sock_open(local_endp.protocol());
 
-                opt_do_lock();
+            if (this->dgram_sock_option(
+                    boost::asio::socket_base::reuse_address(true)))
+                this->dgram_sock_bind(local_endp);
+        }
 
-                data_handler_.get()(std::forward<MessageContainer>(data));
+        /**
+         * Join a multicast group. Any number of groups can be joined on a
+         * single port.
+         *
+         * @param   group   The group to join.
+         * @param   iface   Index of the interface to join on (see
+         *                  interface_index()) or 0 to let the system
+         *                  choose.
+         */
+        void join_group(const boost::asio::ip::address& group,
+                        unsigned int iface = 0) {
+            group_membership_impl(true, group, nullptr, iface);
+        }
 
-                opt_do_unlock();
-            }
+        /**
+         * Join a multicast group, but only receive datagrams sent by a
+         * single source (source-specific multicast).
+         *
+         * @param   group   The group to join.
+         * @param   source  The source to receive from.
+         * @param   iface   Index of the interface to join on or 0.
+         */
+        void join_source_group(const boost::asio::ip::address& group,
+                               const boost::asio::ip::address& source,
+                               unsigned int iface = 0) {
+            group_membership_impl(true, group, &source, iface);
         }
 
-        void on_dgram_error(
-            typename datagram_device<Protocol, MessageContainer,
-                                     ConcurrencyOption>::error_case eca,
-            boost::system::error_code ec) override {
+        /**
+         * Leave a multicast group that was joined with join_group().
+         *
+         * @param   group   The group to leave.
+         * @param   iface   The interface index passed to join_group().
+         */
+        void leave_group(const boost::asio::ip::address& group,
+                         unsigned int iface = 0) {
+            group_membership_impl(false, group, nullptr, iface);
+        }
+
+        /**
+         * Leave a multicast group that was joined with join_source_group().
+         *
+         * @param   group   The group to leave.
+         * @param   source  The source passed to join_source_group().
+         * @param   iface   The interface index passed to
+         *                  join_source_group().
+         */
+        void leave_source_group(const boost::asio::ip::address& group,
+                                const boost::asio::ip::address& source,
+                                unsigned int iface = 0) {
+            group_membership_impl(false, group, &source, iface);
+        }
 
-            if (error_handler_) error_handler_.get()(ec);
+        /** receive multicast datagrams sent from this host */
+        void set_multicast_loopback(bool enable) {
+            set_option_impl(
+                boost::asio::ip::multicast::enable_loopback(enable));
         }
 
-        // TODO replace with std::optional and deprecate Xcode 9 (alias buy new
-        // macbook)
-        boost::optional<std::function<void(MessageContainer&&)>> data_handler_;
-        boost::optional<std::function<void(boost::system::error_code)>>
-            error_handler_;
+        /** number of hops (ttl) of outgoing multicast datagrams */
+        void set_multicast_hops(int hops) {
+            set_option_impl(boost::asio::ip::multicast::hops(hops));
+        }
 
-        inline void set_data_handler(data_handler_type&& handler) {
+        /** interface for outgoing ipv4 multicast datagrams */
+        void set_multicast_interface(const boost::asio::ip::address_v4& iface) {
+            set_option_impl(
+                boost::asio::ip::multicast::outbound_interface(iface));
+        }
+
+        /** interface for outgoing ipv6 multicast datagrams */
+        void set_multicast_interface(unsigned int iface) {
+            set_option_impl(
+                boost::asio::ip::multicast::outbound_interface(iface));
+        }
+
+        /**
+         * Add a handler for datagrams sent to a multicast group. A group can
+         * have any number of handlers. All of them are called with a view of
+         * the same buffer, so the datagram is not copied per subscriber.
+         * Datagrams that do not belong to a subscribed group are passed to
+         * the data handler. Can be called at any time, also from a group
+         * handler.
+         *
+         * @param   group   The multicast group.
+         * @param   handler The handler.
+         */
+        void subscribe(const boost::asio::ip::address& group,
+                       group_handler_type&& handler) {
 
             opt_do_lock();
 
-            data_handler_ =
-                boost::make_optional(std::forward<data_handler_type>(handler));
+            auto groups = groups_copy_impl();
+
+            groups[group].emplace_back(
+                std::forward<group_handler_type>(handler));
+
+            groups_.store(std::move(groups));
 
             opt_do_unlock();
         }
 
-        inline void set_error_handler(error_handler_type&& handler) {
+        /**
+         * Remove all handlers of a multicast group.
+         *
+         * @param   group   The multicast group.
+         */
+        void unsubscribe(const boost::asio::ip::address& group) {
 
             opt_do_lock();
 
-            error_handler_ =
-                boost::make_optional(std::forward<error_handler_type>(handler));
+            auto groups = groups_copy_impl();
+
+            groups.erase(group);
+
+            groups_.store(std::move(groups));
 
             opt_do_unlock();
         }
 
+        void on_dgram_batch(const dgram_batch<Protocol>& batch) override {
+
+            {
+                // handlers are called without holding a lock, they may
+                // subscribe and unsubscribe and other threads keep receiving
+                auto groups = groups_.read();
+
+                for (const auto& dgram : batch) {
+
+                    if (groups) {
+
+                        auto subscribers = groups->find(dgram.destination());
+
+                        if (subscribers != groups->end()) {
+                            for (auto& handler : subscribers->second)
+                                handler(dgram);
+
+                            continue;
+                        }
+                    }
+
+                    this->on_dgram_received_from(
+                        dgram.remote(),
+                        this->dgram_message_impl(dgram.data(), dgram.size()));
+                }
+            }
+
+            groups_.collect();
+        }
+
+        void on_dgram_received_from(const typename Protocol::endpoint& remote,
+                                    MessageContainer&& message) override {
+
+            if (dispatcher_)
+                return dispatcher_->dispatch(
+                    remote, std::forward<MessageContainer>(message));
+
+            port_deliver_impl(remote, std::forward<MessageContainer>(message));
+            port_collect_impl();
+        }
+
+        void on_dgram_received(MessageContainer&& data) override {
+            if (auto handler = data_handler_.read())
+                (*handler)(std::forward<MessageContainer>(data));
+        }
+
+        void on_dgram_sent() override {}
+
+        void on_dgram_error(typename device_type::error_case eca,
+                            boost::system::error_code ec) override {
+
+            if (auto handler = error_handler_.read()) (*handler)(ec);
+        }
+
+        // read without locking on every datagram, see o::ccy::rcu_slot.
+        // replaced handlers are destroyed by port_collect_impl()
+        o::ccy::rcu_slot<std::function<void(MessageContainer&&)>>
+            data_handler_;
+        o::ccy::rcu_slot<peer_handler_type> peer_handler_;
+        o::ccy::rcu_slot<std::function<void(boost::system::error_code)>>
+            error_handler_;
+
+        /**
+         * Set the handler for received datagrams. Can be called while
+         * datagrams are received, each datagram is passed to either the old
+         * or the new handler. With o::ccy::safe, the handler is called from
+         * all threads running the io context without being serialized.
+         *
+         * @param   handler The handler.
+         */
+        inline void set_data_handler(data_handler_type&& handler) {
+            data_handler_.store(std::forward<data_handler_type>(handler));
+        }
+
+        /**
+         * Set a handler for received datagrams that also gets the endpoint
+         * the datagram was received from. If set, it is called instead of
+         * the data handler. Can be called at any time.
+         *
+         * @param   handler The handler.
+         */
+        inline void set_peer_handler(peer_handler_type&& handler) {
+            peer_handler_.store(std::forward<peer_handler_type>(handler));
+        }
+
+        /**
+         * Handle the datagrams of different peers in parallel, but the
+         * datagrams of each peer in the order they were received. Received
+         * datagrams are distributed over `shards` strands by their sender
+         * and passed to the peer handler (or the data handler) on the
+         * strand. Since the strands run in parallel, last_remote() is not
+         * updated for these datagrams, set a peer handler to learn the
+         * sender. Use with a single outstanding receive, see
+         * dgram_receive_depth(), and an io_context run by multiple threads.
+         * Call before binding.
+         *
+         * @param   shards  The number of strands.
+         */
+        void dgram_dispatch_by_peer(std::size_t shards) {
+            dispatcher_ = std::make_unique<dispatcher_type>(
+                this->dgram_sock().get_executor(), shards,
+                [this](const typename Protocol::endpoint& remote,
+                       MessageContainer&& message) {
+                    port_deliver_impl(remote,
+                                      std::forward<MessageContainer>(message),
+                                      false);
+                    port_collect_impl();
+                });
+        }
+
+        /**
+         * @returns The dispatcher set up by dgram_dispatch_by_peer(), to
+         *          read the load of its shards, or nullptr.
+         */
+        const dispatcher_type* dgram_dispatcher() const {
+            return dispatcher_.get();
+        }
+
+        /**
+         * Set the handler for errors. Can be called at any time.
+         *
+         * @param   handler The handler.
+         */
+        inline void set_error_handler(error_handler_type&& handler) {
+            error_handler_.store(std::forward<error_handler_type>(handler));
+        }
+
       private:
+        // Pass a datagram to the peer handler, or to the data handler.
+        // last_remote() is shared by all threads, so it is only written if
+        // `remember` is set.
+        void port_deliver_impl(const typename Protocol::endpoint& remote,
+                               MessageContainer&& message,
+                               bool remember = true) {
+
+            if (auto handler = peer_handler_.read())
+                return (*handler)(remote,
+                                  std::forward<MessageContainer>(message));
+
+            if (!remember)
+                return on_dgram_received(
+                    std::forward<MessageContainer>(message));
+
+            device_type::on_dgram_received_from(
+                remote, std::forward<MessageContainer>(message));
+        }
+
+        // Destroy replaced handlers once no receiving thread can still be
+        // calling them. Called after each delivered datagram, when the
+        // calling thread holds no handler anymore. Only loads a counter
+        // unless a handler was replaced.
+        void port_collect_impl() {
+            data_handler_.collect();
+            peer_handler_.collect();
+            error_handler_.collect();
+        }
+
+        void group_membership_impl(bool join,
+                                   const boost::asio::ip::address& group,
+                                   const boost::asio::ip::address* source,
+                                   unsigned int iface) {
+
+            boost::system::error_code ec;
+
+            detail::dgram_group_membership(this->dgram_sock(), join, group,
+                                           source, iface, ec);
+
+            if (ec) this->dgram_error_impl(device_type::error_case::bind, ec);
+        }
+
+        template <typename Option>
+        void set_option_impl(const Option& option) {
+            this->dgram_sock_option(option);
+        }
+
+        using group_map_type =
+            std::map<boost::asio::ip::address, std::vector<group_handler_type>>;
+
+        // Copy of the subscribers to modify. Called with the port mutex.
+        group_map_type groups_copy_impl() const {
+            auto groups = groups_.read();
+            return groups ? *groups : group_map_type();
+        }
+
+        // replaced on every change, read once per batch
+        o::ccy::rcu_slot<group_map_type> groups_;
+
+        std::unique_ptr<dispatcher_type> dispatcher_;
+
         inline void opt_do_lock() {
             if constexpr (o::ccy::is_safe<ConcurrencyOption>::value)
                 this->udp_port_handler_mutex_.lock();
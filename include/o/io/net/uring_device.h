@@ -0,0 +1,647 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+#include "../../types.h"
+#include "dgram_batch.h"
+#include "udp_device.h"
+#include <boost/asio.hpp>
+#include <vector>
+
+#if defined(O_NET_USE_IO_URING) && defined(O_NET_LINUX)
+#define O_NET_HAS_IO_URING
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <cerrno>
+#include <cstring>
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+namespace o::io::net {
+
+#if defined(O_NET_HAS_IO_URING)
+    namespace detail {
+
+        // A ring with a provided buffer ring for multishot receives. Not
+        // synchronized.
+        class dgram_uring {
+
+          public:
+            // user data of the multishot receive, send completions carry
+            // a pointer to their operation.
+            static constexpr std::uint64_t receive_tag = 0;
+            static constexpr std::uint64_t cancel_tag = 1;
+
+            static constexpr int buffer_group = 0;
+
+            dgram_uring() = default;
+            dgram_uring(const dgram_uring&) = delete;
+            dgram_uring& operator=(const dgram_uring&) = delete;
+
+            ~dgram_uring() { close(); }
+
+            // Set up the ring, the buffer ring and the eventfd. Returns
+            // false if io_uring is not available.
+            bool open(unsigned entries, unsigned buffers,
+                      std::size_t buffer_size) {
+
+                if (io_uring_queue_init(entries, &ring_, 0) < 0) return false;
+
+                ring_open_ = true;
+
+                int ret = 0;
+                buffers_ = io_uring_setup_buf_ring(&ring_, buffers,
+                                                   buffer_group, 0, &ret);
+
+                if (!buffers_) return close(), false;
+
+                buffer_count_ = buffers;
+                buffer_size_ = buffer_size;
+                memory_.resize(buffers * buffer_size);
+
+                for (unsigned bid = 0; bid < buffers; ++bid)
+                    io_uring_buf_ring_add(
+                        buffers_, buffer(bid), buffer_size, bid,
+                        io_uring_buf_ring_mask(buffers), bid);
+
+                io_uring_buf_ring_advance(buffers_, buffers);
+
+                event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+                if (event_fd_ < 0 ||
+                    io_uring_register_eventfd(&ring_, event_fd_) < 0)
+                    return close(), false;
+
+                return true;
+            }
+
+            void close() {
+
+                if (buffers_)
+                    io_uring_free_buf_ring(&ring_, buffers_, buffer_count_,
+                                           buffer_group);
+
+                if (ring_open_) io_uring_queue_exit(&ring_);
+
+                if (event_fd_ >= 0) ::close(event_fd_);
+
+                buffers_ = nullptr;
+                ring_open_ = false;
+                outstanding_ = 0;
+                event_fd_ = -1;
+            }
+
+            bool is_open() const { return ring_open_; }
+
+            // Ownership of the eventfd is passed to the caller.
+            int release_event_fd() {
+                auto fd = event_fd_;
+                event_fd_ = -1;
+                return fd;
+            }
+
+            io_uring_sqe* get_sqe() {
+
+                auto* sqe = io_uring_get_sqe(&ring_);
+
+                if (sqe) return sqe;
+
+                // submission queue is full, make room
+                io_uring_submit(&ring_);
+                return io_uring_get_sqe(&ring_);
+            }
+
+            // Queue a multishot receive on fd. Every completion picks a
+            // buffer from the buffer ring.
+            bool arm_receive(int fd, std::size_t name_size) {
+
+                auto* sqe = get_sqe();
+
+                if (!sqe) return false;
+
+                std::memset(&receive_msg_, 0, sizeof(receive_msg_));
+                receive_msg_.msg_namelen = name_size;
+
+                io_uring_prep_recvmsg_multishot(sqe, fd, &receive_msg_, 0);
+                sqe->flags |= IOSQE_BUFFER_SELECT;
+                sqe->buf_group = buffer_group;
+                io_uring_sqe_set_data64(sqe, receive_tag);
+
+                ++outstanding_;
+
+                return true;
+            }
+
+            // Queue a send of msg, which must stay valid until it
+            // completed.
+            bool prep_send(int fd, msghdr* msg, void* op) {
+
+                auto* sqe = get_sqe();
+
+                if (!sqe) return false;
+
+                io_uring_prep_sendmsg(sqe, fd, msg, 0);
+                io_uring_sqe_set_data(sqe, op);
+
+                ++outstanding_;
+
+                return true;
+            }
+
+            // Cancel all operations on fd and move their completions into
+            // out.
+            void cancel(int fd, std::vector<io_uring_cqe>& out) {
+
+                if (!outstanding_) return;
+
+                if (auto* sqe = get_sqe()) {
+                    io_uring_prep_cancel_fd(sqe, fd, IORING_ASYNC_CANCEL_ALL);
+                    io_uring_sqe_set_data64(sqe, cancel_tag);
+                }
+
+                submit();
+
+                while (outstanding_) {
+                    io_uring_cqe* cqe;
+
+                    if (io_uring_wait_cqe(&ring_, &cqe) < 0) break;
+
+                    reap(out, 64);
+                }
+            }
+
+            int submit() { return io_uring_submit(&ring_); }
+
+            // Move up to max completions into out.
+            std::size_t reap(std::vector<io_uring_cqe>& out,
+                             std::size_t max) {
+
+                io_uring_cqe* cqes[64];
+
+                auto count = io_uring_peek_batch_cqe(
+                    &ring_, cqes, std::min<std::size_t>(max, 64));
+
+                for (unsigned i = 0; i < count; ++i) {
+                    auto& cqe = *cqes[i];
+
+                    if (cqe.user_data == cancel_tag) continue;
+
+                    if (cqe.user_data != receive_tag ||
+                        !(cqe.flags & IORING_CQE_F_MORE))
+                        --outstanding_;
+
+                    out.push_back(cqe);
+                }
+
+                io_uring_cq_advance(&ring_, count);
+
+                return count;
+            }
+
+            char* buffer(unsigned bid) {
+                return memory_.data() + bid * buffer_size_;
+            }
+
+            // Give a buffer back to the kernel. Takes effect with the next
+            // call to publish_buffers().
+            void recycle(unsigned bid) {
+                io_uring_buf_ring_add(buffers_, buffer(bid), buffer_size_, bid,
+                                      io_uring_buf_ring_mask(buffer_count_),
+                                      recycled_++);
+            }
+
+            void publish_buffers() {
+                if (recycled_) io_uring_buf_ring_advance(buffers_, recycled_);
+                recycled_ = 0;
+            }
+
+            msghdr& receive_msg() { return receive_msg_; }
+
+          private:
+            io_uring ring_{};
+            bool ring_open_ = false;
+            io_uring_buf_ring* buffers_ = nullptr;
+            unsigned buffer_count_ = 0;
+            std::size_t buffer_size_ = 0;
+            int recycled_ = 0;
+            std::vector<char> memory_;
+            msghdr receive_msg_{};
+            int event_fd_ = -1;
+            std::size_t outstanding_ = 0;
+        };
+    } // namespace detail
+#endif
+
+    /**
+     * A datagram_device that receives and sends through io_uring.
+     *
+     * Receiving uses a single multishot receive that picks buffers from a
+     * buffer ring registered with the kernel, so a busy socket needs no
+     * system call per datagram. Received datagrams are delivered with
+     * on_dgram_batch(). A receive error other than running out of buffers
+     * is reported once with on_dgram_error() and ends receiving. Sends are
+     * queued as submissions and submitted together once per turn of the
+     * io_context.
+     *
+     * The backend is selected at compile time by defining
+     * O_NET_USE_IO_URING and linking liburing (cmake option
+     * liboh_use_io_uring). Without it, or if the kernel does not support
+     * io_uring, multishot receives or buffer rings, the device falls back to
+     * the datagram_device implementation.
+     *
+     * Batched, pooled and offloaded receiving of datagram_device are not
+     * used by the io_uring path. Pacing applies to both paths, the send
+     * queue of dgram_send_batched() only to the fallback.
+     *
+     * @tparam  Protocol            Type of the protocol.
+     * @tparam  MessageContainer    Type of the message container.
+     * @tparam  ConcurrencyOption   Type of the concurrency option.
+     * @tparam  Features            Feature tags, see datagram_device.
+     */
+    template <typename Protocol, typename MessageContainer,
+              typename ConcurrencyOption, typename... Features>
+    class uring_datagram_device
+        : public datagram_device<Protocol, MessageContainer, ConcurrencyOption,
+                                 Features...> {
+
+        using base_type = datagram_device<Protocol, MessageContainer,
+                                          ConcurrencyOption, Features...>;
+
+      public:
+        using typename base_type::endpoint_type;
+        using typename base_type::error_case;
+
+        uring_datagram_device() = delete;
+
+        /**
+         * Constructor
+         *
+         * @param [in,out]  ctx The context.
+         */
+        uring_datagram_device(boost::asio::io_context& ctx)
+            : base_type(ctx)
+#if defined(O_NET_HAS_IO_URING)
+              ,
+              doorbell_(ctx)
+#endif
+        {
+        }
+
+        virtual ~uring_datagram_device() {
+#if defined(O_NET_HAS_IO_URING)
+            uring_close_impl();
+#endif
+        }
+
+        /**
+         * Configure the ring. Must be called before the socket is bound.
+         *
+         * @param   entries         Size of the submission queue.
+         * @param   buffers         Number of receive buffers, a power of
+         *                          two.
+         * @param   buffer_size     Size of a receive buffer. Must hold the
+         *                          largest expected datagram plus the
+         *                          sender address.
+         */
+        void dgram_uring_config(unsigned entries = 256, unsigned buffers = 256,
+                                std::size_t buffer_size = 4096) {
+            entries_ = entries;
+            buffers_ = buffers;
+            buffer_size_ = buffer_size;
+        }
+
+        /**
+         * @return true if datagrams are received through io_uring. Only
+         *         meaningful after the socket was bound.
+         */
+        bool dgram_uring_active() const { return rx_active_; }
+
+        /**
+         * close the socket and the ring.
+         */
+        void dgram_sock_close() override {
+#if defined(O_NET_HAS_IO_URING)
+            uring_close_impl();
+#endif
+            base_type::dgram_sock_close();
+        }
+
+      protected:
+        void dgram_receive_start() override {
+#if defined(O_NET_HAS_IO_URING)
+            if (uring_open_impl()) return;
+#endif
+            base_type::dgram_receive_start();
+        }
+
+        // Queue the datagram on the ring, or send it with asio if io_uring
+        // is not used.
+        void dgram_send_start(const endpoint_type& endpoint,
+                              MessageContainer&& message) override {
+#if defined(O_NET_HAS_IO_URING)
+            if (tx_active_) {
+
+                auto* op = new send_op{
+                    endpoint, std::forward<MessageContainer>(message)};
+
+                op->iov.iov_base = const_cast<char*>(op->message.data());
+                op->iov.iov_len = op->message.size();
+                op->msg.msg_name = op->remote.data();
+                op->msg.msg_namelen = op->remote.size();
+                op->msg.msg_iov = &op->iov;
+                op->msg.msg_iovlen = 1;
+
+                bool queued = false;
+                bool post = false;
+
+                ring_.apply([&](auto& ring) {
+                    queued = ring.prep_send(this->dgram_sock().native_handle(),
+                                            &op->msg, op);
+
+                    if (queued && !submit_posted_)
+                        submit_posted_ = post = true;
+                });
+
+                if (!queued) {
+                    delete op;
+                    return this->dgram_error_impl(
+                        error_case::connect,
+                        boost::asio::error::no_buffer_space);
+                }
+
+                if (post)
+                    boost::asio::post(this->dgram_sock().get_executor(),
+                                      [this]() { uring_submit_impl(); });
+
+                return;
+            }
+#endif
+            base_type::dgram_send_start(
+                endpoint, std::forward<MessageContainer>(message));
+        }
+
+      private:
+#if defined(O_NET_HAS_IO_URING)
+        // A datagram that was handed to the ring.
+        struct send_op {
+            endpoint_type remote;
+            MessageContainer message;
+            iovec iov{};
+            msghdr msg{};
+        };
+
+        bool uring_open_impl() {
+
+            bool ok = false;
+
+            ring_.apply([&](auto& ring) {
+                ok = ring.open(entries_, buffers_, buffer_size_) &&
+                     ring.arm_receive(this->dgram_sock().native_handle(),
+                                      endpoint_type().capacity()) &&
+                     ring.submit() >= 0;
+
+                if (ok)
+                    doorbell_.assign(ring.release_event_fd());
+                else
+                    ring.close();
+            });
+
+            if (!ok) return false;
+
+            rx_active_ = tx_active_ = true;
+
+            uring_wait_impl();
+
+            return true;
+        }
+
+        void uring_close_impl() {
+
+            if (!tx_active_) return;
+
+            rx_active_ = tx_active_ = false;
+
+            boost::system::error_code ec;
+            doorbell_.close(ec);
+
+            // Sends that did not complete yet are dropped.
+            ring_.apply([&](auto& ring) {
+                std::vector<io_uring_cqe> cqes;
+
+                ring.cancel(this->dgram_sock().native_handle(), cqes);
+
+                for (auto& cqe : cqes)
+                    if (cqe.user_data != detail::dgram_uring::receive_tag)
+                        delete reinterpret_cast<send_op*>(cqe.user_data);
+
+                ring.close();
+            });
+        }
+
+        void uring_submit_impl() {
+            ring_.apply([&](auto& ring) {
+                submit_posted_ = false;
+                if (ring.is_open()) ring.submit();
+            });
+        }
+
+        void uring_wait_impl() {
+            doorbell_.async_wait(
+                boost::asio::posix::descriptor_base::wait_read,
+                std::bind(&uring_datagram_device::on_uring_ready_impl, this,
+                          std::placeholders::_1));
+        }
+
+        // The eventfd signalled new completions. Reap them in batches and
+        // wait again.
+        void on_uring_ready_impl(boost::system::error_code ec) {
+
+            if (ec) return;
+
+            std::uint64_t signals;
+            while (::read(doorbell_.native_handle(), &signals,
+                          sizeof(signals)) > 0) {}
+
+            std::vector<io_uring_cqe> cqes;
+            cqes.reserve(64);
+
+            for (;;) {
+                cqes.clear();
+
+                ring_.apply([&](auto& ring) { ring.reap(cqes, 64); });
+
+                if (cqes.empty()) break;
+
+                on_uring_completions_impl(cqes);
+
+                if (!tx_active_) return;
+            }
+
+            uring_wait_impl();
+        }
+
+        void on_uring_completions_impl(std::vector<io_uring_cqe>& cqes) {
+
+            bool rearm = false;
+
+            views_.clear();
+            bids_.clear();
+
+            for (auto& cqe : cqes) {
+
+                if (cqe.user_data != detail::dgram_uring::receive_tag) {
+                    on_uring_sent_impl(cqe);
+                    continue;
+                }
+
+                // the multishot receive ended. It is armed again if it
+                // ended normally or ran out of buffers, a hard error stops
+                // receiving
+                if (cqe.res < 0) {
+                    if (on_uring_receive_error_impl(-cqe.res) &&
+                        !(cqe.flags & IORING_CQE_F_MORE))
+                        rearm = true;
+                    continue;
+                }
+
+                if (!(cqe.flags & IORING_CQE_F_MORE)) rearm = true;
+
+                rx_confirmed_ = true;
+
+                if (!(cqe.flags & IORING_CQE_F_BUFFER)) continue;
+
+                unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                bids_.push_back(bid);
+
+                add_view_impl(bid, cqe.res);
+            }
+
+            if (!views_.empty()) {
+                dgram_batch<Protocol> batch(views_.data(), views_.size());
+
+                std::size_t bytes = 0;
+                for (const auto& dgram : batch) bytes += dgram.size();
+
+                this->stats_in(batch.size(), bytes);
+                this->stats_handler([&] { this->on_dgram_batch(batch); });
+            }
+
+            if (!tx_active_) return;
+
+            ring_.apply([&](auto& ring) {
+                for (auto bid : bids_) ring.recycle(bid);
+
+                ring.publish_buffers();
+
+                if (rearm && rx_active_ &&
+                    ring.arm_receive(this->dgram_sock().native_handle(),
+                                     endpoint_type().capacity()) &&
+                    !submit_posted_)
+                    ring.submit();
+            });
+        }
+
+        void add_view_impl(unsigned bid, int size) {
+
+            char* buffer = nullptr;
+            msghdr* msg = nullptr;
+
+            ring_.apply([&](auto& ring) {
+                buffer = ring.buffer(bid);
+                msg = &ring.receive_msg();
+            });
+
+            auto* out = io_uring_recvmsg_validate(buffer, size, msg);
+
+            if (!out) return;
+
+            endpoint_type remote;
+            auto name_size = std::min<std::size_t>(out->namelen,
+                                                   remote.capacity());
+            std::memcpy(remote.data(), io_uring_recvmsg_name(out), name_size);
+            remote.resize(name_size);
+
+            views_.emplace_back(
+                static_cast<const char*>(io_uring_recvmsg_payload(out, msg)),
+                io_uring_recvmsg_payload_length(out, size, msg), remote);
+        }
+
+        // Returns true if the receive should be armed again.
+        bool on_uring_receive_error_impl(int error) {
+
+            // out of buffers, the receive is re-armed once they are
+            // returned
+            if (error == ENOBUFS) return true;
+
+            // no multishot receives on this kernel, receive through asio
+            // and keep the ring for sending.
+            if (error == EINVAL && !rx_confirmed_) {
+                rx_active_ = false;
+                base_type::dgram_receive_start();
+                return false;
+            }
+
+            if (error == ECANCELED) return false;
+
+            this->dgram_error_impl(
+                error_case::read,
+                boost::system::error_code(error,
+                                          boost::system::system_category()));
+            return false;
+        }
+
+        void on_uring_sent_impl(const io_uring_cqe& cqe) {
+
+            delete reinterpret_cast<send_op*>(cqe.user_data);
+
+            if (cqe.res < 0)
+                return this->dgram_error_impl(
+                    error_case::connect,
+                    boost::system::error_code(
+                        -cqe.res, boost::system::system_category()));
+
+            this->stats_out(1, static_cast<std::size_t>(cqe.res));
+
+            this->on_dgram_sent();
+        }
+
+        o::ccy::opt_safe_visitable<detail::dgram_uring, ConcurrencyOption>
+            ring_;
+        boost::asio::posix::stream_descriptor doorbell_;
+        std::vector<dgram_view<Protocol>> views_;
+        std::vector<unsigned> bids_;
+        bool submit_posted_ = false;
+        bool rx_confirmed_ = false;
+#endif
+        bool rx_active_ = false;
+        bool tx_active_ = false;
+        unsigned entries_ = 256;
+        unsigned buffers_ = 256;
+        std::size_t buffer_size_ = 4096;
+    };
+
+} // namespace o::io::net
@@ -0,0 +1,127 @@
+//
+// This file is part of the liboh project.
+//
+// Copyright (c) 2019, Jonas Ohland
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+
+/**
+ * @file
+ *
+ * A hashed timing wheel for large numbers of coarse timeouts
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace o::io {
+
+    /**
+     * A hashed timing wheel. Entries are scheduled a number of ticks ahead
+     * and handed back by advance() once the wheel reached their slot.
+     * Scheduling and expiring an entry is O(1), the wheel itself is ticked
+     * by its owner, usually from a single timer.
+     *
+     * Entries further ahead than the wheel spans are put into the last
+     * slot. The owner checks the real deadline of an expired entry and
+     * schedules it again if it is not due yet, which also makes it cheap
+     * to postpone a deadline: only the deadline is updated, the entry is
+     * moved when it expires.
+     *
+     * The slots keep their capacity, so the wheel does not allocate once
+     * it held its usual number of entries. Not thread-safe.
+     *
+     * @tparam  Entry   Type of the entries, should be cheap to copy.
+     */
+    template <typename Entry>
+    class timing_wheel {
+
+      public:
+        /**
+         * Constructor
+         *
+         * @param   slots   Number of slots, the number of ticks the wheel
+         *                  spans.
+         */
+        explicit timing_wheel(std::size_t slots)
+            : slots_(std::max<std::size_t>(slots, 1)) {}
+
+        /**
+         * Schedule an entry.
+         *
+         * @param   entry   The entry.
+         * @param   ticks   Number of ticks until the entry expires, at
+         *                  least 1 and at most slots().
+         */
+        void schedule(Entry entry, std::size_t ticks) {
+            ticks = std::clamp<std::size_t>(ticks, 1, slots_.size());
+            slots_[(cursor_ + ticks) % slots_.size()].push_back(
+                std::move(entry));
+            ++size_;
+        }
+
+        /**
+         * Advance the wheel by one tick.
+         *
+         * @param   expired Called with every entry of the slot that was
+         *                  reached. May schedule entries again.
+         *
+         * @returns The number of expired entries.
+         */
+        template <typename Function>
+        std::size_t advance(Function&& expired) {
+            cursor_ = (cursor_ + 1) % slots_.size();
+            ++now_;
+
+            // entries the callback schedules a full turn ahead go into the
+            // emptied slot
+            firing_.swap(slots_[cursor_]);
+            size_ -= firing_.size();
+
+            for (auto& entry : firing_) expired(entry);
+
+            auto count = firing_.size();
+            firing_.clear();
+            return count;
+        }
+
+        /** @returns The number of ticks so far. */
+        std::uint64_t now() const { return now_; }
+
+        /** @returns The number of scheduled entries. */
+        std::size_t size() const { return size_; }
+
+        /** @returns The number of slots. */
+        std::size_t slots() const { return slots_.size(); }
+
+      private:
+        std::vector<std::vector<Entry>> slots_;
+        std::vector<Entry> firing_;
+        std::size_t cursor_ = 0;
+        std::size_t size_ = 0;
+        std::uint64_t now_ = 0;
+    };
+
+} // namespace o::io
@@ -31,11 +31,16 @@
 #include <boost/tti/tti.hpp>
 #include <boost/type_traits/is_same.hpp>
 #include <mutex>
+#include <type_traits>
 
 #if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
 #define O_NET_POSIX
 #endif
 
+#if defined(__linux__)
+#define O_NET_LINUX
+#endif
+
 namespace o {
 
     namespace type_traits {
@@ -53,6 +58,16 @@ namespace o {
                   std::function<R(Args...)>,
                   std::reference_wrapper<
                       typename std::remove_reference<F>::type>> {};
+
+        // true for protocols that have v4() and v6(), like asio::ip::udp
+        template <typename Protocol, typename = void>
+        struct is_ip_protocol : std::false_type {};
+
+        template <typename Protocol>
+        struct is_ip_protocol<Protocol,
+                              std::void_t<decltype(Protocol::v4()),
+                                          decltype(Protocol::v6())>>
+            : std::true_type {};
     } // namespace type_traits
 
     namespace messages {
@@ -105,6 +120,11 @@ namespace o {
             struct statistics {};
         } // namespace features
 
+        // true if Feature is one of Features
+        template <typename Feature, typename... Features>
+        struct has_feature
+            : public std::disjunction<std::is_same<Feature, Features>...> {};
+
         template <typename Role, typename T = void>
         struct enable_for_client {};
 